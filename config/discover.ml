@@ -37,6 +37,9 @@ let configure t =
     | exception Not_found ->
        match pkg with Some p -> p.P.libs
                     | None -> libs_default sys in
+  (* Deadlines and the log file writer use POSIX threads. *)
+  let libs =
+    if sys = "msvc" || sys = "win64" then libs else libs @ ["-lpthread"] in
 
   (* Check for debug environment variable *)
   let debug = try ignore(Sys.getenv "OCAML_GAMMU_DEBUG"); true
@@ -1,6 +1,12 @@
 (* Sample program to be run as (say) a cron job to send an email for
    each SMS.  Use the unix command "mail" to send emails (see the
-   [mailto] function) to change that. *)
+   [mailto] function) to change that.
+
+   With --daemon, it keeps running, is woken up by incoming SMS
+   notifications and delivers the received messages, without starting
+   a process for each, either to a maildir or to the local MTA through
+   one "sendmail -bs" session per batch.  Delivered SMS are deleted from
+   the phone. *)
 
 open Printf
 open Scanf
@@ -11,6 +17,14 @@ type config = { gammurc: string;
                 pin : string;  (* "" for none *)
                 folder : int;
                 email : string;
+                delete : bool; (* delete the SMS once emailed *)
+                daemon : bool;
+                maildir : string; (* "" to use sendmail *)
+                batch : float;    (* seconds to gather SMS before delivery *)
+                interval : float; (* seconds between checks without
+                                     notification *)
+                part_timeout : float; (* seconds to wait for the missing
+                                         parts of a message *)
               }
 
 let config_file =
@@ -21,13 +35,36 @@ let config_file =
 let config = ref { gammurc = "";
                    pin = "";
                    folder = 0;
-                   email = "" }
+                   email = "";
+                   delete = false;
+                   daemon = false;
+                   maildir = "";
+                   batch = 2.;
+                   interval = 60.;
+                   part_timeout = 3600. }
 
 let spec = [
   ("--gammurc", Arg.String(fun rc -> config := { !config with gammurc = rc}),
    "<file> Force gammurc file path (override autodetection).");
   ("--folder", Arg.Int(fun i -> config := { !config with folder = i }),
    sprintf "<number> folder to check for SMS (default: %i)" !config.folder);
+  ("--delete", Arg.Unit(fun () -> config := { !config with delete = true }),
+   " delete the SMS from the phone once emailed.");
+  ("--daemon", Arg.Unit(fun () -> config := { !config with daemon = true }),
+   " keep running and deliver the SMS as they arrive (implies --delete).");
+  ("--maildir", Arg.String(fun d -> config := { !config with maildir = d }),
+   "<dir> with --daemon, deliver to this maildir instead of sendmail.");
+  ("--batch", Arg.Float(fun t -> config := { !config with batch = t }),
+   sprintf "<seconds> with --daemon, time to gather SMS after a \
+            notification (default: %g)" !config.batch);
+  ("--interval", Arg.Float(fun t -> config := { !config with interval = t }),
+   sprintf "<seconds> with --daemon, time between two checks without \
+            notification (default: %g)" !config.interval);
+  ("--part-timeout",
+   Arg.Float(fun t -> config := { !config with part_timeout = t }),
+   sprintf "<seconds> with --daemon, time to wait for the missing parts \
+            of a message before delivering it (default: %g)"
+           !config.part_timeout);
   ("--config", Arg.Set_string config_file,
    sprintf "<file> file used for configuration (default: %s)" !config_file);
 ]
@@ -44,7 +81,7 @@ let parse_config () =
   with Sys_error _ -> ()
 
 
-(* Simple function to send an email. *)
+(* Simple function to send an email.  Raise [Failure] if "mail" fails. *)
 let mailto ?(date="") ~subject msg =
   let msg_file, fh = Filename.open_temp_file "sms" ".txt" in
   output_string fh msg;
@@ -54,11 +91,13 @@ let mailto ?(date="") ~subject msg =
                       -s %S %S" subject !config.email in
   let mail = if date = "" then mail
              else sprintf "%s -a \"Date: %s\"" mail date in
-  ignore(Sys.command (mail ^ " < " ^ msg_file));
-  Sys.remove msg_file
+  let status = Sys.command (mail ^ " < " ^ Filename.quote msg_file) in
+  Sys.remove msg_file;
+  if status <> 0 then failwith(sprintf "mail exited with code %i" status)
 
 let mail_error ?(subject="ERROR") err =
-  mailto ~subject:("SMS to email: " ^ subject) err
+  try mailto ~subject:("SMS to email: " ^ subject) err
+  with Failure e -> eprintf "%s\n%s: %s\n%!" err subject e
 
 let get_security_status s =
   try Gammu.get_security_status s
@@ -124,8 +163,8 @@ let concat_sms sms =
   { date = msg1.date;  from = msg1.from;
     text = String.concat "" (List.map (fun m -> m.text) msg) }
 
-(* Put together the messages that were splitted into different SMS. *)
-let rec link_sms all_sms =
+(* Group the SMS that are parts of the same message. *)
+let rec group_sms all_sms =
   match all_sms with
   | [] -> []
   | sms :: tl ->
@@ -135,13 +174,35 @@ let rec link_sms all_sms =
      if hd.udh = ConcatenatedMessages then
        let same_id s = s.(0).udh_header.id8bit = hd.id8bit in
        let msg_sms, other = List.partition same_id all_sms in
-       concat_sms msg_sms :: link_sms other
+       msg_sms :: group_sms other
      else if hd.udh = ConcatenatedMessages16bit then
        let same_id s = s.(0).udh_header.id16bit = hd.id16bit in
        let msg_sms, other = List.partition same_id all_sms in
-       concat_sms msg_sms :: link_sms other
+       msg_sms :: group_sms other
      else
-       message_of_sms sms :: link_sms tl
+       [sms] :: group_sms tl
+
+(* Put together the messages that were splitted into different SMS. *)
+let link_sms all_sms = List.map concat_sms (group_sms all_sms)
+
+(* Whether the SMS was received (as opposed to sent, to send or draft). *)
+let received multi_sms =
+  match multi_sms.(0).SMS.state with
+  | SMS.Read | SMS.Unread -> true
+  | SMS.Sent | SMS.Unsent -> false
+
+(* Delete all parts of the messages [groups], [report] the failures. *)
+let delete_messages s report groups =
+  let locations =
+    List.concat (List.map (fun m ->
+                     Array.to_list (Array.map (fun p -> (p.SMS.folder,
+                                                         p.SMS.message_number))
+                                              m)) (List.concat groups)) in
+  List.iter2 (fun (_, loc) err ->
+      match err with
+      | Some e -> report loc e
+      | None -> ()
+    ) locations (G.SMS.delete_many s locations)
 
 let email_messages msgs =
   List.iter (fun msg ->
@@ -157,10 +218,26 @@ let read_all_sms s folder =
                         loc (Gammu.string_of_error e));
     Unix.sleep 1 in
   try
-    let all_sms = G.SMS.fold s ~folder ~on_err (fun l m -> m :: l) [] in
-    (* Filter out SMS that are already read. *)
-    let all_sms = List.filter (fun s -> s.(0).SMS.state = SMS.Unread) all_sms in
-    email_messages (link_sms all_sms)
+    if !config.delete then (
+      (* Only the received messages are emailed and deleted, one by one
+         so that only the ones successfully sent are deleted. *)
+      let all_sms = G.SMS.fold s ~folder ~on_err (fun l m -> m :: l) [] in
+      let all_sms = List.filter received all_sms in
+      let email parts =
+        try email_messages [concat_sms parts]; true
+        with Failure e | Sys_error e -> eprintf "%s\n%!" e; false in
+      let emailed = List.filter email (group_sms all_sms) in
+      delete_messages s (fun loc e ->
+          mail_error (sprintf "Failed to delete SMS at location %i: %s"
+                        loc (G.string_of_error e))) emailed
+    )
+    else (
+      let all_sms = G.SMS.fold s ~folder ~on_err (fun l m -> m :: l) [] in
+      (* Filter out SMS that are already read. *)
+      let all_sms = List.filter (fun s -> s.(0).SMS.state = SMS.Unread)
+                                all_sms in
+      email_messages (link_sms all_sms)
+    )
   with
   | G.Error G.NOTSUPPORTED ->
      mail_error "Sorry but your phone doesn't support GetNext."
@@ -168,6 +245,210 @@ let read_all_sms s folder =
      mail_error "Sorry but GetNext is not implemented."
 
 
+
+(* Daemon mode
+ ***********************************************************************)
+
+let months = [| "Jan"; "Feb"; "Mar"; "Apr"; "May"; "Jun"; "Jul"; "Aug";
+                "Sep"; "Oct"; "Nov"; "Dec" |]
+let days = [| "Sun"; "Mon"; "Tue"; "Wed"; "Thu"; "Fri"; "Sat" |]
+
+(* Day of the week of the SMS date, if valid. *)
+let week_day d =
+  let tm = { Unix.tm_sec = d.G.DateTime.second;  tm_min = d.G.DateTime.minute;
+             tm_hour = d.G.DateTime.hour;  tm_mday = d.G.DateTime.day;
+             tm_mon = d.G.DateTime.month - 1;
+             tm_year = d.G.DateTime.year - 1900;
+             tm_wday = 0;  tm_yday = 0;  tm_isdst = false } in
+  try Some (snd (Unix.mktime tm)).Unix.tm_wday
+  with Unix.Unix_error _ -> None
+
+let rfc2822_date d =
+  let tz = d.G.DateTime.timezone / 60 in
+  let day = match week_day d with
+    | Some wday -> days.(wday) ^ ", "
+    | None -> "" (* the day of the week is optional *) in
+  sprintf "%s%02d %s %04d %02d:%02d:%02d %c%02d%02d"
+          day d.G.DateTime.day
+          months.((d.G.DateTime.month + 11) mod 12) d.G.DateTime.year
+          d.G.DateTime.hour d.G.DateTime.minute d.G.DateTime.second
+          (if tz < 0 then '-' else '+') (abs tz / 60) (abs tz mod 60)
+
+let email_of_message msg =
+  sprintf "From: SMS <SMS@localhost>\nTo: %s\nSubject: SMS from %s on %s\n\
+           Date: %s\nMIME-Version: 1.0\n\
+           Content-Type: text/plain; charset=utf-8\n\
+           Content-Transfer-Encoding: 8bit\n\n%s\n"
+          !config.email msg.from (G.DateTime.os_date_time msg.date)
+          (rfc2822_date msg.date) msg.text
+
+(* Maildir delivery: write in tmp/ then move to new/, no process is
+   started. *)
+let maildir_deliver dir =
+  let sub d = Filename.concat dir d in
+  List.iter (fun d -> try Unix.mkdir d 0o700
+                      with Unix.Unix_error(Unix.EEXIST, _, _) -> ())
+            [dir; sub "tmp"; sub "new"; sub "cur"];
+  let host = Unix.gethostname () and count = ref 0 in
+  fun msg ->
+  incr count;
+  let name = sprintf "%.6f.P%dQ%d.%s" (Unix.gettimeofday ()) (Unix.getpid ())
+                     !count host in
+  let tmp = Filename.concat (sub "tmp") name in
+  try
+    let fh = open_out_bin tmp in
+    output_string fh (email_of_message msg);
+    close_out fh;
+    Unix.rename tmp (Filename.concat (sub "new") name);
+    true
+  with Sys_error _ | Unix.Unix_error _ -> false
+
+(* SMTP delivery through a "sendmail -bs" process kept open between
+   messages. *)
+let smtp = ref None
+
+let rec smtp_reply ic =
+  let l = input_line ic in
+  if String.length l > 3 && l.[3] = '-' then smtp_reply ic (* continued *)
+  else l
+
+let smtp_check ic expect =
+  let r = smtp_reply ic in
+  if String.length r < 3 || r.[0] <> expect then failwith r
+
+let smtp_command (ic, oc) cmd expect =
+  output_string oc cmd;
+  output_string oc "\r\n";
+  flush oc;
+  smtp_check ic expect
+
+let smtp_session () =
+  match !smtp with
+  | Some c -> c
+  | None ->
+     let (ic, _) as c = Unix.open_process "sendmail -bs" in
+     smtp := Some c;
+     smtp_check ic '2';
+     smtp_command c "HELO localhost" '2';
+     c
+
+let smtp_close () =
+  match !smtp with
+  | Some c -> smtp := None; ignore(try Unix.close_process c
+                                   with Unix.Unix_error _ -> Unix.WEXITED 0)
+  | None -> ()
+
+let smtp_deliver msg =
+  try
+    let (_, oc) as c = smtp_session () in
+    smtp_command c "MAIL FROM:<SMS@localhost>" '2';
+    smtp_command c (sprintf "RCPT TO:<%s>" !config.email) '2';
+    smtp_command c "DATA" '3';
+    (* CRLF line endings and dot-stuffing. *)
+    let line_start = ref true in
+    String.iter (fun ch ->
+        if !line_start && ch = '.' then output_char oc '.';
+        if ch = '\n' then output_string oc "\r\n" else output_char oc ch;
+        line_start := ch = '\n'
+      ) (email_of_message msg);
+    smtp_command c "." '2';
+    true
+  with Failure _ | End_of_file | Sys_error _ ->
+    (* Start a new session for the next message. *)
+    smtp_close ();
+    false
+
+(* Concatenated messages are only delivered once all their parts have
+   been received, or after [part_timeout]. *)
+let first_seen = Hashtbl.create 16
+
+let concat_key multi_sms =
+  let open SMS in
+  let hd = multi_sms.(0).udh_header in
+  if hd.udh = ConcatenatedMessages then
+    Some(multi_sms.(0).number, hd.id8bit, hd.all_parts)
+  else if hd.udh = ConcatenatedMessages16bit then
+    Some(multi_sms.(0).number, hd.id16bit, hd.all_parts)
+  else None
+
+let complete_messages now all_sms =
+  let groups = Hashtbl.create 16 in
+  let ready = ref [] in
+  List.iter (fun sms ->
+      match concat_key sms with
+      | None -> ready := [sms] :: !ready
+      | Some k ->
+         let parts = try Hashtbl.find groups k with Not_found -> [] in
+         Hashtbl.replace groups k (sms :: parts)
+    ) all_sms;
+  Hashtbl.iter (fun ((_, _, all_parts) as k) parts ->
+      let seen = try Hashtbl.find first_seen k
+                 with Not_found -> Hashtbl.add first_seen k now; now in
+      if List.length parts >= all_parts
+         || now -. seen > !config.part_timeout then (
+        Hashtbl.remove first_seen k;
+        ready := parts :: !ready
+      )
+    ) groups;
+  !ready
+
+let deliver_batch s deliver =
+  let on_err loc e =
+    eprintf "Failed to get SMS next to location %i: %s\n%!"
+            loc (G.string_of_error e) in
+  let all_sms = G.SMS.fold s ~folder:!config.folder ~on_err
+                           (fun l m -> if received m then m :: l else l) [] in
+  let delivered = ref [] and latency = ref [] in
+  List.iter (fun parts ->
+      let msg = concat_sms parts in
+      if deliver msg then (
+        delivered := parts :: !delivered;
+        (* The epoch takes the time zone of the date into account. *)
+        match G.DateTime.epoch msg.date with
+        | 0L -> ()
+        | t ->
+           let t = Int64.to_float t in
+           latency := (Unix.gettimeofday () -. t) :: !latency
+      )
+    ) (complete_messages (Unix.gettimeofday ()) all_sms);
+  delete_messages s (fun loc e ->
+      eprintf "Failed to delete SMS at location %i: %s\n%!"
+              loc (G.string_of_error e)) !delivered;
+  match !latency with
+  | [] -> ()
+  | l ->
+     let n = List.length l in
+     printf "%i message(s) delivered, latency: mean %.1fs, max %.1fs\n%!" n
+            (List.fold_left (+.) 0. l /. float n)
+            (List.fold_left max neg_infinity l)
+
+let run_daemon s =
+  let deliver = if !config.maildir = "" then smtp_deliver
+                else maildir_deliver !config.maildir in
+  (* Time of the first notification not dealt with yet. *)
+  let notified = ref None in
+  (try G.incoming_sms s (fun _ ->
+           if !notified = None then notified := Some(Unix.gettimeofday ()))
+   with G.Error G.UNKNOWN | G.Error G.NOTSUPPORTED ->
+     eprintf "No SMS notification, checking every %gs.\n%!" !config.interval);
+  let next_check = ref 0. in
+  while true do
+    ignore(G.read_device s ~wait_for_reply:false);
+    let now = Unix.gettimeofday () in
+    let due = match !notified with
+      | Some t -> now -. t >= !config.batch
+      | None -> now >= !next_check in
+    if due then (
+      notified := None;
+      next_check := now +. !config.interval;
+      deliver_batch s deliver;
+      (* Do not keep the MTA session open while idle. *)
+      smtp_close ()
+    )
+    else ignore(Unix.select [] [] [] 0.2)
+  done
+
+
 let () =
   let usage_msg = sprintf "Usage: %s [options] <to email>" Sys.argv.(0) in
   let anon s = config := { !config with email = s } in
@@ -177,6 +458,8 @@ let () =
   try
     let s = Gammu.make () in
     Gammu.connect s;
-    check_sec_status_and_do s (fun () -> read_all_sms s !config.folder)
+    check_sec_status_and_do s (fun () ->
+        if !config.daemon then run_daemon s
+        else read_all_sms s !config.folder)
   with Gammu.Error e -> printf "Error: %s\n" (Gammu.string_of_error e)
 
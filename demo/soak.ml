@@ -0,0 +1,73 @@
+(* Soak test of the memory management: creates and drops many state
+   machines and parsed gammurc files, releasing half of them with
+   [Gammu.free] and leaving the others to the GC, then pushes, removes
+   and reads configurations many times.  It prints the resident memory,
+   which must stay stable.  No phone is needed. *)
+open Printf
+
+(* Linux only, the second field is in pages (assumed of 4 KB). *)
+let resident_kb () =
+  try
+    let ic = open_in "/proc/self/statm" in
+    let rss = Scanf.sscanf (input_line ic) "%d %d" (fun _ r -> r * 4) in
+    close_in ic;
+    rss
+  with Sys_error _ | End_of_file | Scanf.Scan_failure _ -> 0
+
+let check_freed name f =
+  match f () with
+  | _ -> printf "%s: use after free not detected!\n" name; exit 1
+  | exception Invalid_argument _ -> ()
+
+let report name every start i =
+  if i mod every = 0 then (
+    let rss = resident_kb () in
+    printf "%s %8d: %d KB resident (%+d KB)\n%!" name i rss (rss - start)
+  )
+
+let () =
+  let path = ref "demo/gammurc"
+  and n = ref 10_000
+  and configs = ref 1_000_000 in
+  let args = [
+    ("--gammurc", Arg.Set_string path, "<file> gammurc file to read.");
+    ("-n", Arg.Set_int n,
+     "<integer> Number of state machines (default 10000).");
+    ("--configs", Arg.Set_int configs,
+     "<integer> Number of configurations (default 1000000).");
+  ] in
+  let anon _ = raise (Arg.Bad "No anonymous arguments.") in
+  Arg.parse (Arg.align args) anon (sprintf "Usage: %s [options]" Sys.argv.(0));
+  let s = Gammu.make ~path:!path () in
+  Gammu.free s;
+  Gammu.free s;
+  check_freed "Gammu.free" (fun () -> Gammu.length_config s);
+  let ini = Gammu.INI.read !path in
+  Gammu.INI.free ini;
+  check_freed "Gammu.INI.free" (fun () -> Gammu.INI.config ini 0);
+  let start = resident_kb () in
+  for i = 1 to !n do
+    let ini = Gammu.INI.read !path in
+    let s = Gammu.make ~path:!path () in
+    Gammu.push_config s (Gammu.INI.config ini 0);
+    if i land 1 = 0 then (
+      Gammu.free s;
+      Gammu.INI.free ini
+    );
+    report "machines" 1000 start i
+  done;
+  Gc.full_major ();
+  printf "After a full major GC: %d KB resident (start: %d KB)\n%!"
+    (resident_kb ()) start;
+  (* Configuration strings are owned by the slots of the stack. *)
+  let ini = Gammu.INI.read !path in
+  let s = Gammu.make ~path:!path () in
+  let start = resident_kb () in
+  for i = 1 to !configs do
+    let cfg = Gammu.INI.config ini 0 in
+    Gammu.push_config s { cfg with Gammu.debug_file = string_of_int i };
+    Gammu.remove_config s;
+    report "configs" 100_000 start i
+  done;
+  Gammu.free s;
+  Gammu.INI.free ini
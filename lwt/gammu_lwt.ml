@@ -0,0 +1,241 @@
+(* File: gammu_lwt.ml
+
+   Part of ocaml-gammu, see gammu.opam for the authors.
+
+   This library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details. *)
+
+open Lwt.Infix
+
+type 'a outcome = Value of 'a | Exn of exn
+
+type event =
+  | Incoming_sms of Gammu.SMS.message
+  | Incoming_call of Gammu.Call.call
+
+type t = {
+  sm : Gammu.t;
+  max_pending : int;
+  poll_interval : float;
+  (* Shared with the worker thread, protected by [mutex]. *)
+  mutex : Mutex.t;
+  jobs : (Gammu.t -> unit) Queue.t;
+  events : event Queue.t;
+  mutable polling : bool;       (* Whether the idle worker reads the
+                                   phone for incoming events. *)
+  mutable stopping : bool;
+  (* The worker waits for jobs on [wake_in]. *)
+  wake_in : Unix.file_descr;
+  wake_out : Unix.file_descr;
+  (* Only used by the Lwt thread. *)
+  mutable closed : bool;
+  mutable pending : int;
+  room : unit Lwt_condition.t;
+  events_id : int;              (* Notification of new [events]. *)
+  stopped : unit Lwt.t;
+  sms_stream : Gammu.SMS.message Lwt_stream.t;
+  push_sms : Gammu.SMS.message option -> unit;
+  mutable sms_enabled : bool;
+  call_stream : Gammu.Call.call Lwt_stream.t;
+  push_call : Gammu.Call.call option -> unit;
+  mutable call_enabled : bool;
+}
+
+let with_lock w f =
+  Mutex.lock w.mutex;
+  match f () with
+  | r -> Mutex.unlock w.mutex; r
+  | exception e -> Mutex.unlock w.mutex; raise e
+
+let wake w =
+  (* The worker drains the pipe before each wait and at most
+     [max_pending] jobs are queued, so the write does not block. *)
+  ignore(Unix.single_write w.wake_out (Bytes.make 1 'j') 0 1)
+
+let rec worker w stopped_id =
+  let next () =
+    if not(Queue.is_empty w.jobs) then `Job(Queue.pop w.jobs)
+    else if w.stopping then `Stop
+    else `Wait w.polling in
+  match with_lock w next with
+  | `Job job -> job w.sm; worker w stopped_id
+  | `Stop -> Lwt_unix.send_notification stopped_id
+  | `Wait polling ->
+     if polling then
+       (* The callbacks are called by [read_device], see [add_event]. *)
+       (try ignore(Gammu.read_device ~wait_for_reply:false w.sm)
+        with Gammu.Error _ -> ());
+     let timeout = if polling then w.poll_interval else -1. in
+     let buf = Bytes.create 64 in
+     (match Unix.select [w.wake_in] [] [] timeout with
+      | [], _, _ -> ()
+      | _ -> ignore(Unix.read w.wake_in buf 0 (Bytes.length buf))
+      | exception Unix.Unix_error(Unix.EINTR, _, _) -> ());
+     worker w stopped_id
+
+(* Called in the worker thread. *)
+let add_event w e =
+  with_lock w (fun () -> Queue.add e w.events);
+  Lwt_unix.send_notification w.events_id
+
+let deliver_events w () =
+  let events = with_lock w (fun () ->
+                   let q = Queue.create () in
+                   Queue.transfer w.events q;
+                   q) in
+  Queue.iter (function
+      | Incoming_sms sms -> w.push_sms (Some sms)
+      | Incoming_call call -> w.push_call (Some call)) events
+
+let create ?(max_pending=16) ?(poll_interval=1.) sm =
+  if max_pending < 1 || max_pending > 4096 then
+    invalid_arg "Gammu_lwt.create: max_pending must be in 1 .. 4096";
+  if poll_interval <= 0. then
+    invalid_arg "Gammu_lwt.create: poll_interval <= 0";
+  let wake_in, wake_out = Unix.pipe () in
+  Unix.set_nonblock wake_in;
+  let stopped, stopped_wakener = Lwt.wait () in
+  let stopped_id = Lwt_unix.make_notification ~once:true
+                     (fun () -> Lwt.wakeup stopped_wakener ()) in
+  let sms_stream, push_sms = Lwt_stream.create () in
+  let call_stream, push_call = Lwt_stream.create () in
+  let deliver = ref (fun () -> ()) in
+  let w = {
+    sm; max_pending; poll_interval;
+    mutex = Mutex.create ();
+    jobs = Queue.create ();
+    events = Queue.create ();
+    polling = false; stopping = false;
+    wake_in; wake_out;
+    closed = false; pending = 0;
+    room = Lwt_condition.create ();
+    events_id = Lwt_unix.make_notification (fun () -> !deliver ());
+    stopped;
+    sms_stream; push_sms; sms_enabled = false;
+    call_stream; push_call; call_enabled = false;
+  } in
+  deliver := deliver_events w;
+  ignore(Thread.create (worker w) stopped_id);
+  w
+
+let machine w = w.sm
+
+let pending w = w.pending
+
+let rec wait_room w =
+  if w.pending < w.max_pending then Lwt.return_unit
+  else Lwt_condition.wait w.room >>= fun () -> wait_room w
+
+let run w f =
+  if w.closed then Lwt.fail(Invalid_argument "Gammu_lwt.run: closed worker")
+  else
+    wait_room w >>= fun () ->
+    if w.closed then
+      Lwt.fail(Invalid_argument "Gammu_lwt.run: closed worker")
+    else (
+      let result, wakener = Lwt.wait () in
+      let outcome = ref (Exn Exit) in
+      let id = Lwt_unix.make_notification ~once:true (fun () ->
+                   w.pending <- w.pending - 1;
+                   Lwt_condition.signal w.room ();
+                   match !outcome with
+                   | Value v -> Lwt.wakeup wakener v
+                   | Exn e -> Lwt.wakeup_exn wakener e) in
+      let job sm =
+        outcome := (try Value(f sm) with e -> Exn e);
+        Lwt_unix.send_notification id in
+      w.pending <- w.pending + 1;
+      with_lock w (fun () -> Queue.add job w.jobs);
+      wake w;
+      result
+    )
+
+let close w =
+  if w.closed then w.stopped
+  else (
+    w.closed <- true;
+    (* The callers of [run] waiting for room fail. *)
+    Lwt_condition.broadcast w.room ();
+    with_lock w (fun () -> w.stopping <- true);
+    wake w;
+    w.stopped >>= fun () ->
+    Lwt_unix.stop_notification w.events_id;
+    (* Events received by the last operations. *)
+    deliver_events w ();
+    w.push_sms None;
+    w.push_call None;
+    Unix.close w.wake_in;
+    Unix.close w.wake_out;
+    Lwt.return_unit
+  )
+
+let start_polling w = with_lock w (fun () -> w.polling <- true)
+
+let incoming_sms w =
+  if w.sms_enabled then Lwt.return w.sms_stream
+  else
+    run w (fun sm ->
+        Gammu.incoming_sms sm (fun sms -> add_event w (Incoming_sms sms));
+        start_polling w)
+    >>= fun () ->
+    w.sms_enabled <- true;
+    Lwt.return w.sms_stream
+
+let incoming_call w =
+  if w.call_enabled then Lwt.return w.call_stream
+  else
+    run w (fun sm ->
+        Gammu.incoming_call sm (fun call -> add_event w (Incoming_call call));
+        start_polling w)
+    >>= fun () ->
+    w.call_enabled <- true;
+    Lwt.return w.call_stream
+
+
+module Info =
+struct
+  module I = Gammu.Info
+
+  let battery_charge ?timeout w = run w (I.battery_charge ?timeout)
+  let firmware ?timeout w = run w (I.firmware ?timeout)
+  let hardware ?timeout w = run w (I.hardware ?timeout)
+  let imei ?timeout w = run w (I.imei ?timeout)
+  let imsi ?timeout w = run w (I.imsi ?timeout)
+  let manufacture_month ?timeout w = run w (I.manufacture_month ?timeout)
+  let manufacturer ?timeout w = run w (I.manufacturer ?timeout)
+  let model ?timeout w = run w (I.model ?timeout)
+  let model_info ?timeout w = run w (I.model_info ?timeout)
+  let network_info ?timeout w = run w (I.network_info ?timeout)
+  let product_code ?timeout w = run w (I.product_code ?timeout)
+  let signal_quality ?timeout w = run w (I.signal_quality ?timeout)
+end
+
+module SMS =
+struct
+  module S = Gammu.SMS
+
+  let get ?timeout w ~folder ~message_number =
+    run w (fun sm -> S.get ?timeout sm ~folder ~message_number)
+
+  let fold w ?folder ?n ?retries ?timeout ?on_err f a =
+    run w (fun sm -> S.fold sm ?folder ?n ?retries ?timeout ?on_err f a)
+
+  let send ?timeout w sms = run w (fun sm -> S.send ?timeout sm sms)
+
+  let delete ?timeout w ~folder ~message_number =
+    run w (fun sm -> S.delete ?timeout sm ~folder ~message_number)
+
+  let delete_many ?timeout w locations =
+    run w (fun sm -> S.delete_many ?timeout sm locations)
+
+  let get_status ?timeout w = run w (S.get_status ?timeout)
+
+  let folders ?timeout w = run w (S.folders ?timeout)
+end
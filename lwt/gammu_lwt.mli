@@ -0,0 +1,120 @@
+(* File: gammu_lwt.mli
+
+   Part of ocaml-gammu, see gammu.opam for the authors.
+
+   This library is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details. *)
+
+
+(** Lwt interface to {!Gammu}.
+
+    Each phone gets a worker: a system thread executing, one at a
+    time and in the order they were queued, the operations on its
+    state machine.  libGammu waits for the phone without the runtime
+    lock, so the Lwt main loop and the workers of the other phones keep
+    running.  Once given to {!create}, a state machine must only be
+    used through its worker.
+
+    This library is installed as [gammu.lwt] when Lwt is available. *)
+
+type t
+(** Worker of a state machine. *)
+
+val create : ?max_pending:int -> ?poll_interval:float -> Gammu.t -> t
+(** [create s] starts a worker for the state machine [s], which may be
+    connected or not.
+
+    @param max_pending the number of operations that may be queued or
+    running at once (default: [16]).  Further calls of {!run} wait for
+    one of them to complete.
+
+    @param poll_interval once incoming events are requested (see
+    {!incoming_sms}), the interval, in seconds, at which the idle
+    worker polls the phone with {!Gammu.read_device} (default: [1.]). *)
+
+val machine : t -> Gammu.t
+(** [machine w] returns the state machine of [w]. *)
+
+val pending : t -> int
+(** [pending w] returns the number of operations of [w] queued or
+    running. *)
+
+val run : t -> (Gammu.t -> 'a) -> 'a Lwt.t
+(** [run w f] queues [f] and returns a promise resolved with [f s] (or
+    rejected with its exception), where [s] is the state machine of
+    [w].  [f] runs in the worker thread: it must not use Lwt.  The
+    promise is pending until there is room in the queue, see
+    [max_pending].
+
+    @raise Invalid_argument (in the promise) if [w] is closed. *)
+
+val close : t -> unit Lwt.t
+(** [close w] stops [w] once the operations already queued are done and
+    ends the streams of incoming events.  The state machine is neither
+    disconnected nor freed.  Closing [w] again does nothing. *)
+
+
+(** {2 Events} *)
+
+val incoming_sms : t -> Gammu.SMS.message Lwt_stream.t Lwt.t
+(** [incoming_sms w] enables the notification of incoming SMS (see
+    {!Gammu.incoming_sms}) and returns the stream of the received
+    messages.  All calls return the same stream.
+
+    @raise Gammu.Error (in the promise) if the phone does not support
+    the notifications. *)
+
+val incoming_call : t -> Gammu.Call.call Lwt_stream.t Lwt.t
+(** [incoming_call w] is like {!incoming_sms} for the incoming calls. *)
+
+
+(** {2 Operations} *)
+
+(** The functions of {!Gammu.Info} through a worker. *)
+module Info :
+sig
+  val battery_charge : ?timeout:float -> t -> Gammu.Info.battery_charge Lwt.t
+  val firmware : ?timeout:float -> t -> Gammu.Info.firmware Lwt.t
+  val hardware : ?timeout:float -> t -> string Lwt.t
+  val imei : ?timeout:float -> t -> string Lwt.t
+  val imsi : ?timeout:float -> t -> string Lwt.t
+  val manufacture_month : ?timeout:float -> t -> string Lwt.t
+  val manufacturer : ?timeout:float -> t -> string Lwt.t
+  val model : ?timeout:float -> t -> string Lwt.t
+  val model_info : ?timeout:float -> t -> Gammu.Info.phone_model Lwt.t
+  val network_info : ?timeout:float -> t -> Gammu.Info.network Lwt.t
+  val product_code : ?timeout:float -> t -> string Lwt.t
+  val signal_quality : ?timeout:float -> t -> Gammu.Info.signal_quality Lwt.t
+end
+
+(** The functions of {!Gammu.SMS} through a worker. *)
+module SMS :
+sig
+  val get : ?timeout:float -> t -> folder:int -> message_number:int ->
+    Gammu.SMS.multi_sms Lwt.t
+
+  val fold : t -> ?folder:int -> ?n:int -> ?retries:int -> ?timeout:float ->
+    ?on_err:(int -> Gammu.error -> unit) ->
+    ('a -> Gammu.SMS.multi_sms -> 'a) -> 'a -> 'a Lwt.t
+  (** [fold w f a] is {!Gammu.SMS.fold} run as a single operation.  [f]
+      and [on_err] run in the worker thread, they must not use Lwt. *)
+
+  val send : ?timeout:float -> t -> Gammu.SMS.message -> unit Lwt.t
+
+  val delete : ?timeout:float -> t -> folder:int -> message_number:int ->
+    unit Lwt.t
+
+  val delete_many : ?timeout:float -> t -> (int * int) list ->
+    Gammu.error option list Lwt.t
+
+  val get_status : ?timeout:float -> t -> Gammu.SMS.memory_status Lwt.t
+
+  val folders : ?timeout:float -> t -> Gammu.SMS.folder array Lwt.t
+end
@@ -114,6 +114,7 @@ type error =
   | INI_KEY_NOT_FOUND   (** Pair section/value not found in INI file. *)
   | COULD_NOT_DECODE    (** Decoding SMS Message failed. *)
   | INVALID_CONFIG_NUM  (** Invalid config number. *)
+  | DEADLINE_EXCEEDED   (** Operation aborted by {!Gammu.with_timeout}. *)
 
 external string_of_error : error -> string = "caml_gammu_GSM_ErrorString"
 
@@ -195,6 +196,7 @@ let string_for_uncaught_Error = function
   | INI_KEY_NOT_FOUND   -> "Gammu.Error(INI_KEY_NOT_FOUND)"
   | COULD_NOT_DECODE    -> "Gammu.Error(COULD_NOT_DECODE)"
   | INVALID_CONFIG_NUM  -> "Gammu.Error(INVALID_CONFIG_NUM)"
+  | DEADLINE_EXCEEDED   -> "Gammu.Error(DEADLINE_EXCEEDED)"
 
 let () =
   Callback.register_exception "Gammu.GSM_Error" (Error DEVICEOPENERROR);
@@ -222,8 +224,19 @@ struct
   external set_global : info -> bool -> unit
     = "caml_gammu_GSM_SetDebugGlobal"
 
-  external set_output : info -> out_channel -> unit
+  external channel_descriptor : out_channel -> int = "caml_channel_descriptor"
+
+  external _set_output : info -> int -> unit
     = "caml_gammu_GSM_SetDebugFileDescriptor"
+  let set_output di ch =
+    flush ch;
+    _set_output di (channel_descriptor ch)
+
+  external _set_output_buffer : info -> int -> unit
+    = "caml_gammu_set_debug_buffer"
+  let set_output_buffer di ~size = _set_output_buffer di size
+
+  external snapshot : info -> string = "caml_gammu_debug_buffer_snapshot"
 
   external set_level : info -> string -> unit
     = "caml_gammu_GSM_SetDebugLevel"
@@ -288,23 +301,50 @@ struct
   type sections = {
     head : section_node;
     unicode : bool;
+    entries : (string * (string * string) array) array Lazy.t;
+    index : (string * string, string) Hashtbl.t option;
   }
 
+  external _entries : section_node -> bool ->
+                      (string * (string * string) array) array
+    = "caml_gammu_INI_entries"
+
+  (* libGammu compares section and key names ignoring (ASCII) case. *)
+  let lowercase s =
+    String.map (function
+        | 'A' .. 'Z' as c -> Char.unsafe_chr (Char.code c + 32)
+        | c -> c) s
+
+  let make_index entries =
+    let h = Hashtbl.create 64 in
+    Array.iter (fun (section, keys) ->
+        let section = lowercase section in
+        Array.iter (fun (key, v) ->
+            let k = (section, lowercase key) in
+            (* Like INI_GetValue, the first entry wins. *)
+            if not(Hashtbl.mem h k) then Hashtbl.add h k v) keys
+      ) entries;
+    h
+
+  let make head unicode index =
+    let entries = lazy (_entries head unicode) in
+    { head = head; unicode = unicode; entries = entries;
+      index = if index then Some(make_index (Lazy.force entries)) else None }
+
   external _read : string -> bool -> section_node = "caml_gammu_INI_ReadFile"
-  let read ?(unicode=false) file_name =
-    { head = _read file_name unicode;
-      unicode = unicode; }
+  let read ?(unicode=false) ?(index=false) file_name =
+    make (_read file_name unicode) unicode index
 
   external _find_gammurc_force : string -> section_node
     = "caml_gammu_GSM_FindGammuRC_force"
   external _find_gammurc : unit -> section_node = "caml_gammu_GSM_FindGammuRC"
-  let of_gammurc ?path () =
+  let of_gammurc ?path ?(index=false) () =
     let s_node = match path with
       | None -> _find_gammurc ()
       | Some path -> _find_gammurc_force path
     in
     (* TODO: Check if can set a better unicode flag. *)
-    { head = s_node; unicode=false; }
+    make s_node false index
 
   external _config_of_ini : section_node -> int -> config
     = "caml_gammu_GSM_ReadConfig"
@@ -312,10 +352,29 @@ struct
   let config cfg_info num =
     _config_of_ini cfg_info.head num
 
+  external _free : section_node -> unit = "caml_gammu_INI_free"
+  let free file_info = _free file_info.head
+
   external _get_value : section_node -> string -> string -> bool -> string
     = "caml_gammu_INI_GetValue"
   let get_value file_info ~section ~key =
-    _get_value file_info.head section key file_info.unicode
+    match file_info.index with
+    | Some h ->
+       (try Hashtbl.find h (lowercase section, lowercase key)
+        with Not_found -> raise(Error INI_KEY_NOT_FOUND))
+    | None -> _get_value file_info.head section key file_info.unicode
+
+  let find file_info ~section ~key =
+    try Some(get_value file_info ~section ~key)
+    with Error INI_KEY_NOT_FOUND -> None
+
+  let sections file_info =
+    Array.to_list (Array.map fst (Lazy.force file_info.entries))
+
+  let fold file_info f a =
+    Array.fold_left (fun a (section, keys) ->
+        Array.fold_left (fun a (key, v) -> f a section key v) a keys
+      ) a (Lazy.force file_info.entries)
 
 end
 
@@ -334,6 +393,167 @@ let init_locales ?path () = match path with
 
 external alloc_state_machine : unit -> t = "caml_gammu_GSM_AllocStateMachine"
 
+module Log =
+struct
+  type record = {
+    time : float;
+    text : string;
+  }
+
+  external now : unit -> float = "caml_gammu_monotonic_time"
+
+  external _enable : t -> string option -> int -> string option -> unit
+    = "caml_gammu_log_enable"
+  let enable ?level ?(capacity=1024) ?file s =
+    _enable s level capacity file
+
+  external disable : t -> unit = "caml_gammu_log_disable"
+
+  external drain : t -> record array = "caml_gammu_log_drain"
+
+  external dropped : t -> int = "caml_gammu_log_dropped"
+
+  external _log_function : t -> (string -> unit) option
+    = "caml_gammu_log_function"
+
+  let flush s = match _log_function s with
+    | None -> ()
+    | Some f -> Array.iter (fun r -> f r.text) (drain s)
+end
+
+module Trace =
+struct
+  (* WARNING: must be in sync with TRACE_* in gammu_stubs.h *)
+  type kind = Call | Sent | Received
+
+  type event = {
+    kind : kind;
+    stub : string;
+    start : float;
+    duration : float;
+    size : int;
+    label : string;
+  }
+
+  external _start : t -> int -> string option -> unit
+    = "caml_gammu_trace_start"
+  let start ?(capacity=4096) ?(level="text") s =
+    _start s capacity (Some level)
+
+  external stop : t -> unit = "caml_gammu_trace_stop"
+
+  external events : t -> event array = "caml_gammu_trace_events"
+
+  external dropped : t -> int = "caml_gammu_trace_dropped"
+
+  let json_string s =
+    let b = Buffer.create (String.length s + 2) in
+    Buffer.add_char b '"';
+    let add_char = function
+      | '"' -> Buffer.add_string b "\\\""
+      | '\\' -> Buffer.add_string b "\\\\"
+      | '\000' .. '\031' as c ->
+         Buffer.add_string b (Printf.sprintf "\\u%04x" (Char.code c))
+      | c -> Buffer.add_char b c in
+    String.iter add_char s;
+    Buffer.add_char b '"';
+    Buffer.contents b
+
+  let output_chrome ?(pid=1) ch events =
+    let events = Array.copy events in
+    Array.stable_sort (fun e1 e2 -> compare e1.start e2.start) events;
+    let first = ref true in
+    let emit ~name ~tid ~start ~duration args =
+      if !first then first := false else output_string ch ",\n";
+      Printf.fprintf ch "{\"name\":%s,\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\
+                         \"ts\":%.0f,\"dur\":%.0f,\"args\":{%s}}"
+        (json_string name) pid tid (start *. 1e6) (duration *. 1e6) args in
+    (* A frame sent and the frames received until the next one sent are
+       shown as one exchange, to see the latency of each command. *)
+    let exchange = ref None in
+    let close_exchange () = match !exchange with
+      | Some (sent, stop, received) ->
+         let name = if sent.label = "" then sent.stub else sent.label in
+         emit ~name ~tid:2 ~start:sent.start ~duration:(stop -. sent.start)
+           (Printf.sprintf "\"stub\":%s,\"sent\":%d,\"received\":%d"
+              (json_string sent.stub) sent.size received);
+         exchange := None
+      | None -> () in
+    output_string ch "{\"traceEvents\":[\n";
+    Array.iter (fun e ->
+        match e.kind with
+        | Call ->
+           emit ~name:e.stub ~tid:1 ~start:e.start ~duration:e.duration ""
+        | Sent ->
+           close_exchange();
+           exchange := Some(e, e.start, 0)
+        | Received ->
+           match !exchange with
+           | Some(sent, _, received) ->
+              exchange := Some(sent, e.start, received + max e.size 0)
+           | None ->
+              emit ~name:(if e.label = "" then e.stub else e.label) ~tid:2
+                ~start:e.start ~duration:0.
+                (Printf.sprintf "\"stub\":%s,\"received\":%d"
+                   (json_string e.stub) e.size)
+      ) events;
+    close_exchange();
+    output_string ch "],\n\"displayTimeUnit\":\"ms\"}\n"
+end
+
+external _watchdog_arm : t -> float -> bool = "caml_gammu_watchdog_arm"
+external _watchdog_disarm : t -> bool = "caml_gammu_watchdog_disarm"
+
+let with_timeout s timeout f =
+  if _watchdog_arm s timeout then (
+    match f () with
+    | r ->
+      (* A deadline expiring once the last operation of [f] returned
+         does not abort [s] (see watchdog_thread), the result is
+         valid. *)
+      ignore(_watchdog_disarm s);
+      r
+    | exception e ->
+      let fired = _watchdog_disarm s in
+      match e with
+      | Error ABORTED when fired -> raise(Error DEADLINE_EXCEEDED)
+      | _ -> raise e
+  )
+  else f ()
+
+(* Calls the incoming SMS and call callbacks on the events libGammu
+   reported during the last functions.  Each event is removed before its
+   callback is called. *)
+external dispatch_incoming : t -> unit = "caml_gammu_dispatch_incoming"
+
+(* The exception of a callback does not change the outcome of the
+   operation that received the event, the next events are dispatched. *)
+let rec dispatch s =
+  match dispatch_incoming s with
+  | () -> ()
+  | exception Sys.Break -> raise Sys.Break
+  | exception _ -> dispatch s
+
+(* Errors meaning that the phone no longer answers. *)
+let link_error = function
+  | NOTCONNECTED | TIMEOUT | ABORTED | DEADLINE_EXCEEDED
+  | DEVICEOPENERROR | DEVICENOTEXIST | DEVICENOTWORK
+  | DEVICEWRITEERROR | DEVICEREADERROR -> true
+  | _ -> false
+
+(* All operations on the phone go through this function, it is also the
+   place to deliver the lines logged meanwhile. *)
+let may_timeout s timeout f =
+  let r =
+    try
+      match timeout with
+      | None -> f ()
+      | Some timeout -> with_timeout s timeout f
+    with e -> Log.flush s; dispatch s; raise e in
+  Log.flush s;
+  dispatch s;
+  r
+
 external _get_config : t -> int -> config = "caml_gammu_GSM_GetConfig"
 let get_config ?(num=(-1)) s = _get_config s num
 
@@ -348,18 +568,53 @@ let load_gammurc ?path ?(section=0) s =
   let cfg = INI.config ini section in
   push_config s cfg
 
-let make ?section () =
+let make ?path ?section () =
   let s = alloc_state_machine() in
-  load_gammurc ?section s;
+  load_gammurc ?path ?section s;
   s
 
+external _free : t -> unit = "caml_gammu_free"
+let free s =
+  (* Deliver the last logged lines, unless [s] was already freed. *)
+  (try Log.flush s with Invalid_argument _ -> ());
+  _free s
+
 external _connect : t -> int -> unit= "caml_gammu_GSM_InitConnection"
 external _connect_log : t -> int -> (string -> unit) -> unit
   = "caml_gammu_GSM_InitConnection_Log"
 
-let connect ?log ?(replies=3) s = match log with
-  | None -> _connect s replies
-  | Some log_func -> _connect_log s replies log_func
+let connect ?log ?(replies=3) ?timeout s =
+  may_timeout s timeout (fun () ->
+      match log with
+      | None -> _connect s replies
+      | Some log_func -> _connect_log s replies log_func)
+
+type startup = {
+  machine : t;
+  failure : error option;
+  connect_time : float;
+}
+
+external _connect_all : t array -> int -> (error option * float) array
+  = "caml_gammu_connect_all"
+
+let connect_all ?(replies=3) ?timeout cfgs =
+  let machines = Array.of_list (List.map (fun cfg ->
+                                    let s = alloc_state_machine() in
+                                    push_config s cfg;
+                                    s) cfgs) in
+  let armed = match timeout with
+    | None -> Array.map (fun _ -> false) machines
+    | Some timeout -> Array.map (fun s -> _watchdog_arm s timeout) machines in
+  let results = _connect_all machines replies in
+  let startup i (failure, time) =
+    let s = machines.(i) in
+    let fired = armed.(i) && _watchdog_disarm s in
+    let failure = match failure with
+      | Some ABORTED when fired -> Some DEADLINE_EXCEEDED
+      | _ -> failure in
+    { machine = s; failure = failure; connect_time = time } in
+  Array.to_list (Array.mapi startup results)
 
 external disconnect : t -> unit = "caml_gammu_GSM_TerminateConnection"
 
@@ -369,8 +624,68 @@ external get_used_connection : t -> connection_type =
   "caml_gammu_GSM_GetUsedConnection"
 
 external _read_device : t -> bool -> int = "caml_gammu_GSM_ReadDevice"
-let read_device ?(wait_for_reply=true) s =
-  _read_device s wait_for_reply
+let read_device ?(wait_for_reply=true) ?timeout s =
+  may_timeout s timeout (fun () -> _read_device s wait_for_reply)
+
+type reload = Unchanged | Updated | Reconnected
+
+external _update_config : t -> int -> config -> unit
+  = "caml_gammu_update_config"
+
+let reload_config ?log ?replies ?timeout s cfg =
+  let num = length_config s - 1 in
+  let old = get_config ~num s in
+  if cfg = old then Unchanged
+  else if cfg.model <> old.model || cfg.device <> old.device
+          || cfg.connection <> old.connection then (
+    let connected = is_connected s in
+    (* The link may already be broken, we reconnect anyway. *)
+    if connected then (try disconnect s with Error _ -> ());
+    remove_config s;
+    push_config s cfg;
+    if connected then connect ?log ?replies ?timeout s;
+    Reconnected
+  )
+  else (
+    _update_config s num cfg;
+    Updated
+  )
+
+let reload_gammurc ?path ?(section=0) ?log ?replies ?timeout s =
+  let cfg = INI.config (INI.of_gammurc ?path ()) section in
+  reload_config ?log ?replies ?timeout s cfg
+
+external file_mtime : string -> float = "caml_gammu_file_mtime"
+
+type gammurc_watch = {
+  path : string;
+  section : int;
+  machines : t list;
+  mutable mtime : float;
+}
+
+let watch_gammurc ?(section=0) ~path machines =
+  { path = path; section = section; machines = machines;
+    mtime = file_mtime path }
+
+let poll_gammurc ?log ?replies ?timeout ?(on_err=(fun _ _ -> ()))
+    ?(on_parse_err=(fun _ -> ())) w =
+  let parse mtime =
+    if mtime = w.mtime then None
+    else Some (INI.config (INI.of_gammurc ~path:w.path ()) w.section) in
+  let mtime = try file_mtime w.path with Error _ -> w.mtime in
+  match parse mtime with
+  | None -> []
+  | exception Error e -> on_parse_err e; []
+  | Some cfg ->
+    (* Only now, so that a file caught mid-save is parsed again. *)
+    w.mtime <- mtime;
+    List.fold_right (fun s changes ->
+        match reload_config ?log ?replies ?timeout s cfg with
+        | Unchanged -> changes
+        | change -> (s, change) :: changes
+        | exception Error e -> on_err s e; changes
+      ) w.machines []
 
 
 (************************************************************************)
@@ -386,12 +701,16 @@ type security_code_type =
   | SEC_Phone
   | SEC_Network
 
-external enter_security_code : t ->
+external _enter_security_code : t ->
   code_type:security_code_type -> code:string -> unit =
   "caml_gammu_GSM_EnterSecurityCode"
+let enter_security_code ?timeout s ~code_type ~code =
+  may_timeout s timeout (fun () -> _enter_security_code s ~code_type ~code)
 
-external get_security_status : t -> security_code_type =
+external _get_security_status : t -> security_code_type =
   "caml_gammu_GSM_GetSecurityStatus"
+let get_security_status ?timeout s =
+  may_timeout s timeout (fun () -> _get_security_status s)
 
 
 (************************************************************************)
@@ -471,30 +790,56 @@ struct
   external country_code_name : string -> string
     = "caml_gammu_GSM_GetCountryName"
 
-  external battery_charge : t -> battery_charge
+  external network_code_names : string array -> string array
+    = "caml_gammu_network_code_names"
+
+  external country_code_names : string array -> string array
+    = "caml_gammu_country_code_names"
+
+  external _battery_charge : t -> battery_charge
     = "caml_gammu_GSM_GetBatteryCharge"
+  let battery_charge ?timeout s =
+    may_timeout s timeout (fun () -> _battery_charge s)
 
-  external firmware : t -> firmware = "caml_gammu_GSM_GetFirmWare"
+  external _firmware : t -> firmware = "caml_gammu_GSM_GetFirmWare"
+  let firmware ?timeout s = may_timeout s timeout (fun () -> _firmware s)
 
-  external hardware : t -> string = "caml_gammu_GSM_GetHardware"
+  external _hardware : t -> string = "caml_gammu_GSM_GetHardware"
+  let hardware ?timeout s = may_timeout s timeout (fun () -> _hardware s)
 
-  external imei : t -> string = "caml_gammu_GSM_GetIMEI"
+  external _imei : t -> string = "caml_gammu_GSM_GetIMEI"
+  let imei ?timeout s = may_timeout s timeout (fun () -> _imei s)
 
-  external manufacture_month : t -> string
+  external _manufacture_month : t -> string
     = "caml_gammu_GSM_GetManufactureMonth"
+  let manufacture_month ?timeout s =
+    may_timeout s timeout (fun () -> _manufacture_month s)
+
+  external _manufacturer : t -> string = "caml_gammu_GSM_GetManufacturer"
+  let manufacturer ?timeout s =
+    may_timeout s timeout (fun () -> _manufacturer s)
 
-  external manufacturer : t -> string = "caml_gammu_GSM_GetManufacturer"
+  external _model : t -> string = "caml_gammu_GSM_GetModel"
+  let model ?timeout s = may_timeout s timeout (fun () -> _model s)
 
-  external model : t -> string = "caml_gammu_GSM_GetModel"
+  external _imsi : t -> string = "caml_gammu_GSM_GetSIMIMSI"
+  let imsi ?timeout s = may_timeout s timeout (fun () -> _imsi s)
 
-  external model_info : t -> phone_model = "caml_gammu_GSM_GetModelInfo"
+  external _model_info : t -> phone_model = "caml_gammu_GSM_GetModelInfo"
+  let model_info ?timeout s = may_timeout s timeout (fun () -> _model_info s)
 
-  external network_info : t -> network = "caml_gammu_GSM_GetNetworkInfo"
+  external _network_info : t -> network = "caml_gammu_GSM_GetNetworkInfo"
+  let network_info ?timeout s =
+    may_timeout s timeout (fun () -> _network_info s)
 
-  external product_code : t -> string = "caml_gammu_GSM_GetProductCode"
+  external _product_code : t -> string = "caml_gammu_GSM_GetProductCode"
+  let product_code ?timeout s =
+    may_timeout s timeout (fun () -> _product_code s)
 
-  external signal_quality : t -> signal_quality
+  external _signal_quality : t -> signal_quality
     = "caml_gammu_GSM_GetSignalQuality"
+  let signal_quality ?timeout s =
+    may_timeout s timeout (fun () -> _signal_quality s)
 
 end
 
@@ -543,6 +888,28 @@ struct
 
   let os_date_time ?(timezone=false) dt = _os_date_time dt timezone
 
+  external epoch : t -> int64 = "caml_gammu_datetime_epoch"
+
+  type stamp = {
+    epoch : int64;
+    tz_offset : int;
+  }
+
+  external to_stamp : t -> stamp = "caml_gammu_datetime_to_stamp"
+
+  external of_stamp : stamp -> t = "caml_gammu_datetime_of_stamp"
+
+  let compare_stamp st1 st2 = Int64.compare st1.epoch st2.epoch
+
+  external _format : t -> bool -> string = "caml_gammu_datetime_format"
+
+  let format ?(timezone=false) dt = _format dt timezone
+
+  external _format_stamp : stamp -> bool -> string
+    = "caml_gammu_datetime_format_stamp"
+
+  let format_stamp ?(timezone=false) st = _format_stamp st timezone
+
 end
 
 
@@ -759,49 +1126,851 @@ struct
       sms_class = '\x00';
       message_reference = '\x00' }
 
-  external get : t -> folder:int -> message_number:int -> multi_sms =
+  external _get : t -> folder:int -> message_number:int -> multi_sms =
     "caml_gammu_GSM_GetSMS"
+  let get ?timeout s ~folder ~message_number =
+    may_timeout s timeout (fun () -> _get s ~folder ~message_number)
 
   external _get_next : t -> location:int -> folder:int -> bool -> multi_sms
     = "caml_gammu_GSM_GetNextSMS"
 
-  let rec fold_loop s location folder n ~retries retries_num on_err f acc =
+  external _get_next_stamped : t -> location:int -> folder:int -> bool ->
+    DateTime.stamp * multi_sms = "caml_gammu_GSM_GetNextSMS_stamped"
+
+  (* [get_next] reads the message after [location] and [number] gives
+     the location of what it returned. *)
+  let rec fold_loop get_next number s location folder n ~retries retries_num
+                    ~timeout on_err f acc =
     if n = 0 then acc
     else (
       try
-        let multi_sms =
-          if location = -1 then
-            (* Start from the beginning of the folder. *)
-            _get_next s ~location:0 ~folder true
-          else
-            (* Get next location, folder need to be 0 because the
-               location carries the folder in its representation. *)
-            _get_next s ~location ~folder:0 false
+        let next =
+          may_timeout s timeout (fun () ->
+              if location = -1 then
+                (* Start from the beginning of the folder. *)
+                get_next s ~location:0 ~folder true
+              else
+                (* Get next location, folder need to be 0 because the
+                   location carries the folder in its representation. *)
+                get_next s ~location ~folder:0 false)
         in
         (* Not a tail recursive call but the number of SMS messages is
            assumed to be small: *)
-        fold_loop s multi_sms.(0).message_number folder (n - 1)
-                  ~retries 0 on_err f (f acc multi_sms)
+        fold_loop get_next number s (number next) folder (n - 1)
+                  ~retries 0 ~timeout on_err f (f acc next)
       with
       | Error EMPTY -> acc (* There's no next SMS message *)
       | Error (UNKNOWN | CORRUPTED as e) ->
         on_err location e;
         if retries_num = retries then
           (* Continue with next message. *)
-          fold_loop s (location + 1) folder n ~retries 0 on_err f acc
+          fold_loop get_next number s (location + 1) folder n ~retries 0
+                    ~timeout on_err f acc
         else
           (* Retry retrieval. *)
-          fold_loop s location folder n ~retries (retries_num + 1) on_err f acc
+          fold_loop get_next number s location folder n ~retries
+                    (retries_num + 1) ~timeout on_err f acc
     )
 
-  let fold s ?(folder=0) ?(n=(-1)) ?(retries=2) ?(on_err=(fun _ _ -> ())) f a =
-    fold_loop s (-1) folder n ~retries 0 on_err f a
+  let fold s ?(folder=0) ?(n=(-1)) ?(retries=2) ?timeout
+           ?(on_err=(fun _ _ -> ())) f a =
+    let number multi_sms = multi_sms.(0).message_number in
+    fold_loop _get_next number s (-1) folder n ~retries 0 ~timeout on_err
+              f a
+
+  let fold_stamped s ?(folder=0) ?(n=(-1)) ?(retries=2) ?timeout
+                   ?(on_err=(fun _ _ -> ())) f a =
+    let number (_, multi_sms) = multi_sms.(0).message_number in
+    let f acc (stamp, multi_sms) = f acc stamp multi_sms in
+    fold_loop _get_next_stamped number s (-1) folder n ~retries 0 ~timeout
+              on_err f a
+
+  type prefetch
+  type prefetched =
+    | Prefetched of multi_sms
+    | Prefetch_error of (int * error)
+
+  type prefetch_stats = {
+    fetched : int;
+    fetch_time : float;
+    producer_wait : float;
+    consumer_wait : float;
+  }
+
+  external _prefetch_start : t -> int -> int -> int -> int -> prefetch
+    = "caml_gammu_sms_prefetch_start"
+  external _prefetch_next : prefetch -> prefetched option
+    = "caml_gammu_sms_prefetch_next"
+  external _prefetch_stop : prefetch -> prefetch_stats
+    = "caml_gammu_sms_prefetch_stop"
+
+  let overlap st =
+    if st.fetch_time <= 0. then 0.
+    else max 0. (1. -. st.consumer_wait /. st.fetch_time)
+
+  let rec prefetch_loop p on_err f acc =
+    match _prefetch_next p with
+    | None -> acc
+    | Some(Prefetched multi_sms) -> prefetch_loop p on_err f (f acc multi_sms)
+    | Some(Prefetch_error(location, e)) ->
+      on_err location e;
+      prefetch_loop p on_err f acc
+
+  let fold_prefetch s ?(folder=0) ?(n=(-1)) ?(retries=2) ?(depth=4) ?timeout
+                    ?(on_err=(fun _ _ -> ())) ?(stats=(fun _ -> ())) f a =
+    may_timeout s timeout (fun () ->
+        let p = _prefetch_start s folder n retries depth in
+        match prefetch_loop p on_err f a with
+        | acc -> stats (_prefetch_stop p); acc
+        | exception e -> stats (_prefetch_stop p); raise e)
+
+  type columns = {
+    count : int;
+    time : (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    state : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    folder : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    location : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    coding : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    sms_class : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    offsets : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    arena : (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout)
+              Bigarray.Array1.t;
+  }
+
+  external _columns : t -> int -> int -> columns = "caml_gammu_sms_columns"
+  let columns ?(folder=0) ?(n=(-1)) ?timeout s =
+    may_timeout s timeout (fun () -> _columns s folder n)
+
+  let arena_string c j =
+    let ofs = c.offsets.{j} in
+    String.init (c.offsets.{j + 1} - ofs) (fun k -> c.arena.{ofs + k})
+
+  let column_number c i =
+    if i < 0 || i >= c.count then invalid_arg "Gammu.SMS.column_number";
+    arena_string c (2 * i)
+
+  let column_text c i =
+    if i < 0 || i >= c.count then invalid_arg "Gammu.SMS.column_text";
+    arena_string c (2 * i + 1)
+
+  external _set : t -> message -> int * int = "caml_gammu_GSM_SetSMS"
+  let set ?timeout s msg = may_timeout s timeout (fun () -> _set s msg)
+
+  external _add : t -> message -> int * int = "caml_gammu_GSM_AddSMS"
+  let add ?timeout s msg = may_timeout s timeout (fun () -> _add s msg)
 
-  external set : t -> message -> int * int = "caml_gammu_GSM_SetSMS"
+  external _send : t -> message -> unit = "caml_gammu_GSM_SendSMS"
+  let send ?timeout s msg = may_timeout s timeout (fun () -> _send s msg)
 
-  external add : t -> message -> int * int = "caml_gammu_GSM_AddSMS"
+  external _get_smsc : t -> int -> smsc = "caml_gammu_GSM_GetSMSC"
+  let get_smsc ?timeout ?(location=1) s =
+    may_timeout s timeout (fun () -> _get_smsc s location)
 
-  external send : t -> message -> unit = "caml_gammu_GSM_SendSMS"
+  external _set_smsc : t -> smsc -> unit = "caml_gammu_GSM_SetSMSC"
+  let set_smsc ?timeout s smsc =
+    may_timeout s timeout (fun () -> _set_smsc s smsc)
+
+  external cached_smsc : t -> smsc option = "caml_gammu_smsc_cached"
+  external clear_smsc_cache : t -> unit = "caml_gammu_smsc_clear"
+
+  type template
+
+  external _template : message -> string -> template
+    = "caml_gammu_sms_template"
+  let template msg ~placeholder = _template msg placeholder
+
+  external _send_template : t -> template -> number:string -> string -> unit
+    = "caml_gammu_send_sms_template"
+  let send_template ?timeout s tpl ~number fill =
+    may_timeout s timeout (fun () -> _send_template s tpl ~number fill)
+
+  type send_status =
+    | Send_pending
+    | Send_ok of int
+    | Send_error of int
+
+  type sending = {
+    sending_sm : t;
+    submission : int;
+  }
+
+  (* WARNING: must be in sync with SEND_STATUS_RING in gammu_stubs.h *)
+  let send_status_ring = 64
+
+  external _send_async : t -> message -> int = "caml_gammu_send_sms_async"
+
+  external _send_result : t -> int -> send_status
+    = "caml_gammu_send_sms_result"
+
+  external in_flight : t -> int = "caml_gammu_sms_in_flight"
+
+  external drop_pending : t -> unit = "caml_gammu_sms_drop_pending"
+
+  (* Seconds without any status reported after which the messages in
+     flight are considered lost. *)
+  let status_wait = 30.
+
+  (* Read the phone until [ready ()].  If no status comes for
+     [status_wait] seconds, the messages in flight are marked as failed
+     (with status -1), which makes [ready ()] true for the callers. *)
+  let wait_reports s ready =
+    let rec loop n since =
+      if not(ready ()) then (
+        ignore(read_device s);
+        let n' = in_flight s and now = Log.now () in
+        if n' < n then loop n' now
+        else if now -. since > status_wait then drop_pending s
+        else loop n since
+      ) in
+    loop (in_flight s) (Log.now ())
+
+  let send_async ?(max_in_flight=4) ?timeout s msg =
+    if max_in_flight < 1 || max_in_flight > send_status_ring then
+      invalid_arg "Gammu.SMS.send_async: max_in_flight out of range";
+    may_timeout s timeout (fun () ->
+        (* Let the phone report the status of previous messages. *)
+        wait_reports s (fun () -> in_flight s < max_in_flight);
+        { sending_sm = s; submission = _send_async s msg })
+
+  let send_status h = _send_result h.sending_sm h.submission
+
+  let wait_send ?timeout h =
+    may_timeout h.sending_sm timeout (fun () ->
+        wait_reports h.sending_sm (fun () -> send_status h <> Send_pending);
+        send_status h)
+
+  module Outbox =
+  struct
+    external fsync : int -> unit = "caml_gammu_fsync"
+    external fsync_dir : string -> unit = "caml_gammu_fsync_dir"
+
+    type id = int
+
+    type state =
+      | Queued
+      | Submitted
+      | Sent of int
+      | Failed of int
+      | Rejected of string
+
+    (* Records of the journal, replayed in order by [apply]. *)
+    type record =
+      | Next_id of id
+      | Enqueue of id * message
+      | Submit of id
+      | Set_state of id * state
+      | Remove of id
+
+    type entry = {
+      msg : message;
+      mutable entry_state : state;
+    }
+
+    type journal = {
+      path : string;
+      mutable ch : out_channel;
+      entries : (id, entry) Hashtbl.t;
+      mutable next_id : id;
+      mutable records : int;    (* Number of records in the journal. *)
+      mutable unsynced : int;   (* Records written since the last fsync. *)
+      mutable last_sync : float;
+      sync_every : int;
+      sync_interval : float;
+      compact_every : int;
+    }
+
+    let apply t = function
+      | Next_id id -> t.next_id <- max t.next_id id
+      | Enqueue(id, msg) ->
+        Hashtbl.replace t.entries id { msg; entry_state = Queued };
+        t.next_id <- max t.next_id (id + 1)
+      | Submit id ->
+        (try (Hashtbl.find t.entries id).entry_state <- Submitted
+         with Not_found -> ())
+      | Set_state(id, st) ->
+        (try (Hashtbl.find t.entries id).entry_state <- st
+         with Not_found -> ())
+      | Remove id -> Hashtbl.remove t.entries id
+
+    let open_journal path =
+      open_out_gen [Open_wronly; Open_creat; Open_append; Open_binary]
+                   0o600 path
+
+    let sync t =
+      if t.unsynced > 0 then (
+        flush t.ch;
+        fsync (Debug.channel_descriptor t.ch);
+        t.unsynced <- 0
+      );
+      t.last_sync <- Log.now ()
+
+    (* Write the live entries to a new journal, atomically replacing the
+       current one.  Sent, failed and rejected messages are forgotten. *)
+    let rewrite t =
+      let tmp = t.path ^ ".tmp" in
+      let ch = open_out_gen [Open_wronly; Open_creat; Open_trunc;
+                             Open_binary] 0o600 tmp in
+      let write r = Marshal.to_channel ch (r: record) [] in
+      write (Next_id t.next_id);
+      let finished = ref [] in
+      let ids = Hashtbl.fold (fun id _ l -> id :: l) t.entries [] in
+      List.iter (fun id ->
+          let e = Hashtbl.find t.entries id in
+          match e.entry_state with
+          | Queued -> write (Enqueue(id, e.msg))
+          | Submitted -> write (Enqueue(id, e.msg)); write (Submit id)
+          | Sent _ | Failed _ | Rejected _ -> finished := id :: !finished
+        ) (List.sort compare ids);
+      flush ch;
+      fsync (Debug.channel_descriptor ch);
+      close_out ch;
+      Sys.rename tmp t.path;
+      fsync_dir (Filename.dirname t.path);
+      List.iter (Hashtbl.remove t.entries) !finished;
+      t.records <- 1 + Hashtbl.length t.entries
+
+    let compact t =
+      sync t;
+      close_out t.ch;
+      rewrite t;
+      t.ch <- open_journal t.path
+
+    let log t r =
+      apply t r;
+      Marshal.to_channel t.ch (r: record) [];
+      t.records <- t.records + 1;
+      t.unsynced <- t.unsynced + 1
+
+    (* Group commit: one fsync for many records. *)
+    let maybe_sync t =
+      if t.unsynced >= t.sync_every
+         || Log.now () -. t.last_sync >= t.sync_interval then sync t;
+      if t.records >= t.compact_every
+         && t.records >= 2 * Hashtbl.length t.entries then compact t
+
+    let create ?(sync_every=64) ?(sync_interval=1.) ?(compact_every=10_000)
+               path =
+      (* [ch] is opened once the journal is replayed. *)
+      let t = { path;  ch = stdout;  entries = Hashtbl.create 64;
+                next_id = 0;  records = 0;  unsynced = 0;
+                last_sync = Log.now ();  sync_every;  sync_interval;
+                compact_every } in
+      (match open_in_bin path with
+       | ic ->
+         (* A record cut by a crash ends the replay. *)
+         (try
+            while true do apply t (Marshal.from_channel ic : record) done
+          with End_of_file | Failure _ -> ());
+         close_in ic
+       | exception Sys_error _ -> ());
+      (* Start from a clean journal, without the possible partial record. *)
+      rewrite t;
+      t.ch <- open_journal path;
+      t
+
+    let close t =
+      sync t;
+      close_out t.ch
+
+    let enqueue t msg =
+      let id = t.next_id in
+      log t (Enqueue(id, msg));
+      maybe_sync t;
+      id
+
+    let state t id = (Hashtbl.find t.entries id).entry_state
+
+    let with_state t st =
+      let l = Hashtbl.fold (fun id e l ->
+                  if e.entry_state = st then (id, e.msg) :: l else l)
+                t.entries [] in
+      List.sort (fun (id1, _) (id2, _) -> compare id1 id2) l
+
+    let queued t = with_state t Queued
+
+    let in_doubt t = with_state t Submitted
+
+    let requeue t id =
+      if not(Hashtbl.mem t.entries id) then raise Not_found;
+      log t (Set_state(id, Queued));
+      maybe_sync t
+
+    let cancel t id =
+      if not(Hashtbl.mem t.entries id) then raise Not_found;
+      log t (Remove id);
+      maybe_sync t
+
+    let rec take n = function
+      | [] -> []
+      | x :: tl -> if n <= 0 then [] else x :: take (n - 1) tl
+
+    let send_pending ?(max=64) ?max_in_flight ?timeout t s =
+      (* The statuses of the whole batch must still be known to
+         [wait_send]. *)
+      if max < 1 || max > send_status_ring then
+        invalid_arg "Gammu.SMS.Outbox.send_pending: max out of range";
+      let batch = take max (queued t) in
+      (* The submissions are on disk before the phone sees them, so a
+         message is never sent twice without being reported in doubt. *)
+      List.iter (fun (id, _) -> log t (Submit id)) batch;
+      sync t;
+      (* In reverse order, [`Sending] once given to the phone. *)
+      let started = ref [] in
+      let reject id reason =
+        log t (Set_state(id, Rejected reason));
+        started := (id, `Done(Rejected reason)) :: !started in
+      (try
+         List.iter (fun (id, msg) ->
+             match send_async ?max_in_flight ?timeout s msg with
+             | h -> started := (id, `Sending h) :: !started
+             (* Refused at once: sending it again would fail the same
+                way and block the journal. *)
+             | exception Error e when not(link_error e) ->
+                reject id (string_of_error e)
+             | exception Invalid_argument m -> reject id m
+           ) batch
+       with e ->
+         (* The messages not given to the phone are still to be sent. *)
+         List.iter (fun (id, _) ->
+             if not(List.mem_assoc id !started) then
+               log t (Set_state(id, Queued))) batch;
+         sync t;
+         raise e);
+      let results =
+        List.rev_map (function
+            | (id, `Done st) -> (id, st)
+            | (id, `Sending h) ->
+               let st = match wait_send ?timeout h with
+                 | Send_ok reference -> Sent reference
+                 | Send_error status -> Failed status
+                 | Send_pending -> Submitted in
+               if st <> Submitted then log t (Set_state(id, st));
+               (id, st)
+          ) !started in
+      maybe_sync t;
+      results
+  end
+
+  module Scheduler =
+  struct
+    type priority = Urgent | Normal | Bulk
+
+    let index = function Urgent -> 0 | Normal -> 1 | Bulk -> 2
+
+    type job = {
+      msg : message;
+      deadline : float;
+      enqueued : float;
+      seq : int;                (* FIFO order among equal deadlines. *)
+      attempts : int;           (* Failed sendings. *)
+      retry_at : float;         (* Not sent again before this time. *)
+    }
+
+    (* Binary min-heap of jobs by deadline.  The slots past [size] are
+       [None] so that the popped messages are not kept alive. *)
+    type heap = {
+      mutable jobs : job option array;
+      mutable size : int;
+    }
+
+    let heap_get h i = match h.jobs.(i) with Some j -> j | None -> assert false
+
+    let before j1 j2 =
+      j1.deadline < j2.deadline
+      || (j1.deadline = j2.deadline && j1.seq < j2.seq)
+
+    let heap_push h j =
+      if h.size = Array.length h.jobs then (
+        let jobs = Array.make (max 16 (2 * h.size)) None in
+        Array.blit h.jobs 0 jobs 0 h.size;
+        h.jobs <- jobs
+      );
+      let i = ref h.size in
+      h.size <- h.size + 1;
+      while !i > 0 && before j (heap_get h ((!i - 1) / 2)) do
+        h.jobs.(!i) <- h.jobs.((!i - 1) / 2);
+        i := (!i - 1) / 2
+      done;
+      h.jobs.(!i) <- Some j
+
+    let heap_pop h =
+      let top = heap_get h 0 in
+      h.size <- h.size - 1;
+      let last = heap_get h h.size in
+      h.jobs.(h.size) <- None;
+      let i = ref 0 and continue = ref (h.size > 0) in
+      while !continue do
+        let l = 2 * !i + 1 in
+        let c = if l + 1 < h.size
+                   && before (heap_get h (l + 1)) (heap_get h l) then l + 1
+                else l in
+        if c < h.size && before (heap_get h c) last then (
+          h.jobs.(!i) <- h.jobs.(c);
+          i := c
+        )
+        else continue := false
+      done;
+      if h.size > 0 then h.jobs.(!i) <- Some last;
+      top
+
+    type class_stats = {
+      queued : int;
+      sent : int;
+      expired : int;
+      failed : int;
+      total_wait : float;
+      max_wait : float;
+    }
+
+    type queue = {
+      queues : heap array;      (* Indexed by [index]. *)
+      stats : class_stats array;
+      rate : float;
+      burst : float;
+      mutable tokens : float;
+      mutable refilled : float; (* Time of the last refill. *)
+      mutable seq : int;
+      on_expire : priority -> message -> unit;
+      max_attempts : int;
+      on_failure : priority -> message -> exn -> unit;
+    }
+
+    let priorities = [| Urgent; Normal; Bulk |]
+
+    let no_stats = { queued = 0;  sent = 0;  expired = 0;  failed = 0;
+                     total_wait = 0.;  max_wait = 0. }
+
+    let create ?(rate=1.) ?(burst=1.) ?(on_expire=(fun _ _ -> ()))
+               ?(max_attempts=3) ?(on_failure=(fun _ _ _ -> ())) () =
+      if not(rate > 0.) then invalid_arg "Gammu.SMS.Scheduler.create: rate";
+      if not(burst >= 1.) then invalid_arg "Gammu.SMS.Scheduler.create: burst";
+      if max_attempts < 1 then
+        invalid_arg "Gammu.SMS.Scheduler.create: max_attempts";
+      { queues = Array.init 3 (fun _ -> { jobs = [| |];  size = 0 });
+        stats = Array.make 3 no_stats;
+        rate;  burst;  tokens = burst;  refilled = Log.now ();  seq = 0;
+        on_expire;  max_attempts;  on_failure }
+
+    (* See GSM 03.40 section 9.2.3.12.1. *)
+    let validity_period = function
+      | Not_available -> None
+      | Relative c ->
+        let v = float(Char.code c) in
+        let minutes =
+          if v <= 143. then (v +. 1.) *. 5.
+          else if v <= 167. then 12. *. 60. +. (v -. 143.) *. 30.
+          else if v <= 196. then (v -. 166.) *. 24. *. 60.
+          else (v -. 192.) *. 7. *. 24. *. 60. in
+        Some(minutes *. 60.)
+
+    let submit t ?(priority=Normal) ?deadline msg =
+      let now = Log.now () in
+      let deadline = match deadline with
+        | Some d -> now +. d
+        | None -> match validity_period msg.smsc.validity with
+                  | Some d -> now +. d
+                  | None -> infinity in
+      let i = index priority in
+      heap_push t.queues.(i) { msg;  deadline;  enqueued = now;  seq = t.seq;
+                               attempts = 0;  retry_at = now };
+      t.seq <- t.seq + 1;
+      t.stats.(i) <- { t.stats.(i) with queued = t.stats.(i).queued + 1 }
+
+    let length t =
+      Array.fold_left (fun n h -> n + h.size) 0 t.queues
+
+    let stats t priority = t.stats.(index priority)
+
+    (* Drop the jobs whose deadline has passed. *)
+    let expire t now =
+      Array.iteri (fun i h ->
+          while h.size > 0 && (heap_get h 0).deadline < now do
+            let job = heap_pop h in
+            let st = t.stats.(i) in
+            t.stats.(i) <- { st with queued = st.queued - 1;
+                                     expired = st.expired + 1 };
+            t.on_expire priorities.(i) job.msg
+          done
+        ) t.queues
+
+    type step =
+      | Sent of priority * message
+      | Throttled of float
+      | Idle
+
+    let step ?timeout t s =
+      let now = Log.now () in
+      expire t now;
+      t.tokens <- min t.burst (t.tokens +. (now -. t.refilled) *. t.rate);
+      t.refilled <- now;
+      (* A class whose first message waits to be sent again lets the
+         next classes go. *)
+      let rec first i wait =
+        if i = 3 then `Wait wait
+        else
+          let h = t.queues.(i) in
+          if h.size = 0 then first (i + 1) wait
+          else if (heap_get h 0).retry_at > now then
+            first (i + 1) (min wait ((heap_get h 0).retry_at -. now))
+          else `Ready i in
+      match first 0 infinity with
+      | `Wait w -> if w = infinity then Idle else Throttled w
+      | `Ready _ when t.tokens < 1. -> Throttled((1. -. t.tokens) /. t.rate)
+      | `Ready i ->
+        let job = heap_pop t.queues.(i) in
+        (try send ?timeout s job.msg
+         with e ->
+           let attempts = job.attempts + 1 in
+           if attempts < t.max_attempts then
+             (* The message stays queued, and is tried again after an
+                exponential backoff. *)
+             let backoff = float(1 lsl min attempts 16) /. t.rate in
+             heap_push t.queues.(i)
+                       { job with attempts;  retry_at = Log.now () +. backoff }
+           else (
+             let st = t.stats.(i) in
+             t.stats.(i) <- { st with queued = st.queued - 1;
+                                      failed = st.failed + 1 };
+             t.on_failure priorities.(i) job.msg e
+           );
+           raise e);
+        t.tokens <- t.tokens -. 1.;
+        let wait = Log.now () -. job.enqueued in
+        let st = t.stats.(i) in
+        t.stats.(i) <- { st with queued = st.queued - 1;
+                                 sent = st.sent + 1;
+                                 total_wait = st.total_wait +. wait;
+                                 max_wait = max st.max_wait wait };
+        Sent(priorities.(i), job.msg)
+  end
+
+  module Archive =
+  struct
+    (* WARNING: must be in sync with ARCHIVE_* in gammu_stubs.h *)
+    let magic = "GMARCH01"
+    let header_length = 24
+    let state_field = 12
+    let coding_field = 13
+    let class_field = 14
+    let folder_field = 15
+
+    let states = [| Sent; Unsent; Read; Unread |]
+    let codings = [| Unicode_No_Compression; Unicode_Compression;
+                     Default_No_Compression; Default_Compression;
+                     Eight_bit |]
+
+    let index_of a x =
+      let rec find i = if a.(i) = x then i else find (i + 1) in
+      find 0
+
+    let phone_char = function
+      | '0' .. '9' | '+' | ' ' | '-' | '.' | '(' | ')' -> true
+      | _ -> false
+
+    let normalize_number n =
+      let rec all_phone_chars i =
+        i = String.length n || (phone_char n.[i] && all_phone_chars (i + 1)) in
+      if not(all_phone_chars 0) then n (* Alphanumeric sender. *)
+      else (
+        let b = Buffer.create (String.length n) in
+        String.iter (fun c ->
+            if ('0' <= c && c <= '9') || (c = '+' && Buffer.length b = 0) then
+              Buffer.add_char b c) n;
+        let n = Buffer.contents b in
+        let len = String.length n in
+        if len > 2 && n.[0] = '0' && n.[1] = '0' then
+          "+" ^ String.sub n 2 (len - 2)
+        else n
+      )
+
+    type writer = {
+      ch : out_channel;
+      buf : Buffer.t;           (* Records not written yet. *)
+    }
+
+    let add_uint b n bytes =
+      for i = 0 to bytes - 1 do
+        Buffer.add_char b (Char.unsafe_chr ((n lsr (8 * i)) land 0xFF))
+      done
+
+    let add_int64 b x =
+      for i = 0 to 7 do
+        let byte = Int64.logand (Int64.shift_right_logical x (8 * i)) 0xFFL in
+        Buffer.add_char b (Char.unsafe_chr (Int64.to_int byte))
+      done
+
+    type reader
+    (* The offset of the record in the file of [owner]. *)
+    type entry = { owner : reader;  offset : int }
+
+    external open_reader : string -> reader = "caml_gammu_archive_open"
+    external close_reader : reader -> unit = "caml_gammu_archive_close"
+    external info : reader -> int * int = "caml_gammu_archive_info"
+
+    let copy_prefix path len =
+      let tmp = path ^ ".tmp" in
+      let ic = open_in_bin path in
+      let oc = open_out_bin tmp in
+      let chunk = Bytes.create 65536 in
+      let rec copy len =
+        if len > 0 then (
+          let n = input ic chunk 0 (min len (Bytes.length chunk)) in
+          if n = 0 then raise End_of_file;
+          output oc chunk 0 n;
+          copy (len - n)
+        ) in
+      copy len;
+      close_in ic;
+      close_out oc;
+      Sys.rename tmp path
+
+    let open_writer path =
+      let valid =
+        if Sys.file_exists path then (
+          let r = open_reader path in
+          let _, valid = info r in
+          close_reader r;
+          let ic = open_in_bin path in
+          let size = in_channel_length ic in
+          close_in ic;
+          (* Drop the record cut by a crash, if any. *)
+          if valid > 0 && valid < size then copy_prefix path valid;
+          valid
+        )
+        else 0 in
+      let ch = open_out_gen [Open_wronly; Open_creat; Open_binary;
+                             (if valid = 0 then Open_trunc else Open_append)]
+                            0o644 path in
+      if valid = 0 then output_string ch magic;
+      { ch;  buf = Buffer.create 65536 }
+
+    let flush_channel = flush
+
+    let flush w =
+      Buffer.output_buffer w.ch w.buf;
+      Buffer.clear w.buf;
+      flush_channel w.ch
+
+    let close_writer w =
+      flush w;
+      close_out w.ch
+
+    let append w msg =
+      let number = normalize_number msg.number in
+      let number = if String.length number > 0xFFFF then
+                     String.sub number 0 0xFFFF else number in
+      let b = w.buf in
+      add_uint b (header_length + String.length number
+                  + String.length msg.text) 4;
+      add_int64 b (DateTime.epoch msg.date_time);
+      add_uint b (index_of states msg.state) 1;
+      add_uint b (index_of codings msg.coding) 1;
+      add_uint b (Char.code msg.sms_class) 1;
+      add_uint b (min msg.folder 0xFF) 1;
+      add_uint b (String.length number) 2;
+      add_uint b 0 2;
+      add_uint b (String.length msg.text) 4;
+      Buffer.add_string b number;
+      Buffer.add_string b msg.text;
+      if Buffer.length b >= 65536 then flush w
+
+    let length r = fst (info r)
+
+    external _nth : reader -> int -> int = "caml_gammu_archive_nth"
+    external _time : reader -> int -> int64 = "caml_gammu_archive_time"
+    external _field : reader -> int -> int -> int = "caml_gammu_archive_field"
+    external _get_string : reader -> int -> bool -> string
+      = "caml_gammu_archive_string"
+
+    let offset r e =
+      if e.owner != r then
+        invalid_arg "Gammu.SMS.Archive: entry of another reader";
+      e.offset
+
+    let nth r i = { owner = r;  offset = _nth r i }
+    let time r e = _time r (offset r e)
+    let field r e f = _field r (offset r e) f
+    let get_string r e text = _get_string r (offset r e) text
+
+    let number r e = get_string r e false
+    let text r e = get_string r e true
+    let state r e = states.(field r e state_field)
+    let coding r e = codings.(field r e coding_field)
+    let sms_class r e = Char.chr (field r e class_field)
+    let folder r e = field r e folder_field
+
+    let fold r f a =
+      let n = length r in
+      let rec loop i acc = if i = n then acc else loop (i + 1) (f acc (nth r i))
+      in
+      loop 0 a
+
+    external _range : reader -> string option -> int64 -> int64 -> int array
+      = "caml_gammu_archive_range"
+
+    let range ?number ?(from=Int64.min_int) ?(until=Int64.max_int) r =
+      let number = match number with
+        | Some n -> Some(normalize_number n)
+        | None -> None in
+      Array.map (fun offset -> { owner = r;  offset })
+                (_range r number from until)
+  end
+
+  module Backup =
+  struct
+    type backup
+
+    external create : unit -> backup = "caml_gammu_sms_backup_create"
+    external _append : backup -> message -> unit = "caml_gammu_sms_backup_add"
+    external write : backup -> string -> unit = "caml_gammu_sms_backup_write"
+    external read : string -> backup = "caml_gammu_sms_backup_read"
+    external next : backup -> message option = "caml_gammu_sms_backup_next"
+    external free : backup -> unit = "caml_gammu_sms_backup_free"
+
+    type writer = {
+      backup : backup;
+      path : string;
+    }
+
+    let open_writer path = { backup = create (); path }
+
+    let append w msg = _append w.backup msg
+
+    let close_writer w =
+      match write w.backup w.path with
+      | () -> free w.backup
+      | exception e -> free w.backup; raise e
+
+    let export ?folder ?timeout s path =
+      let w = open_writer path in
+      let n = match fold s ?folder ?timeout (fun n multi_sms ->
+                        Array.iter (append w) multi_sms;
+                        n + Array.length multi_sms) 0 with
+        | n -> n
+        | exception e -> free w.backup; raise e in
+      close_writer w;
+      n
+
+    let fold path f a =
+      let b = read path in
+      let rec loop acc = match next b with
+        | Some msg -> loop (f acc msg)
+        | None -> acc in
+      match loop a with
+      | acc -> free b; acc
+      | exception e -> free b; raise e
+
+    let restore ?folder ?timeout s path =
+      let restore_msg (i, n, failed) msg =
+        let msg = match folder with
+          | Some folder -> { msg with folder = folder }
+          | None -> msg in
+        match add ?timeout s msg with
+        | _ -> (i + 1, n + 1, failed)
+        | exception Error e -> (i + 1, n, (i, e) :: failed) in
+      let _, n, failed = fold path restore_msg (0, 0, []) in
+      (n, List.rev failed)
+  end
 
   type folder = {
     box : folder_box;
@@ -810,7 +1979,8 @@ struct
   }
   and folder_box = Inbox | Outbox
 
-  external folders : t -> folder array = "caml_gammu_GSM_GetSMSFolders"
+  external _folders : t -> folder array = "caml_gammu_GSM_GetSMSFolders"
+  let folders ?timeout s = may_timeout s timeout (fun () -> _folders s)
 
   type memory_status = {
     sim_unread : int;
@@ -822,14 +1992,84 @@ struct
     phone_size : int;
   }
 
-  external get_status : t -> memory_status = "caml_gammu_GSM_GetSMSStatus"
+  external _get_status : t -> memory_status = "caml_gammu_GSM_GetSMSStatus"
+  let get_status ?timeout s = may_timeout s timeout (fun () -> _get_status s)
 
   external set_incoming_sms : t -> bool -> unit
     = "caml_gammu_GSM_SetIncomingSMS"
 
   external _delete : t -> int -> int -> unit = "caml_gammu_GSM_DeleteSMS"
-  let delete s ~folder ~message_number =
-    _delete s message_number folder
+  let delete ?timeout s ~folder ~message_number =
+    may_timeout s timeout (fun () -> _delete s message_number folder)
+
+  external _delete_many : t -> (int * int) array -> error option array
+    = "caml_gammu_sms_delete_many"
+
+  let delete_many_timeout s timeout locations =
+    if _watchdog_arm s timeout then (
+      let r = try _delete_many s locations
+              with e -> ignore(_watchdog_disarm s); raise e in
+      if _watchdog_disarm s then
+        Array.map (function Some ABORTED -> Some DEADLINE_EXCEEDED
+                          | e -> e) r
+      else r
+    )
+    else _delete_many s locations
+
+  let delete_many ?timeout s locations =
+    let locations = Array.of_list locations in
+    (* The errors are returned per location, not raised, so the
+       deadline is dealt with here rather than by [with_timeout]. *)
+    let r = may_timeout s None (fun () ->
+                match timeout with
+                | None -> _delete_many s locations
+                | Some timeout -> delete_many_timeout s timeout locations) in
+    Array.to_list r
+
+  type drain_status =
+    | Kept
+    | Deleted
+    | Not_deleted of error
+
+  let rec split_at n acc l =
+    if n = 0 then List.rev acc, l
+    else match l with
+      | x :: tl -> split_at (n - 1) (x :: acc) tl
+      | [] -> List.rev acc, []
+
+  let rec drain_report errors acc = function
+    | [] -> List.rev acc
+    | (multi_sms, ack) :: tl ->
+      if not ack then drain_report errors ((multi_sms, Kept) :: acc) tl
+      else
+        let parts, errors = split_at (Array.length multi_sms) [] errors in
+        (* All parts must be deleted for the message to be. *)
+        let status = match List.filter (fun e -> e <> None) parts with
+          | Some e :: _ -> Not_deleted e
+          | _ -> Deleted in
+        drain_report errors ((multi_sms, status) :: acc) tl
+
+  let drain_delete ?timeout s read =
+    let read = List.rev read in
+    let locations =
+      List.fold_right (fun (multi_sms, ack) l ->
+          if ack then
+            Array.fold_right (fun m l -> (m.folder, m.message_number) :: l)
+                             multi_sms l
+          else l) read [] in
+    drain_report (delete_many ?timeout s locations) [] read
+
+  let drain ?folder ?n ?retries ?timeout ?on_err s consumer =
+    let read = ref [] in
+    (try
+       fold s ?folder ?n ?retries ?timeout ?on_err
+            (fun () multi_sms ->
+               read := (multi_sms, consumer multi_sms) :: !read) ()
+     with e ->
+       (* Do not deliver again the messages already acknowledged. *)
+       ignore(drain_delete ?timeout s !read);
+       raise e);
+    drain_delete ?timeout s !read
 
   type multipart_info = {
     unicode_coding : bool;
@@ -978,3 +2218,271 @@ let incoming_call ?(enable=true) s f =
   _incoming_call s f;
   enable_incoming_call s enable
 
+
+
+(************************************************************************)
+(* Supervised connections *)
+
+module Supervisor =
+struct
+  type stats = {
+    outages : int;
+    attempts : int;
+    downtime : float;
+    last_recovery : float;
+    max_recovery : float;
+  }
+
+  type supervisor = {
+    sm : t;
+    log : (string -> unit) option;
+    replies : int option;
+    connect_timeout : float option;
+    probe_interval : float;
+    probe_timeout : float;
+    min_backoff : float;
+    max_backoff : float;
+    mutable pin_model : bool;
+    mutable pinned : bool;     (* Whether [set_model] changed the config. *)
+    mutable detected_model : string; (* At the first connection. *)
+    mutable security_code : (security_code_type * string) option;
+    mutable sms_callback : (SMS.message -> unit) option;
+    mutable call_callback : (Call.call -> unit) option;
+    mutable up : bool;
+    mutable outage : bool;     (* Whether the link went down (vs. never
+                                   connected). *)
+    mutable down_since : float;
+    mutable next_probe : float;
+    mutable next_attempt : float;
+    mutable backoff : float;
+    mutable stats : stats;
+  }
+
+  (* The model as known by libGammu, "" if it is not. *)
+  let detect_model ~timeout s =
+    try (Info.model_info ~timeout s).Info.model with Error _ -> ""
+
+  let create ?log ?replies ?connect_timeout ?(probe_interval=10.)
+             ?(probe_timeout=5.) ?(min_backoff=1.) ?(max_backoff=60.)
+             ?(pin_model=true) s =
+    if probe_interval <= 0. then
+      invalid_arg "Gammu.Supervisor.create: probe_interval <= 0";
+    if min_backoff <= 0. || max_backoff < min_backoff then
+      invalid_arg "Gammu.Supervisor.create: invalid backoff";
+    let now = Log.now () in
+    let up = is_connected s in
+    { sm = s; log = log; replies = replies;
+      connect_timeout = connect_timeout;
+      probe_interval = probe_interval; probe_timeout = probe_timeout;
+      min_backoff = min_backoff; max_backoff = max_backoff;
+      pin_model = pin_model; pinned = false;
+      detected_model = (if up then detect_model ~timeout:probe_timeout s
+                        else "");
+      security_code = None; sms_callback = None; call_callback = None;
+      up = up; outage = false; down_since = now;
+      next_probe = now +. probe_interval; next_attempt = now;
+      backoff = min_backoff;
+      stats = { outages = 0; attempts = 0; downtime = 0.;
+                last_recovery = 0.; max_recovery = 0. } }
+
+  let machine v = v.sm
+  let is_up v = v.up
+  let stats v = v.stats
+
+  let mark_down v =
+    if v.up then (
+      v.up <- false;
+      v.outage <- true;
+      v.down_since <- Log.now ();
+      v.next_attempt <- v.down_since;
+      v.backoff <- v.min_backoff;
+      v.stats <- { v.stats with outages = v.stats.outages + 1 }
+    )
+
+  let enter_code v (code_type, code) =
+    try enter_security_code ~timeout:v.probe_timeout v.sm ~code_type ~code
+    with Error e when not(link_error e) ->
+      (* Do not lock the SIM by retrying a wrong code. *)
+      v.security_code <- None;
+      raise(Error e)
+
+  (* Put the model in the configuration so that libGammu does not
+     identify the phone again. *)
+  let set_model v =
+    let num = length_config v.sm - 1 in
+    let cfg = get_config ~num v.sm in
+    if cfg.model = "" then (
+      remove_config v.sm;
+      push_config v.sm { cfg with model = v.detected_model };
+      v.pinned <- true
+    )
+
+  (* libGammu rejected the pinned model: let it identify the phone. *)
+  let unpin_model v =
+    let num = length_config v.sm - 1 in
+    let cfg = get_config ~num v.sm in
+    remove_config v.sm;
+    push_config v.sm { cfg with model = "" };
+    v.pinned <- false;
+    v.pin_model <- false
+
+  let reconnect v =
+    if is_connected v.sm then (try disconnect v.sm with Error _ -> ());
+    if v.pin_model && v.detected_model <> "" then set_model v;
+    connect ?log:v.log ?replies:v.replies ?timeout:v.connect_timeout v.sm;
+    (match v.security_code with
+     | Some ((code_type, _) as c) ->
+        if get_security_status ~timeout:v.probe_timeout v.sm = code_type then
+          enter_code v c
+     | None -> ());
+    (match v.sms_callback with
+     | Some f -> incoming_sms v.sm f
+     | None -> ());
+    (match v.call_callback with
+     | Some f -> incoming_call v.sm f
+     | None -> ());
+    if v.detected_model = "" then
+      v.detected_model <- detect_model ~timeout:v.probe_timeout v.sm
+
+  let attempt v =
+    v.stats <- { v.stats with attempts = v.stats.attempts + 1 };
+    match reconnect v with
+    | () ->
+       let now = Log.now () in
+       v.up <- true;
+       v.next_probe <- now +. v.probe_interval;
+       if v.outage then (
+         let recovery = now -. v.down_since in
+         v.stats <- { v.stats with
+                      downtime = v.stats.downtime +. recovery;
+                      last_recovery = recovery;
+                      max_recovery = max v.stats.max_recovery recovery }
+       )
+    | exception Error e ->
+       if e = UNKNOWNMODELSTRING && v.pinned then unpin_model v;
+       v.next_attempt <- Log.now () +. v.backoff;
+       v.backoff <- min v.max_backoff (2. *. v.backoff)
+
+  let probe v =
+    v.next_probe <- Log.now () +. v.probe_interval;
+    match get_security_status ~timeout:v.probe_timeout v.sm with
+    | status ->
+       (* The modem may have reset without the link breaking. *)
+       (match v.security_code with
+        | Some ((code_type, _) as c) when code_type = status ->
+           (* A rejected code is forgotten by [enter_code]. *)
+           (try enter_code v c with Error e -> if link_error e then mark_down v)
+        | _ -> ())
+    | exception Error e when link_error e -> mark_down v
+    | exception Error _ -> () (* The phone answered. *)
+
+  let step v =
+    let now = Log.now () in
+    if v.up then (if now >= v.next_probe then probe v)
+    else if now >= v.next_attempt then attempt v;
+    v.up
+
+  let use v f =
+    if not v.up then raise(Error NOTCONNECTED);
+    try f v.sm
+    with Error e when link_error e -> mark_down v; raise(Error e)
+
+  let enter_security_code ?timeout v ~code_type ~code =
+    if v.up then
+      use v (fun s -> enter_security_code ?timeout s ~code_type ~code);
+    v.security_code <- Some (code_type, code)
+
+  let incoming_sms v f =
+    v.sms_callback <- Some f;
+    if v.up then use v (fun s -> incoming_sms s f)
+
+  let incoming_call v f =
+    v.call_callback <- Some f;
+    if v.up then use v (fun s -> incoming_call s f)
+end
+
+
+(************************************************************************)
+(* Discovery *)
+
+module Discovery =
+struct
+  let has_prefix p s =
+    String.length s > String.length p
+    && String.sub s 0 (String.length p) = p
+
+  let candidates () =
+    let is_candidate n = has_prefix "ttyUSB" n || has_prefix "ttyACM" n in
+    (* Sort ttyUSB2 before ttyUSB10. *)
+    let by_number d1 d2 =
+      compare (String.length d1, d1) (String.length d2, d2) in
+    match Sys.readdir "/dev" with
+    | names ->
+       let names = List.filter is_candidate (Array.to_list names) in
+       List.sort by_number (List.map (fun n -> "/dev/" ^ n) names)
+    | exception Sys_error _ -> []
+
+  let probe_config connection device : config =
+    { model = ""; debug_level = ""; device = device; connection = connection;
+      sync_time = false; lock_device = false; debug_file = "";
+      start_info = false; use_global_debug_file = false;
+      text_reminder = ""; text_meeting = ""; text_call = "";
+      text_birthday = ""; text_memo = "" }
+
+  type modem = {
+    device : string;
+    connection : string;
+    imei : string;
+    model : string;
+    imsi : string option;
+    other_devices : string list;
+  }
+
+  let config (m : modem) = probe_config m.connection m.device
+
+  external _identify_all : t array -> (string * string * string option)
+                                       option array
+    = "caml_gammu_identify_all"
+
+  (* Identify the connected machines of [startups] at once, all the
+     probes of a machine within [timeout], and disconnect them. *)
+  let identify ~timeout connection devices startups =
+    let connected = List.filter (fun (_, st) -> st.failure = None)
+                      (List.combine devices startups) in
+    let devices = Array.of_list (List.map fst connected) in
+    let machines = Array.of_list (List.map (fun (_, st) -> st.machine)
+                                    connected) in
+    let armed = Array.map (fun s -> _watchdog_arm s timeout) machines in
+    let close () =
+      Array.iteri (fun i s ->
+          if armed.(i) then ignore(_watchdog_disarm s);
+          try disconnect s with Error _ -> ()) machines in
+    let ids = try _identify_all machines with e -> close(); raise e in
+    close();
+    let modem i = function
+      | Some(imei, model, imsi) ->
+         Some { device = devices.(i); connection = connection; imei = imei;
+                model = model; imsi = imsi; other_devices = [] }
+      | None -> None in
+    Array.to_list (Array.mapi modem ids)
+
+  (* Keep the first port of each modem, in the order of [modems]. *)
+  let rec group = function
+    | [] -> []
+    | m :: tl ->
+       let same m' = m.imei <> "" && m'.imei = m.imei in
+       let others, tl = List.partition same tl in
+       { m with other_devices = List.map (fun m -> m.device) others }
+       :: group tl
+
+  let scan ?devices ?(connection="at") ?(replies=1) ?(timeout=5.) () =
+    let devices = match devices with
+      | Some d -> d
+      | None -> candidates () in
+    let startups = connect_all ~replies ~timeout
+                     (List.map (probe_config connection) devices) in
+    let modems = identify ~timeout connection devices startups in
+    group (List.fold_right (fun m l -> match m with
+                                       | Some m -> m :: l
+                                       | None -> l) modems [])
+end
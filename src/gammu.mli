@@ -112,6 +112,7 @@ type error =
   | INI_KEY_NOT_FOUND   (** Pair section/value not found in INI file. *)
   | COULD_NOT_DECODE    (** Decoding SMS Message failed. *)
   | INVALID_CONFIG_NUM  (** Invalid config number. *)
+  | DEADLINE_EXCEEDED   (** Operation aborted by {!Gammu.with_timeout}. *)
 
 val string_of_error : error -> string
 (** [string_of_error e] returns a textual description of the error [e]. *)
@@ -140,7 +141,25 @@ sig
 
   val set_output : info -> out_channel -> unit
   (** [set_debug_output di channel] sets output channel of [di] to
-      [channel]. *)
+      [channel].
+
+      @raise Invalid_argument if [di] is the debug info of a state
+      machine being traced (see {!Gammu.Trace}). *)
+
+  val set_output_buffer : info -> size:int -> unit
+  (** [set_output_buffer di ~size] keeps the last [size] bytes of debug
+      output of [di] in memory instead of writing them to a channel.
+      Use {!snapshot} to retrieve them, e.g. when an error occurs.  For
+      the debug info of a state machine, this replaces {!Gammu.Log} and
+      conversely.  Calling it again empties the buffer.
+
+      @raise Invalid_argument if [size < 1] or if [di] is the debug info
+      of a state machine being traced: {!Gammu.Trace} reads the frames
+      from the log. *)
+
+  val snapshot : info -> string
+  (** [snapshot di] returns the content of the buffer set with
+      {!set_output_buffer}, oldest byte first ([""] if none). *)
 
   val set_level : info -> string -> unit
   (** [set_debug_level di level] sets debug level on [di] according to
@@ -221,7 +240,8 @@ type connection_type =
   | NONE
 
 val get_debug : t -> Debug.info
-(** Gets debug information for state machine. *)
+(** Gets debug information for state machine.  It refers to the state
+    machine: after {!free}, using it raises [Invalid_argument]. *)
 
 val init_locales : ?path:string -> unit -> unit
 (** Initializes locales. This sets up things needed for proper string
@@ -232,15 +252,33 @@ val init_locales : ?path:string -> unit -> unit
     @param path Path to gettext translation. If not set, compiled in
     default is used. *)
 
-val make : ?section: int -> unit -> t
+val make : ?path:string -> ?section: int -> unit -> t
 (** Make a new clean state machine.  It is automatically configured
     using {!load_gammurc}.  If you want to configure it yourself, use
     {!push_config} to supersede the configuration with the one of your
     choice.
 
+    @param path path of the gammurc file (default: autodetection is
+    performed).
+
     @param section section number of the gammurc file to read. See
     {!Gammu.INI.config} for details. *)
 
+val free : t -> unit
+(** [free s] closes the connection of [s], if any, and releases its
+    memory at once instead of when [s] is garbage collected.  The
+    messages still being read ahead by {!SMS.fold_prefetch} are dropped
+    first.  Once [free] returns, using [s], or the {!Debug.info}
+    returned by {!get_debug} for it, raises [Invalid_argument]; freeing
+    it again does nothing.
+
+    Only the calls made after [free] are checked: [s] must not be in use
+    by another thread (e.g. waiting for the phone) when it is freed, the
+    call would then use the released memory.
+
+    @raise Error if closing the connection failed (the memory is
+    released anyway). *)
+
 val get_config : ?num:int -> t -> config
 (** [get_config s ~num] gets gammu configuration from state machine [s],
     where [num] is the number of the section to read, starting from
@@ -271,7 +309,136 @@ val load_gammurc : ?path:string -> ?section:int -> t -> unit
     @param section section number of the gammurc file to read. See
     {!Gammu.INI.config} for details. *)
 
-val connect : ?log:(string -> unit) -> ?replies:int -> t -> unit
+val with_timeout : t -> float -> (unit -> 'a) -> 'a
+(** [with_timeout s timeout f] evaluates [f ()] and aborts the operation
+    running on [s] if it is not finished after [timeout] seconds.  This
+    protects against phones that stop answering, which would otherwise
+    block the calling thread forever.
+
+    All functions of this module talking to the phone accept an optional
+    argument [?timeout] with the same meaning (applying to the whole call).
+
+    After an operation was aborted, all subsequent ones fail with
+    [ABORTED]: the connection must be re-established with {!disconnect}
+    and {!connect}.  The operation is only aborted while it waits for
+    libGammu: if the deadline expires between two operations of [f], the
+    next one is aborted, and if it expires after the last one returned,
+    [s] stays usable.  If [with_timeout] is used inside [f], the outer
+    deadline only is enforced.
+
+    @raise Error DEADLINE_EXCEEDED if [f] was aborted after [timeout]
+    seconds.
+
+    @raise Error NOTIMPLEMENTED if the version of libGammu does not allow
+    to abort operations.
+
+    @raise Invalid_argument if [timeout] is negative. *)
+
+(** Logging of the communication with the phone.  Lines logged by libGammu
+    are stored, with their time, in a ring buffer of the state machine,
+    without calling OCaml code.  They are retrieved with {!Gammu.Log.drain}
+    or written to a file by a background thread. *)
+module Log : sig
+  type record = {
+    time : float;  (** Time at which the line was logged, see {!now}. *)
+    text : string; (** Logged line (truncated to 511 bytes). *)
+  }
+
+  val now : unit -> float
+  (** [now()] returns the current time, in seconds, of a monotonic clock
+      (unrelated to the calendar time). *)
+
+  val enable : ?level:string -> ?capacity:int -> ?file:string -> t -> unit
+  (** [enable s] starts storing the lines logged for [s].  It replaces the
+      previous logging setup of [s], if any.  Lines are only logged
+      once connected, see {!Gammu.connect}.
+
+      @param level debug level (see {!Gammu.Debug.set_level}) set in
+      all configurations of [s].  The filtering is done by libGammu
+      (default: keep the level of the configurations).
+
+      @param capacity maximum number of lines kept until they are
+      drained.  When the buffer is full, new lines are dropped
+      (default: 1024).
+
+      @param file append the lines, prefixed by their time, to the file
+      [file] instead of keeping them for {!drain}.
+
+      @raise Error CANTOPENFILE if [file] cannot be opened. *)
+
+  val disable : t -> unit
+  (** [disable s] stops logging for [s] and discards the pending lines.
+
+      @raise Invalid_argument if [s] is being traced (see {!Gammu.Trace}),
+      since the frames are found in the log. *)
+
+  val drain : t -> record array
+  (** [drain s] removes and returns the lines logged for [s] since the last
+      call, oldest first. *)
+
+  val dropped : t -> int
+  (** [dropped s] returns the number of lines lost because the buffer was
+      full. *)
+
+  val flush : t -> unit
+  (** [flush s] drains the lines of [s] to the [log] function given to
+      {!Gammu.connect}, if any.  This is done automatically at the end of
+      each operation on the phone. *)
+end
+
+(** Tracing of the communication with the phone, to find where the time
+    is spent. *)
+module Trace : sig
+  type kind =
+    | Call     (** Call of a libGammu function. *)
+    | Sent     (** Frame sent to the phone. *)
+    | Received (** Frame received from the phone. *)
+
+  type event = {
+    kind : kind;
+    stub : string;     (** libGammu function (e.g. ["GetNextSMS"]) during
+                           which the event happened ([""] if none). *)
+    start : float;     (** Time of the event, see {!Gammu.Log.now}. *)
+    duration : float;  (** Duration of the call, [0.] for frames. *)
+    size : int;        (** Size of the frame in bytes, [0] for calls. *)
+    label : string;    (** Beginning of the frame as text (e.g. the AT
+                           command), may be empty. *)
+  }
+
+  val start : ?capacity:int -> ?level:string -> t -> unit
+  (** [start s] records the libGammu functions called on [s] and the frames
+      exchanged with the phone.  Frames are found in the lines logged by
+      libGammu: if {!Gammu.Log} is not enabled, it is with the debug level
+      [level] (default: ["text"]).  Any previous trace is discarded.
+      Until {!stop} is called, the log can neither be disabled nor
+      replaced by {!Debug.set_output} or {!Debug.set_output_buffer}.
+
+      @param capacity maximum number of events kept until they are
+      retrieved with {!events}.  Newer events are dropped (default: 4096). *)
+
+  val stop : t -> unit
+  (** [stop s] stops tracing and discards the events not retrieved. *)
+
+  val events : t -> event array
+  (** [events s] removes and returns the events recorded since the last
+      call, in the order they were completed. *)
+
+  val dropped : t -> int
+  (** [dropped s] returns the number of events lost because the buffer was
+      full. *)
+
+  val output_chrome : ?pid:int -> out_channel -> event array -> unit
+  (** [output_chrome ch events] writes [events] in the Chrome trace event
+      format (open it with chrome://tracing or Perfetto).  Calls are on
+      thread 1.  On thread 2, each frame sent is shown with the frames
+      received after it, so their length is the latency of the command.
+
+      @param pid process identifier to use, to merge the traces of several
+      phones (default: [1]). *)
+end
+
+val connect : ?log:(string -> unit) -> ?replies:int -> ?timeout:float ->
+  t -> unit
 (** Initiates connection.
 
     IMPORTANT: do not forget to call disconnect when done as otherwise the
@@ -279,19 +446,43 @@ val connect : ?log:(string -> unit) -> ?replies:int -> t -> unit
     you have no reference to the state machine left, the GC may free it and by
     the same time terminate your connection.
 
-    @param log logging function.
+    @param log logging function.  It is given the lines logged by
+    libGammu (according to the debug level of the configuration) in
+    batches, at the end of each operation, see {!Gammu.Log.flush}.
 
     @param replies number of replies to wait for on each request (default: 3).
 
+    @param timeout see {!with_timeout} (default: no timeout).
+
     @raise UNCONFIGURED if no configuration was set. *)
 
+(** Outcome of the connection of a phone by {!connect_all}. *)
+type startup = {
+  machine : t;             (** State machine of the phone. *)
+  failure : error option;  (** [None] if the phone is connected. *)
+  connect_time : float;    (** Seconds taken by the connection. *)
+}
+
+val connect_all : ?replies:int -> ?timeout:float -> config list ->
+  startup list
+(** [connect_all cfgs] makes a state machine for each configuration of
+    [cfgs] (see e.g. {!Gammu.INI.config}) and connects all of them at
+    once, each in its own system thread, so that it takes as long as the
+    slowest phone instead of the sum of the times.  The results are in
+    the order of [cfgs].  The machines that failed to connect can be
+    given to {!connect} again.
+
+    @param replies see {!connect}.
+    @param timeout maximum time for each connection; an aborted one
+    fails with [DEADLINE_EXCEEDED] (default: no timeout). *)
+
 val disconnect : t -> unit
 
 val is_connected : t -> bool
 
 val get_used_connection : t -> connection_type
 
-val read_device : ?wait_for_reply:bool -> t -> int
+val read_device : ?wait_for_reply:bool -> ?timeout:float -> t -> int
 (** Attempts to read data from phone. Thus can be used for getting status
     of incoming events, which would not be found out without polling
     device.
@@ -300,6 +491,58 @@ val read_device : ?wait_for_reply:bool -> t -> int
 
     @param wait_for_reply whether to wait for some event (default true). *)
 
+(** Outcome of a configuration reload. *)
+type reload =
+  | Unchanged   (** The configuration is the same. *)
+  | Updated     (** The settings were changed in place. *)
+  | Reconnected (** The model, device or connection changed: the
+                    configuration was replaced and, if [s] was connected,
+                    the connection re-established. *)
+
+val reload_config : ?log:(string -> unit) -> ?replies:int -> ?timeout:float ->
+  t -> config -> reload
+(** [reload_config s cfg] replaces the top configuration of [s] (see
+    {!push_config}) by [cfg], without disconnecting [s] unless its
+    [model], [device] or [connection] changed.  The debug level applies
+    at once, [sync_time], [lock_device], [start_info] and [debug_file]
+    on the next connection and the texts when they are used.
+
+    [log], [replies] and [timeout] are given to {!connect} when
+    reconnecting. *)
+
+val reload_gammurc : ?path:string -> ?section:int -> ?log:(string -> unit) ->
+  ?replies:int -> ?timeout:float -> t -> reload
+(** [reload_gammurc s] reads the gammurc file again (see
+    {!load_gammurc}) and applies the configuration with
+    {!reload_config}. *)
+
+type gammurc_watch
+(** Watch of a gammurc file for a set of state machines. *)
+
+val watch_gammurc : ?section:int -> path:string -> t list -> gammurc_watch
+(** [watch_gammurc ~path machines] watches the gammurc file [path] for
+    the state machines [machines], configured from [section] (default:
+    [0]) of that file.
+
+    @raise Error CANTOPENFILE if [path] does not exist. *)
+
+val poll_gammurc : ?log:(string -> unit) -> ?replies:int -> ?timeout:float ->
+  ?on_err:(t -> error -> unit) -> ?on_parse_err:(error -> unit) ->
+  gammurc_watch -> (t * reload) list
+(** [poll_gammurc w] reloads the configuration of the state machines of
+    [w] (see {!reload_config}) if the file was modified since the last
+    call and returns the ones that changed.  The file is parsed once for
+    all machines.  The modification time has a resolution of one second,
+    so edits made within the same second as the previous poll may be
+    seen only by the next modification.
+
+    @param on_err called with the machines failing to reload (e.g. to
+    reconnect); the other ones are still reloaded.
+    @param on_parse_err called when the file cannot be read or parsed
+    (e.g. caught in the middle of a save); no machine is reloaded and
+    the file is parsed again at the next call.  A file briefly missing
+    (replaced by a rename) is treated as unmodified.  Default: ignore. *)
+
 
 (************************************************************************)
 (** {2 INI files} *)
@@ -315,14 +558,17 @@ module INI : sig
      public interface ? *)
   type sections
 
-  val read : ?unicode:bool -> string -> sections
+  val read : ?unicode:bool -> ?index:bool -> string -> sections
   (** [read fname] reads INI data from the file [fname].
 
       @param unicode Whether file should be treated as unicode encoded
       (default = [false], beware that unicode handling is somewhat buggy in
-      libGammu). *)
+      libGammu).
+      @param index Whether to build a hash table of the entries, so that
+      {!get_value} and {!find} do not search the libGammu lists for each
+      key (default = [false]). *)
 
-  val of_gammurc : ?path:string -> unit -> sections
+  val of_gammurc : ?path:string -> ?index:bool -> unit -> sections
   (** Finds and reads gammu configuration file.  The search order depends on
       platform.  On POSIX systems it looks for ~/.gammurc and then for
       /etc/gammurc and also follows freedesktop.org/XDG specifications and
@@ -332,6 +578,7 @@ module INI : sig
 
       @param path force the use of a custom path instead of the autodetected
       one (default: autodetection is performed).
+      @param index see {!read}.
 
       Raises [Error CANTOPENFILE] if no gammu rc file can be found.
       Raises [Error FILENOTSUPPORTED] if first found gammu rc file is
@@ -343,8 +590,33 @@ module INI : sig
       [section].  Beware that [num]th section is in facts the section named
       "gammu[num]" in the file itself. *)
 
+  val free : sections -> unit
+  (** [free ini] releases the libGammu representation of [ini] at once
+      instead of when [ini] is garbage collected.  The functions needing
+      it afterwards raise [Invalid_argument], {!get_value} with an index,
+      {!sections} and {!fold} still work if the entries were already
+      copied.  Freeing [ini] again does nothing. *)
+
   val get_value : sections -> section:string -> key:string -> string
-  (** @return value of the INI file entry. *)
+  (** @return value of the INI file entry.  Section and key names are
+      case insensitive.
+
+      Raises [Error INI_KEY_NOT_FOUND] if there is no such entry. *)
+
+  val find : sections -> section:string -> key:string -> string option
+  (** Same as {!get_value} but returns [None] if there is no such
+      entry. *)
+
+  val sections : sections -> string list
+  (** [sections ini] returns the names of the sections of [ini]. *)
+
+  val fold : sections -> ('a -> string -> string -> string -> 'a) -> 'a -> 'a
+  (** [fold ini f a] computes [f (... (f a s1 k1 v1) ...) sN kN vN]
+      where [(si, ki, vi)] are the section, key and value of the entries
+      of [ini], in the order {!get_value} searches them.
+
+      The entries of [ini] are copied once, on the first call to
+      {!sections} or [fold] (or by {!read} with [~index:true]). *)
 end
 
 
@@ -362,11 +634,11 @@ type security_code_type =
   | SEC_Phone   (** Phone code needed. *)
   | SEC_Network (** Network code needed. *)
 
-val enter_security_code :
+val enter_security_code : ?timeout:float ->
   t -> code_type:security_code_type -> code:string -> unit
 (** Enter security code (PIN, PUK,...). *)
 
-val get_security_status : t -> security_code_type
+val get_security_status : ?timeout:float -> t -> security_code_type
 (** Query whether some security code needs to be entered. *)
 
 
@@ -463,30 +735,45 @@ sig
       code [code], of the form "\[0-9\]\{3\}" (the first 3 digits of the
       network code). *)
 
-  val battery_charge : t -> battery_charge
+  (** The names are memoized: libGammu is searched once per code and
+      equal codes give physically equal strings. *)
+
+  val network_code_names : string array -> string array
+  (** [network_code_names codes] is [Array.map network_code_name codes]
+      in a single call. *)
+
+  val country_code_names : string array -> string array
+  (** [country_code_names codes] is [Array.map country_code_name codes]
+      in a single call. *)
+
+  val battery_charge : ?timeout:float -> t -> battery_charge
   (** @return information about battery charge and phone charging state. *)
 
-  val firmware : t -> firmware
+  val firmware : ?timeout:float -> t -> firmware
 
-  val hardware : t -> string
+  val hardware : ?timeout:float -> t -> string
 
-  val imei : t -> string
+  val imei : ?timeout:float -> t -> string
   (** @return IMEI (International Mobile Equipment Identity) / Serial
       Number *)
 
-  val manufacture_month : t -> string
+  val imsi : ?timeout:float -> t -> string
+  (** @return IMSI (International Mobile Subscriber Identity) of the SIM
+      card. *)
+
+  val manufacture_month : ?timeout:float -> t -> string
 
-  val manufacturer : t -> string
+  val manufacturer : ?timeout:float -> t -> string
 
-  val model : t -> string
+  val model : ?timeout:float -> t -> string
 
-  val model_info : t -> phone_model
+  val model_info : ?timeout:float -> t -> phone_model
 
-  val network_info : t -> network
+  val network_info : ?timeout:float -> t -> network
 
-  val product_code : t -> string
+  val product_code : ?timeout:float -> t -> string
 
-  val signal_quality : t -> signal_quality
+  val signal_quality : ?timeout:float -> t -> signal_quality
 
 end
 
@@ -543,6 +830,39 @@ sig
 
       @param timezone Whether to include time zone (default false). *)
 
+  val epoch : t -> int64
+  (** [epoch dt] returns the number of seconds from 1970-01-01 00:00 UTC
+      to [dt] (taking its [timezone] into account), or [0L] if [dt] has
+      no valid month (i.e. no date was given). *)
+
+  (** Compact representation of a date and time, cheaper to store and
+      compare than {!t}. *)
+  type stamp = {
+    epoch : int64;  (** Seconds from 1970-01-01 00:00 UTC, see {!epoch}. *)
+    tz_offset : int; (** The [timezone] of the date, in seconds. *)
+  }
+
+  val to_stamp : t -> stamp
+  (** [to_stamp dt] is [{ epoch = epoch dt; tz_offset = dt.timezone }]. *)
+
+  val of_stamp : stamp -> t
+  (** [of_stamp st] is the date and time of [st] in the timezone
+      [st.tz_offset].  [of_stamp (to_stamp dt)] is [dt] for valid
+      dates. *)
+
+  val compare_stamp : stamp -> stamp -> int
+  (** [compare_stamp st1 st2] compares the instants [st1] and [st2],
+      regardless of their timezones. *)
+
+  val format : ?timezone:bool -> t -> string
+  (** [format dt] returns [dt] as ["YYYY-MM-DD hh:mm:ss"], followed by
+      [" +hh:mm"] if [timezone] is [true] (default [false]).  Unlike
+      {!os_date_time}, it does not depend on the locale and is safe to
+      call from several threads. *)
+
+  val format_stamp : ?timezone:bool -> stamp -> string
+  (** [format_stamp st] is [format (of_stamp st)]. *)
+
 end
 
 
@@ -754,10 +1074,11 @@ module SMS : sig
   val default_received : message
   (** Empty message with default values needed for saving a received SMS. *)
 
-  val get : t -> folder:int -> message_number:int -> multi_sms
+  val get : ?timeout:float -> t -> folder:int -> message_number:int ->
+    multi_sms
   (** Read a SMS message. *)
 
-  val fold : t -> ?folder:int -> ?n:int -> ?retries:int ->
+  val fold : t -> ?folder:int -> ?n:int -> ?retries:int -> ?timeout:float ->
     ?on_err:(int -> error -> unit) -> ('a -> multi_sms -> 'a) -> 'a -> 'a
   (** [fold s f a] fold SMS messages through the function [f] with [a] as
       initial value, iterating trough SMS' *and* folders).
@@ -782,6 +1103,9 @@ module SMS : sig
       forever (since the location argument is ignored in their
       driver). (default = 2)
 
+      @param timeout maximum duration of the retrieval of each message, see
+      {!Gammu.with_timeout} (default: no timeout).
+
       @param on_err function to handle errors [UNKNOWN] or [CORRUPTED]. The
       location of the SMS message for which the next one failed to be read and
       the error are given (default: does nothing).
@@ -791,20 +1115,509 @@ module SMS : sig
 
       @raise NOTSUPPORTED if the mechanism is not supported by the phone. *)
 
-  val set : t -> message -> int * int
+  val fold_stamped : t -> ?folder:int -> ?n:int -> ?retries:int ->
+    ?timeout:float -> ?on_err:(int -> error -> unit) ->
+    ('a -> DateTime.stamp -> multi_sms -> 'a) -> 'a -> 'a
+  (** [fold_stamped s f a] is like {!Gammu.SMS.fold} but also gives [f]
+      the date of each message (the one of its first part) as a
+      {!Gammu.DateTime.stamp} computed while decoding it.  To sort a
+      folder by date, collect the pairs and compare them with
+      {!Gammu.DateTime.compare_stamp}. *)
+
+  (** Statistics of {!Gammu.SMS.fold_prefetch}, durations in seconds. *)
+  type prefetch_stats = {
+    fetched : int;          (** Number of messages read. *)
+    fetch_time : float;     (** Time spent reading from the phone. *)
+    producer_wait : float;  (** Time the reading waited for room in the
+                                queue, i.e. for the folded function. *)
+    consumer_wait : float;  (** Time the folded function waited for
+                                messages. *)
+  }
+
+  val overlap : prefetch_stats -> float
+  (** [overlap st] is the fraction of the reading time during which the
+      folded function was running rather than waiting for a message,
+      between [0.] (no gain over {!Gammu.SMS.fold}) and [1.]. *)
+
+  val fold_prefetch : t -> ?folder:int -> ?n:int -> ?retries:int ->
+    ?depth:int -> ?timeout:float -> ?on_err:(int -> error -> unit) ->
+    ?stats:(prefetch_stats -> unit) -> ('a -> multi_sms -> 'a) -> 'a -> 'a
+  (** [fold_prefetch s f a] is like {!Gammu.SMS.fold} but the messages
+      are read by a system thread, without the runtime lock, while [f]
+      processes the previous ones.  The reading stays at most [depth]
+      messages ahead of [f] (default: [4], at most [64]).  The phone
+      [s] must not be used by [f].  Since the reading thread writes to
+      the log of [s], {!Gammu.Log.enable}, {!Gammu.Log.disable},
+      {!Gammu.Trace.start}, {!Gammu.Trace.stop} and the
+      [Debug.set_output*] functions raise [Invalid_argument] on [s]
+      until the fold is over.
+
+      @param timeout see {!Gammu.with_timeout}, it applies to the whole
+      fold, [f] included.
+
+      @param stats function called with the statistics of the fold once
+      it is over, even if it is interrupted by an exception.
+
+      @raise NOTIMPLEMENTED if the bindings were built without threads.
+      @raise Invalid_argument if a [fold_prefetch] is already running
+      on [s].
+
+      See {!Gammu.SMS.fold} for the other arguments. *)
+
+  (** Messages stored column by column, without an OCaml value per
+      message.  Row [i] describes one SMS (a part of multipart
+      messages).  Variants are encoded by the position of their
+      constructor, starting from [0] (e.g. [Unread] is [3]). *)
+  type columns = {
+    count : int;  (** Number of rows. *)
+    time : (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    (** Date and time of the message as seconds since 1970-01-01 00:00 UTC,
+        [0L] if not known. *)
+    state : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    (** {!state} of the message. *)
+    folder : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    location : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    coding : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    (** {!coding} of the message. *)
+    sms_class : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    (** Class of the message, [-1] if none. *)
+    offsets : (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array1.t;
+    (** The number of row [i] is in [arena] between offsets
+        [offsets.{2i}] (included) and [offsets.{2i+1}] (excluded), its
+        text between [offsets.{2i+1}] and [offsets.{2i+2}]. *)
+    arena : (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout)
+              Bigarray.Array1.t;
+    (** Numbers and texts of all rows, UTF-8 encoded. *)
+  }
+
+  val columns : ?folder:int -> ?n:int -> ?timeout:float -> t -> columns
+  (** [columns s] reads the messages like {!Gammu.SMS.fold} but stores
+      them in columns, built in C without the runtime lock and with no
+      OCaml allocation per message.  Messages which cannot be read
+      ([UNKNOWN] or [CORRUPTED] errors) are skipped.
+
+      @param folder folder from where to start (default: [0]).
+
+      @param n maximum number of messages (multipart messages counting
+      for one) to read.  If negative, all are read (default: [-1]).
+
+      @param timeout see {!Gammu.with_timeout}, it applies to the whole
+      reading. *)
+
+  val column_number : columns -> int -> string
+  (** [column_number c i] returns the number of row [i] of [c]. *)
+
+  val column_text : columns -> int -> string
+  (** [column_text c i] returns the text of row [i] of [c]. *)
+
+  val set : ?timeout:float -> t -> message -> int * int
   (** [set s sms] sets [sms] at the specified location and folder (given in
       {!SMS.message} representation). And returns a couple for folder and
       location really set (after transformation). *)
 
-  val add : t -> message -> int * int
+  val add : ?timeout:float -> t -> message -> int * int
   (** [add s sms] adds [sms] to the folder specified in the [folder]
       field of [sms] and returns the couple folder and location where
       the message was stored (folder may be transformed). The location
       fields of [sms] are ignored when adding SMS, put whatever you
       want there. *)
 
-  val send : t -> message -> unit
-  (** [send s sms] sends the [sms]. *)
+  val send : ?timeout:float -> t -> message -> unit
+  (** [send s sms] sends the [sms].
+
+      If [sms.smsc] has a non-zero [smsc_location] and no
+      [smsc_number], the number (and the validity, if [sms] has none)
+      of the SMSC at this location is used.  It is read from the phone
+      once and then kept in [s], see {!Gammu.SMS.get_smsc}. *)
+
+  val get_smsc : ?timeout:float -> ?location:int -> t -> smsc
+  (** [get_smsc s] reads the SMSC stored at [location] (default: [1],
+      the first one) of the SIM.  It also becomes the SMSC used by the
+      messages sent through [s] with this SMSC location, without reading
+      it again for each message. *)
+
+  val set_smsc : ?timeout:float -> t -> smsc -> unit
+  (** [set_smsc s smsc] changes the SMSC at location [smsc.smsc_location]
+      of the SIM. *)
+
+  val cached_smsc : t -> smsc option
+  (** [cached_smsc s] returns the SMSC kept by [s], if any.  It is
+      forgotten when [s] connects or disconnects, when a security code
+      is entered and by {!Gammu.SMS.set_smsc}. *)
+
+  val clear_smsc_cache : t -> unit
+  (** [clear_smsc_cache s] forgets the SMSC kept by [s], e.g. after the
+      SIM was changed. *)
+
+  type template
+  (** Message converted once to libGammu representation, with a
+      placeholder to be filled for each send. *)
+
+  val template : message -> placeholder:string -> template
+  (** [template sms ~placeholder] prepares [sms] to be sent many times
+      with the first occurrence of [placeholder] in its text replaced
+      by a different content (e.g. a one-time password).
+
+      @raise Invalid_argument if [placeholder] is empty or is not
+      found in the text of [sms]. *)
+
+  val send_template : ?timeout:float ->
+    t -> template -> number:string -> string -> unit
+  (** [send_template s tpl ~number fill] sends the message [tpl] to
+      [number] with its placeholder replaced by [fill].  This is
+      equivalent to {!Gammu.SMS.send} but the conversion of the message
+      is only performed once, when creating [tpl].
+
+      @raise Invalid_argument if [fill] does not have the same number of
+      characters as the placeholder. *)
+
+  (** Status of a message sent with {!Gammu.SMS.send_async}. *)
+  type send_status =
+    | Send_pending       (** The phone did not report the status yet. *)
+    | Send_ok of int     (** Message sent, with the given message
+                             reference. *)
+    | Send_error of int  (** Sending failed with the given status code
+                             (as reported by the phone, [-1] if the
+                             connection was terminated meanwhile). *)
+
+  type sending
+  (** Handle on a message submitted with {!Gammu.SMS.send_async}. *)
+
+  val send_async : ?max_in_flight:int -> ?timeout:float ->
+    t -> message -> sending
+  (** [send_async s sms] submits [sms] for sending and returns without
+      waiting for the phone to report the final status of the message.
+      Statuses are reported by libGammu while the phone is polled,
+      e.g. with {!Gammu.read_device} or {!Gammu.SMS.wait_send}.
+
+      @param max_in_flight maximum number of messages submitted on [s]
+      whose status is not known yet (between 1 and 64, default: 4).  If
+      this number is reached, [send_async] first reads from the device
+      until a status is reported.  If the phone reports no status for
+      30 seconds, the messages in flight are marked as failed
+      ([Send_error (-1)]). *)
+
+  val send_status : sending -> send_status
+  (** [send_status h] returns the current status of the message [h].
+
+      @raise Invalid_argument if [h] is too old: the statuses of the 64
+      last reported messages only are remembered. *)
+
+  val wait_send : ?timeout:float -> sending -> send_status
+  (** [wait_send h] reads from the device until the status of [h] is
+      known and returns it (never [Send_pending]).  Like
+      {!Gammu.SMS.send_async}, it gives up after 30 seconds without any
+      status reported and then returns [Send_error (-1)]. *)
+
+  val in_flight : t -> int
+  (** [in_flight s] returns the number of messages submitted on [s],
+      including with {!Gammu.SMS.send}, whose status was not reported
+      yet. *)
+
+  (** Journal of messages to send, kept in a file so that a restarted
+      program knows which messages were already submitted.
+
+      Each change is appended to the file.  To keep the cost low, the
+      file is only synchronized to the disk ([fsync]) after a number of
+      changes or some time (group commit), except before submitting
+      messages to the phone.  The journal is rewritten, without the
+      sent, failed and rejected messages, when it grows too much.
+
+      The messages are stored with [Marshal], whose format may change
+      between versions of OCaml: empty the journal (all messages sent,
+      failed or rejected) before upgrading the compiler. *)
+  module Outbox :
+  sig
+    type journal
+
+    type id = int
+    (** Identifier of a message in a journal. *)
+
+    type state =
+      | Queued           (** To be sent. *)
+      | Submitted        (** Given to the phone, result unknown. *)
+      | Sent of int      (** Sent, with the given message reference. *)
+      | Failed of int    (** Sending failed with the given status. *)
+      | Rejected of string (** Refused at once by libGammu or the
+                               bindings (e.g. invalid number), with the
+                               reason.  It is not tried again. *)
+
+    val create : ?sync_every:int -> ?sync_interval:float ->
+      ?compact_every:int -> string -> journal
+    (** [create path] opens the journal stored in [path], creating it if
+        needed, and recovers its messages.  Messages that were
+        [Submitted] when the program stopped are returned by
+        {!in_doubt}: they may or may not have been sent.
+
+        @param sync_every number of changes after which the file is
+        synchronized (default: [64]).
+        @param sync_interval seconds after which the pending changes are
+        synchronized, at the next change (default: [1.]).
+        @param compact_every number of records from which the journal is
+        rewritten (default: [10_000]). *)
+
+    val close : journal -> unit
+    (** [close j] synchronizes and closes [j]. *)
+
+    val sync : journal -> unit
+    (** [sync j] writes all changes of [j] to the disk. *)
+
+    val compact : journal -> unit
+    (** [compact j] rewrites [j] now, forgetting the sent, failed and
+        rejected messages. *)
+
+    val enqueue : journal -> message -> id
+    (** [enqueue j sms] adds [sms] to the messages to send. *)
+
+    val state : journal -> id -> state
+    (** @raise Not_found if the message is unknown or was forgotten. *)
+
+    val queued : journal -> (id * message) list
+    (** Messages to send, oldest first. *)
+
+    val in_doubt : journal -> (id * message) list
+    (** Messages [Submitted] but whose result is not known, oldest
+        first. *)
+
+    val requeue : journal -> id -> unit
+    (** [requeue j id] marks the message [id] (e.g. in doubt or failed)
+        to be sent again.  @raise Not_found if [id] is unknown. *)
+
+    val cancel : journal -> id -> unit
+    (** [cancel j id] removes the message [id] from [j].
+        @raise Not_found if [id] is unknown. *)
+
+    val send_pending : ?max:int -> ?max_in_flight:int -> ?timeout:float ->
+      journal -> t -> (id * state) list
+    (** [send_pending j s] sends, with {!Gammu.SMS.send_async}, at most
+        [max] (between 1 and 64, default: [64]) queued messages of [j]
+        through [s] and waits for their status.  Their submission is
+        synchronized to the disk (once for all) before the first one is
+        sent.  It returns the new state of each message of the batch.
+
+        A message refused at once (e.g. with [Error] [INVALIDDATA] or
+        [Invalid_argument]) is marked [Rejected] and the next ones are
+        sent.  On other exceptions, notably when the phone no longer
+        answers ([NOTCONNECTED], [TIMEOUT], [DEADLINE_EXCEEDED], device
+        errors,...), the exception is re-raised and the messages not yet
+        given to the phone are queued again. *)
+  end
+
+  (** Queue of messages to send through one phone, by priority and
+      deadline, with a rate limit. *)
+  module Scheduler :
+  sig
+    type priority =
+      | Urgent  (** Always sent first (e.g. one-time passwords). *)
+      | Normal
+      | Bulk    (** Only sent when no other message is waiting. *)
+
+    type queue
+
+    (** Statistics of a priority class.  Waits are in seconds, from
+        {!submit} to the end of the sending. *)
+    type class_stats = {
+      queued : int;        (** Messages currently waiting. *)
+      sent : int;
+      expired : int;       (** Messages dropped because of their
+                               deadline. *)
+      failed : int;        (** Messages dropped after [max_attempts]
+                               failed sendings. *)
+      total_wait : float;  (** Sum of the waits of the sent messages. *)
+      max_wait : float;
+    }
+
+    val create : ?rate:float -> ?burst:float ->
+      ?on_expire:(priority -> message -> unit) -> ?max_attempts:int ->
+      ?on_failure:(priority -> message -> exn -> unit) -> unit -> queue
+    (** [create ()] returns an empty scheduler.  It is meant to be used
+        for a single phone.
+
+        @param rate maximum number of messages sent per second, on
+        average (default: [1.]).
+        @param burst maximum number of messages sent at once after an
+        idle period (token bucket size, default: [1.]).
+        @param on_expire function called with the messages dropped
+        because their deadline passed (default: does nothing).
+        @param max_attempts number of times sending a message is tried
+        before it is dropped (default: [3]).
+        @param on_failure function called with the messages dropped
+        after [max_attempts] failures and the last exception raised
+        (default: does nothing).
+
+        @raise Invalid_argument if [rate <= 0.], [burst < 1.] or
+        [max_attempts < 1]. *)
+
+    val validity_period : validity -> float option
+    (** [validity_period v] returns the duration, in seconds, of the
+        validity [v], or [None] if it has none. *)
+
+    val submit : queue -> ?priority:priority -> ?deadline:float -> message ->
+      unit
+    (** [submit q sms] queues [sms].  Messages of a class are sent by
+        increasing deadline.
+
+        @param priority (default: [Normal]).
+        @param deadline number of seconds after which [sms] is no longer
+        worth sending (default: the validity of [sms.smsc], if any). *)
+
+    val length : queue -> int
+    (** [length q] returns the number of messages waiting in [q]. *)
+
+    val stats : queue -> priority -> class_stats
+
+    (** Result of {!step}. *)
+    type step =
+      | Sent of priority * message  (** This message was sent. *)
+      | Throttled of float          (** Rate limited, or the messages
+                                        wait to be sent again after a
+                                        failure: retry in the given
+                                        number of seconds. *)
+      | Idle                        (** No message waiting. *)
+
+    val step : ?timeout:float -> queue -> t -> step
+    (** [step q s] drops the expired messages and, if the rate limit
+        allows it, sends the most urgent message of [q] with
+        {!Gammu.SMS.send}.  If sending raises an exception, it is
+        re-raised and the message stays queued, to be tried again after
+        [2{^n}/rate] seconds on the [n]th failure, while the next
+        classes are served.  After [max_attempts] failures, it is
+        dropped instead (see [on_failure]).
+
+        @param timeout see {!Gammu.with_timeout}. *)
+  end
+
+  (** Append-only archive file of messages, indexed by sender number and
+      by time.
+
+      Messages are appended by a {!writer} (e.g. from {!Gammu.SMS.fold}
+      or {!Gammu.incoming_sms}) and read through a {!reader}, which maps
+      the file in memory: queries use indexes built when the reader is
+      opened and only the requested fields are copied.  A reader does not
+      see the messages appended after it was opened. *)
+  module Archive :
+  sig
+    val normalize_number : string -> string
+    (** [normalize_number n] removes the separators (spaces, dashes,
+        dots, parentheses) of the phone number [n] and replaces a
+        leading "00" by "+".  Alphanumeric senders are unchanged.
+        Numbers are stored and looked up normalized. *)
+
+    type writer
+
+    val open_writer : string -> writer
+    (** [open_writer path] opens the archive [path] to append messages,
+        creating it if needed.  A message partly written when the program
+        was stopped is removed.
+
+        @raise Error FILENOTSUPPORTED if [path] is not an archive. *)
+
+    val append : writer -> message -> unit
+    (** [append w sms] adds [sms] to the archive.  The messages are
+        buffered, see {!flush}. *)
+
+    val flush : writer -> unit
+    (** [flush w] writes the buffered messages to the file. *)
+
+    val close_writer : writer -> unit
+
+    type reader
+
+    type entry
+    (** A message of a reader.  The functions below raise
+        [Invalid_argument] when given an entry of another reader. *)
+
+    val open_reader : string -> reader
+    (** [open_reader path] maps the archive [path] in memory and indexes
+        it.
+
+        @raise Error CANTOPENFILE if [path] cannot be read.
+        @raise Error FILENOTSUPPORTED if [path] is not an archive. *)
+
+    val close_reader : reader -> unit
+    (** [close_reader r] releases the memory of [r] without waiting for
+        the GC.  [r] must not be used afterwards. *)
+
+    val length : reader -> int
+    (** Number of messages. *)
+
+    val nth : reader -> int -> entry
+    (** [nth r i] is the message number [i] of [r], by increasing time. *)
+
+    val fold : reader -> ('a -> entry -> 'a) -> 'a -> 'a
+    (** [fold r f a] folds [f] over the messages of [r] by increasing
+        time. *)
+
+    val range : ?number:string -> ?from:int64 -> ?until:int64 -> reader ->
+      entry array
+    (** [range r] returns the messages sent by [number] (default: all)
+        with a time between [from] and [until] (included, in seconds
+        since the epoch, see {!Gammu.DateTime.epoch}), by increasing
+        time.  It only reads the indexes. *)
+
+    val time : reader -> entry -> int64
+    (** Time of the message, see {!Gammu.DateTime.epoch}. *)
+
+    val number : reader -> entry -> string
+    (** Normalized number of the message. *)
+
+    val text : reader -> entry -> string
+
+    val state : reader -> entry -> state
+
+    val coding : reader -> entry -> coding
+
+    val sms_class : reader -> entry -> char
+
+    val folder : reader -> entry -> int
+  end
+
+  (** SMS backup files in libGammu format, as written by
+      [gammu backupsms] and read by [gammu restoresms].
+
+      The messages are kept in the C heap, not in the OCaml one, until
+      the file is written or while it is read: reading frees each message
+      once it is converted.  libGammu reads and writes a backup file as a
+      whole and does not handle more than 100000 messages. *)
+  module Backup :
+  sig
+    type writer
+
+    val open_writer : string -> writer
+    (** [open_writer path] starts a backup.  [path] is only (over)written
+        by {!close_writer}. *)
+
+    val append : writer -> message -> unit
+    (** [append w sms] adds [sms] to the backup.
+
+        @raise Error MOREMEMORY if the backup has 100000 messages. *)
+
+    val close_writer : writer -> unit
+    (** [close_writer w] writes the backup file and frees the messages.
+        [w] must not be used afterwards.
+
+        @raise Error CANTOPENFILE if the file cannot be written. *)
+
+    val export : ?folder:int -> ?timeout:float -> t -> string -> int
+    (** [export s path] writes all messages of the phone, read with
+        {!Gammu.SMS.fold}, to the backup file [path] and returns their
+        number.  The parts of multipart messages are saved separately, as
+        [gammu backupsms] does. *)
+
+    val fold : string -> ('a -> message -> 'a) -> 'a -> 'a
+    (** [fold path f a] folds [f] over the messages of the backup file
+        [path], in the file order.
+
+        @raise Error CANTOPENFILE if [path] cannot be read. *)
+
+    val restore : ?folder:int -> ?timeout:float -> t -> string ->
+      int * (int * error) list
+    (** [restore s path] adds the messages of the backup file [path] to
+        the phone with {!Gammu.SMS.add}, in [folder] (default: the folder
+        of each message).  It returns the number of messages added and,
+        for the others, their index in the file and the error.
+        [timeout] applies to each message. *)
+  end
 
   type folder = {
     box : folder_box;            (** Whether it is inbox or outbox. *)
@@ -813,7 +1626,7 @@ module SMS : sig
   }
   and folder_box = Inbox | Outbox
 
-  val folders : t -> folder array
+  val folders : ?timeout:float -> t -> folder array
   (** @return SMS folders information. *)
 
   (** Status of SMS memory. *)
@@ -829,7 +1642,7 @@ module SMS : sig
     phone_size : int;     (** Number of possible messages on phone. *)
   }
 
-  val get_status : t -> memory_status
+  val get_status : ?timeout:float -> t -> memory_status
   (** Get information about SMS memory
       (read/unread/size of memory for both SIM and
       phone). *)
@@ -837,9 +1650,45 @@ module SMS : sig
   val set_incoming_sms : t -> bool -> unit
   (** Enable/disable notification on incoming SMS. *)
 
-  val delete : t -> folder:int -> message_number:int -> unit
+  val delete : ?timeout:float -> t -> folder:int -> message_number:int -> unit
   (** Deletes SMS (SMS location and folder must be set). *)
 
+  val delete_many : ?timeout:float -> t -> (int * int) list ->
+    error option list
+  (** [delete_many s locations] deletes the SMS at each [(folder,
+      message_number)] of [locations], all in one call to the bindings.
+      It returns, in the same order, [None] for the deleted messages
+      and [Some e] for the ones that failed with error [e].  After an
+      [ABORTED] or [NOTCONNECTED] error, the remaining locations are not
+      tried and get the same error.
+
+      @param timeout see {!Gammu.with_timeout}, it applies to the whole
+      batch.  The locations not deleted in time get
+      [DEADLINE_EXCEEDED]. *)
+
+  (** What {!Gammu.SMS.drain} did with a message. *)
+  type drain_status =
+    | Kept                  (** Not acknowledged by the consumer. *)
+    | Deleted               (** Acknowledged and deleted. *)
+    | Not_deleted of error  (** Acknowledged but (a part of) it could
+                                not be deleted. *)
+
+  val drain : ?folder:int -> ?n:int -> ?retries:int -> ?timeout:float ->
+    ?on_err:(int -> error -> unit) -> t -> (multi_sms -> bool) ->
+    (multi_sms * drain_status) list
+  (** [drain s consumer] reads the messages as {!Gammu.SMS.fold} does
+      (see it for the optional arguments), gives each of them to
+      [consumer] and then deletes, with {!Gammu.SMS.delete_many}, all
+      parts of the messages for which [consumer] returned [true].  The
+      messages are returned in the order they were read, with what
+      happened to them.
+
+      Messages are only deleted once read and acknowledged: if the
+      program stops before, they are delivered again by the next
+      drain.  If [consumer] or the reading raises an exception, the
+      messages acknowledged so far are deleted before the exception is
+      re-raised. *)
+
 
   (** ID during packing SMS for Smart Messaging 3.0, EMS and other *)
   type encode_part_type_id =
@@ -976,6 +1825,14 @@ end
 (************************************************************************)
 (** {2 Events} *)
 
+(** The callbacks are not run by libGammu itself, which may be
+    waiting on the phone without the runtime lock or run in another
+    thread.  The events are queued and the callbacks called, in the
+    calling thread, when the function that received them returns
+    (e.g. {!read_device}).  An exception raised by a callback is
+    ignored: the function returns its result (or raises its own
+    exception) and the next events are still delivered. *)
+
 val incoming_sms : ?enable:bool -> t -> (SMS.message -> unit) -> unit
 (** [incoming_sms s f] register [f] as callback function in the event of an
     incoming SMS.
@@ -996,3 +1853,128 @@ val enable_incoming_call : t -> bool -> unit
 (** [enable_incoming_call t enable] enable incoming call events or not,
     according to [enable]. *)
 
+
+
+(************************************************************************)
+(** {2 Supervised connections} *)
+
+(** Connection kept alive through modem resets.
+
+    A supervisor periodically probes the phone with a cheap command.
+    When the link is found dead (by a probe or by an operation run
+    through {!use}), it reconnects with an exponential backoff and
+    replays the security code and the incoming events registration.
+    All the work is done by {!step}, which must be called regularly
+    (e.g. from the main loop), so no thread is needed. *)
+module Supervisor :
+sig
+  type supervisor
+
+  (** Statistics of the link.  Times are in seconds. *)
+  type stats = {
+    outages : int;          (** Number of times the link went down. *)
+    attempts : int;         (** Connection attempts. *)
+    downtime : float;       (** Total duration of the finished outages. *)
+    last_recovery : float;  (** Duration of the last finished outage. *)
+    max_recovery : float;
+  }
+
+  val create : ?log:(string -> unit) -> ?replies:int ->
+    ?connect_timeout:float -> ?probe_interval:float -> ?probe_timeout:float ->
+    ?min_backoff:float -> ?max_backoff:float -> ?pin_model:bool ->
+    t -> supervisor
+  (** [create s] supervises the connection of [s].  If [s] is not
+      connected, the first {!step} connects it.  [log], [replies] and
+      [connect_timeout] are given to {!Gammu.connect}.
+
+      @param probe_interval seconds between probes (default: [10.]).
+      @param probe_timeout timeout of probes and of the commands replayed
+      after connecting (default: [5.]).
+      @param min_backoff delay before the second connection attempt of
+      an outage, doubled after each failure (default: [1.]).
+      @param max_backoff maximum delay between attempts (default: [60.]).
+      @param pin_model whether to put the model detected at the first
+      connection (see {!Gammu.Info.model_info}) in the configuration, so
+      that libGammu does not identify the phone again when reconnecting
+      (default: [true]).  It is removed if the connection then fails
+      with [UNKNOWNMODELSTRING]. *)
+
+  val machine : supervisor -> t
+
+  val is_up : supervisor -> bool
+
+  val stats : supervisor -> stats
+
+  val step : supervisor -> bool
+  (** [step v] probes the phone if it is due or, if the link is down and
+      the backoff delay elapsed, tries to reconnect.  It returns whether
+      the link is up.  The [Error]s of the probes and of the connection
+      attempts are not raised. *)
+
+  val use : supervisor -> (t -> 'a) -> 'a
+  (** [use v f] runs [f] on the phone.  If [f] fails with an error
+      meaning the phone no longer answers ([NOTCONNECTED], [TIMEOUT],
+      [DEADLINE_EXCEEDED], device errors,...), the link is marked down
+      before the error is re-raised.
+
+      @raise Error NOTCONNECTED if the link is down. *)
+
+  val enter_security_code : ?timeout:float -> supervisor ->
+    code_type:security_code_type -> code:string -> unit
+  (** Same as {!Gammu.enter_security_code}.  The code is entered again
+      when the phone asks for it after a reconnection or a reset.  It is
+      forgotten if the phone rejects it, not to lock the SIM. *)
+
+  val incoming_sms : supervisor -> (SMS.message -> unit) -> unit
+  (** Same as {!Gammu.incoming_sms}, registered again after each
+      reconnection. *)
+
+  val incoming_call : supervisor -> (Call.call -> unit) -> unit
+  (** Same as {!Gammu.incoming_call}, registered again after each
+      reconnection. *)
+end
+
+
+(************************************************************************)
+(** {2 Discovery} *)
+
+(** Finding the phones and modems plugged to the computer. *)
+module Discovery :
+sig
+  val candidates : unit -> string list
+  (** [candidates()] returns the serial devices of USB phones and modems
+      ([/dev/ttyUSB*] and [/dev/ttyACM*]), in numeric order.  It is empty
+      on systems without [/dev]. *)
+
+  (** A phone or modem answering to libGammu. *)
+  type modem = {
+    device : string;        (** The port to use with libGammu. *)
+    connection : string;
+    imei : string;
+    model : string;
+    imsi : string option;   (** [None] without SIM card. *)
+    other_devices : string list;
+    (** The other ports of the same modem (same IMEI) answering to
+        libGammu.  Multi-port modems often only answer on one. *)
+  }
+
+  val scan : ?devices:string list -> ?connection:string -> ?replies:int ->
+    ?timeout:float -> unit -> modem list
+  (** [scan()] tries to connect to all the [devices] (default:
+      {!candidates}) at once (see {!Gammu.connect_all}) and identifies
+      the ones answering.  The ports of the same modem are grouped, in
+      the order of [devices].  The connections are closed before
+      returning.
+
+      Beware that the probes send commands to all [devices]: do not
+      include the ones used by other programs.
+
+      @param connection the connection type (default: ["at"]).
+      @param replies see {!Gammu.connect} (default: [1]).
+      @param timeout maximum time for the connection and for the
+      identification, both also done at once (default: [5.]). *)
+
+  val config : modem -> config
+  (** [config m] is a configuration to connect to [m] (see
+      {!Gammu.push_config}). *)
+end
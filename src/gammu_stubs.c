@@ -20,12 +20,26 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #if defined(__unix__) || defined(__CYGWIN__) \
   || defined(__MINGW64__) || defined(__MINGW32__)
 #include <unistd.h>
 #endif
+#ifdef _MSC_VER
+#include <io.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__) || defined(__CYGWIN__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#else
+#define CAML_GAMMU_NO_MMAP
+#endif
 
 #include <caml/mlvalues.h>
 #include <caml/alloc.h>
@@ -34,11 +48,11 @@
 #include <caml/callback.h>
 #include <caml/custom.h>
 #include <caml/signals.h>
+#include <caml/bigarray.h>
 
 #include <gammu.h>
 
 #include "gammu_stubs.h"
-#include "io.h"
 
 
 /************************************************************************/
@@ -104,6 +118,87 @@ static value val_Some(value vsome)
   CAMLreturn(res);
 }
 
+static double monotonic_time(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#else
+  return (double) time(NULL);
+#endif
+}
+
+CAMLexport
+value caml_gammu_monotonic_time(value vunit)
+{
+  CAMLparam1(vunit);
+  CAMLreturn(caml_copy_double(monotonic_time()));
+}
+
+/* Write the data of [fd] to the disk, for journals. */
+CAMLexport
+value caml_gammu_fsync(value vfd)
+{
+  CAMLparam1(vfd);
+  int fd = Int_val(vfd), ret;
+
+  caml_enter_blocking_section();
+#ifdef _MSC_VER
+  ret = _commit(fd);
+#else
+  ret = fsync(fd);
+#endif
+  caml_leave_blocking_section();
+  if (ret == -1)
+    caml_gammu_raise_Error(ERR_WRITING_FILE);
+
+  CAMLreturn(Val_unit);
+}
+
+/* Write the entries of the directory [path] to the disk, so that a file
+   renamed in it survives a crash.  Nothing to do on Windows. */
+CAMLexport
+value caml_gammu_fsync_dir(value vpath)
+{
+  CAMLparam1(vpath);
+#if defined(__unix__) || defined(__APPLE__) || defined(__CYGWIN__)
+  char *path = strdup(String_val(vpath));
+  int fd, ret = 0;
+
+  if (path == NULL)
+    caml_raise_out_of_memory();
+  caml_enter_blocking_section();
+  fd = open(path, O_RDONLY);
+  if (fd != -1) {
+    ret = fsync(fd);
+    /* Some file systems cannot sync directories. */
+    if (ret == -1 && errno == EINVAL)
+      ret = 0;
+    close(fd);
+  }
+  caml_leave_blocking_section();
+  free(path);
+  if (fd == -1 || ret == -1)
+    caml_gammu_raise_Error(ERR_WRITING_FILE);
+#endif
+  CAMLreturn(Val_unit);
+}
+
+/* Modification time of [path], to watch configuration files. */
+CAMLexport
+value caml_gammu_file_mtime(value vpath)
+{
+  CAMLparam1(vpath);
+  struct stat st;
+
+  if (stat(String_val(vpath), &st) == -1)
+    caml_gammu_raise_Error(ERR_CANTOPENFILE);
+
+  CAMLreturn(caml_copy_double((double) st.st_mtime));
+}
+
 #if GAMMU_VERSION_NUM < 12792
 static gboolean is_true(const char *str)
 {
@@ -158,6 +253,9 @@ value caml_gammu_GSM_ErrorString(value verr)
   case ERR_INVALID_CONFIG_NUM:
     msg = "Invalid config number.";
     break;
+  case ERR_DEADLINE_EXCEEDED:
+    msg = "Deadline exceeded, the operation was aborted.";
+    break;
   default:
     if (err < ERR_LAST_VALUE)
       msg = GSM_ErrorString(err);
@@ -202,36 +300,203 @@ value caml_gammu_GSM_SetDebugGlobal(value vdi, value vglobal)
   CAMLreturn(Val_unit);
 }
 
-/* TODO: It should work on Windows, but have to check. */
-static FILE *FILE_val(value vchannel, const char *mode)
+/* Buffer of the global debug info, never freed since it may be in use by
+   any thread. */
+static Debug_Buffer *global_debug_buffer = NULL;
+
+static Debug_Buffer **Debug_Buffer_slot(value vdi)
 {
-  int fd;
-  FILE *res;
-  struct channel *channel = Channel(vchannel);
-  assert(channel != NULL);
+  if ((GSM_Debug_Info *) vdi == global_debug)
+    return &global_debug_buffer;
+  return &(STATE_MACHINE_VAL(vdi)->debug_buffer);
+}
 
-  /* Duplicate channel's file descriptor so that the user can close the
-     channel without affecting us and inversely. */
-  fd = dup(channel->fd);
-  if (fd == -1)
-    /* TODO: raise exception */
-    return NULL;
-  res = fdopen(fd, mode);
+#ifdef CAML_GAMMU_NO_PTHREAD
+# define DEBUG_BUFFER_LOCK(buffer)
+# define DEBUG_BUFFER_UNLOCK(buffer)
+#else
+# define DEBUG_BUFFER_LOCK(buffer) pthread_mutex_lock(&(buffer)->mutex)
+# define DEBUG_BUFFER_UNLOCK(buffer) pthread_mutex_unlock(&(buffer)->mutex)
+#endif
 
-  return res;
+/* Called by libGammu, without the runtime lock. */
+static void debug_buffer_callback(const char *text, void *data)
+{
+  Debug_Buffer *buffer = data;
+  size_t len = strlen(text), chunk;
+
+  DEBUG_BUFFER_LOCK(buffer);
+  if (len >= buffer->size) {
+    /* Only the end of [text] fits. */
+    text += len - buffer->size;
+    len = buffer->size;
+  }
+  chunk = buffer->size - buffer->pos;
+  if (len < chunk)
+    chunk = len;
+  memcpy(buffer->data + buffer->pos, text, chunk);
+  memcpy(buffer->data, text + chunk, len - chunk);
+  buffer->pos += len;
+  if (buffer->pos >= buffer->size) {
+    buffer->pos -= buffer->size;
+    buffer->wrapped = TRUE;
+  }
+  DEBUG_BUFFER_UNLOCK(buffer);
+}
+
+static void debug_buffer_free(Debug_Buffer *buffer)
+{
+#ifndef CAML_GAMMU_NO_PTHREAD
+  pthread_mutex_destroy(&buffer->mutex);
+#endif
+  free(buffer->data);
+  free(buffer);
+}
+
+/* Frames are traced through the log sink (see caml_gammu_trace_start),
+   so it must not be replaced while a trace runs. */
+static void check_untraced(value vdi, const char *msg)
+{
+  if ((GSM_Debug_Info *) vdi != global_debug
+      && STATE_MACHINE_VAL(vdi)->trace != NULL)
+    caml_invalid_argument(msg);
+}
+
+/* The thread of SMS.fold_prefetch writes to the log sink and the trace
+   of the state machine without synchronization: they must not be freed
+   or replaced while it runs. */
+static void check_no_prefetch(value vdi, const char *msg)
+{
+  if ((GSM_Debug_Info *) vdi != global_debug
+      && STATE_MACHINE_VAL(vdi)->prefetch != NULL)
+    caml_invalid_argument(msg);
+}
+
+/* Stop sending the debug output of [vdi] to a buffer or a log sink. */
+static void detach_debug_function(value vdi)
+{
+  State_Machine *state_machine;
+
+  GSM_SetDebugFunction(NULL, NULL, GSM_Debug_Info_val(vdi));
+  if ((GSM_Debug_Info *) vdi == global_debug)
+    return;
+  state_machine = STATE_MACHINE_VAL(vdi);
+  caml_gammu_log_disable(vdi);
+  if (state_machine->debug_buffer) {
+    debug_buffer_free(state_machine->debug_buffer);
+    state_machine->debug_buffer = NULL;
+  }
 }
 
 CAMLexport
-value caml_gammu_GSM_SetDebugFileDescriptor(value vdi, value vchannel)
+value caml_gammu_GSM_SetDebugFileDescriptor(value vdi, value vfd)
 {
-  CAMLparam2(vdi, vchannel);
+  CAMLparam2(vdi, vfd);
   GSM_Error error;
-  error = GSM_SetDebugFileDescriptor(FILE_val(vchannel, "a"),
+  FILE *f = NULL;
+  int fd;
+
+  check_untraced(vdi, "Gammu.Debug.set_output: the state machine is "
+                 "traced, see Gammu.Trace.stop.");
+  check_no_prefetch(vdi, "Gammu.Debug.set_output: SMS.fold_prefetch is "
+                    "running.");
+  /* Duplicate channel's file descriptor so that the user can close the
+     channel without affecting us and inversely. */
+  fd = dup(Int_val(vfd));
+  if (fd != -1) {
+    f = fdopen(fd, "a");
+    if (f == NULL)
+      close(fd);
+  }
+  if (f == NULL)
+    caml_gammu_raise_Error(ERR_CANTOPENFILE);
+  detach_debug_function(vdi);
+  error = GSM_SetDebugFileDescriptor(f,
                                      TRUE, // file descr is closable
                                      GSM_Debug_Info_val(vdi));
   caml_gammu_raise_Error(error);
   CAMLreturn(Val_unit);
- }
+}
+
+CAMLexport
+value caml_gammu_set_debug_buffer(value vdi, value vsize)
+{
+  CAMLparam2(vdi, vsize);
+  Debug_Buffer **slot = Debug_Buffer_slot(vdi);
+  Debug_Buffer *buffer = *slot;
+  long size = Long_val(vsize);
+  char *data;
+
+  if (size < 1)
+    caml_invalid_argument("Gammu.Debug.set_output_buffer: size must be >= 1.");
+  check_untraced(vdi, "Gammu.Debug.set_output_buffer: the state machine "
+                 "is traced, see Gammu.Trace.stop.");
+  check_no_prefetch(vdi, "Gammu.Debug.set_output_buffer: SMS.fold_prefetch "
+                    "is running.");
+  data = malloc(size);
+  if (!data)
+    caml_raise_out_of_memory();
+  if ((GSM_Debug_Info *) vdi != global_debug)
+    caml_gammu_log_disable(vdi);
+
+  if (buffer == NULL) {
+    buffer = malloc(sizeof(Debug_Buffer));
+    if (!buffer) {
+      free(data);
+      caml_raise_out_of_memory();
+    }
+#ifndef CAML_GAMMU_NO_PTHREAD
+    pthread_mutex_init(&buffer->mutex, NULL);
+#endif
+    buffer->data = NULL;
+    *slot = buffer;
+  }
+  /* The buffer may be in use: it is reset in place. */
+  DEBUG_BUFFER_LOCK(buffer);
+  free(buffer->data);
+  buffer->data = data;
+  buffer->size = size;
+  buffer->pos = 0;
+  buffer->wrapped = FALSE;
+  DEBUG_BUFFER_UNLOCK(buffer);
+  GSM_SetDebugFunction(debug_buffer_callback, buffer,
+                       GSM_Debug_Info_val(vdi));
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLexport
+value caml_gammu_debug_buffer_snapshot(value vdi)
+{
+  CAMLparam1(vdi);
+  CAMLlocal1(res);
+  Debug_Buffer *buffer = *Debug_Buffer_slot(vdi);
+  char *copy;
+  size_t len, tail;
+
+  if (buffer == NULL)
+    CAMLreturn(caml_copy_string(""));
+
+  /* Copy first, allocating in the OCaml heap with the lock held could
+     run finalizers. */
+  DEBUG_BUFFER_LOCK(buffer);
+  len = buffer->wrapped ? buffer->size : buffer->pos;
+  copy = malloc(len + 1);
+  if (copy) {
+    tail = buffer->wrapped ? buffer->size - buffer->pos : 0;
+    memcpy(copy, buffer->data + buffer->pos, tail);
+    memcpy(copy + tail, buffer->data, buffer->pos);
+  }
+  DEBUG_BUFFER_UNLOCK(buffer);
+  if (!copy)
+    caml_raise_out_of_memory();
+
+  res = caml_alloc_string(len);
+  memcpy((char *) String_val(res), copy, len);
+  free(copy);
+
+  CAMLreturn(res);
+}
 
 CAMLexport
 value caml_gammu_GSM_SetDebugLevel(value vdi, value vlevel)
@@ -248,33 +513,79 @@ value caml_gammu_GSM_SetDebugLevel(value vdi, value vlevel)
 /************************************************************************/
 /* INI files */
 
+static INI_Section *ini_section_val(value vini_section)
+{
+  INI_File *file = INI_FILE_VAL(vini_section);
+
+  if (file->freed)
+    caml_invalid_argument("Gammu.INI: sections used after INI.free.");
+  return file->head;
+}
+
+/* Native memory used by the parsed file, for the GC. */
+static mlsize_t ini_size(INI_Section *ini_section, gboolean unicode)
+{
+  INI_Section *section;
+  INI_Entry *entry;
+  mlsize_t size = 0;
+
+#define INI_STRING_SIZE(s)                                              \
+  ((s) == NULL ? 0 : (unicode ? 2 * UnicodeLength(s) + 2                \
+                      : strlen((char *) (s)) + 1))
+  for (section = ini_section; section != NULL; section = section->Next) {
+    size += sizeof(INI_Section) + INI_STRING_SIZE(section->SectionName);
+    for (entry = section->SubEntries; entry != NULL; entry = entry->Next)
+      size += sizeof(INI_Entry) + INI_STRING_SIZE(entry->EntryName)
+        + INI_STRING_SIZE(entry->EntryValue);
+  }
+#undef INI_STRING_SIZE
+  return size;
+}
+
 static void caml_gammu_ini_section_finalize(value vini_section)
 {
+  INI_File *file = INI_FILE_VAL(vini_section);
+
   SHOUT_DBG("Finalize INI Section.");
-  INI_Free(INI_SECTION_VAL(vini_section));
+  if (!file->freed)
+    INI_Free(file->head);
 }
 
-static value alloc_INI_Section()
+static value alloc_INI_Section(mlsize_t mem)
 {
   CAMLparam0();
   CAMLlocal1(res);
-  /* TODO: Can alloc_custom fail ? */
-  res = alloc_custom(&caml_gammu_ini_section_ops, sizeof(INI_Section *),
-                     1, 100);
+  res = caml_alloc_custom(&caml_gammu_ini_section_ops, sizeof(INI_File),
+                          mem, CUSTOM_MEM_MAX);
   CAMLreturn(res);
 }
 
-static value Val_INI_Section(INI_Section *ini_section)
+static value Val_INI_Section(INI_Section *ini_section, gboolean unicode)
 {
   CAMLparam0();
   CAMLlocal1(res);
 
-  res = alloc_INI_Section();
-  INI_SECTION_VAL(res) = ini_section;
+  res = alloc_INI_Section(ini_size(ini_section, unicode));
+  INI_FILE_VAL(res)->head = ini_section;
+  INI_FILE_VAL(res)->freed = FALSE;
 
   CAMLreturn(res);
 }
 
+CAMLexport
+value caml_gammu_INI_free(value vini_section)
+{
+  CAMLparam1(vini_section);
+  INI_File *file = INI_FILE_VAL(vini_section);
+
+  if (!file->freed) {
+    INI_Free(file->head);
+    file->head = NULL;
+    file->freed = TRUE;
+  }
+  CAMLreturn(Val_unit);
+}
+
 CAMLexport
 value caml_gammu_INI_ReadFile(value vfilename, value vunicode)
 {
@@ -291,7 +602,7 @@ value caml_gammu_INI_ReadFile(value vfilename, value vunicode)
   free(filename);
   caml_gammu_raise_Error(error);
 
-  CAMLreturn(Val_INI_Section(cfg));
+  CAMLreturn(Val_INI_Section(cfg, Unicode));
 }
 
 CAMLexport
@@ -317,16 +628,106 @@ value caml_gammu_INI_GetValue(value vfile_info, value vsection, value vkey,
   CAMLreturn(res);
 }
 
+static value copy_ini_string(unsigned char *s, gboolean unicode)
+{
+  if (s == NULL)
+    return caml_copy_string("");
+  else if (unicode)
+    return CAML_COPY_USTRING(s);
+  else
+    return caml_copy_string((char *) s);
+}
+
+/* All the sections of [vfile_info] with their entries, in the order of
+   libGammu lists (the one INI_GetValue searches). */
+CAMLexport
+value caml_gammu_INI_entries(value vfile_info, value vunicode)
+{
+  CAMLparam2(vfile_info, vunicode);
+  CAMLlocal5(res, vsection, ventries, ventry, vstr);
+  gboolean unicode = Bool_val(vunicode);
+  INI_Section *section;
+  INI_Entry *entry;
+  mlsize_t num_sections = 0, num_entries, i, j;
+
+  for (section = INI_SECTION_VAL(vfile_info); section != NULL;
+       section = section->Next)
+    num_sections++;
+  if (num_sections == 0)
+    CAMLreturn(Atom(0));
+
+  res = caml_alloc_tuple(num_sections);
+  for (section = INI_SECTION_VAL(vfile_info), i = 0; section != NULL;
+       section = section->Next, i++) {
+    num_entries = 0;
+    for (entry = section->SubEntries; entry != NULL; entry = entry->Next)
+      num_entries++;
+    if (num_entries == 0)
+      ventries = Atom(0);
+    else {
+      ventries = caml_alloc_tuple(num_entries);
+      for (entry = section->SubEntries, j = 0; entry != NULL;
+           entry = entry->Next, j++) {
+        ventry = caml_alloc_tuple(2);
+        vstr = copy_ini_string(entry->EntryName, unicode);
+        Store_field(ventry, 0, vstr);
+        vstr = copy_ini_string(entry->EntryValue, unicode);
+        Store_field(ventry, 1, vstr);
+        Store_field(ventries, j, ventry);
+      }
+    }
+    vsection = caml_alloc_tuple(2);
+    vstr = copy_ini_string(section->SectionName, unicode);
+    Store_field(vsection, 0, vstr);
+    Store_field(vsection, 1, ventries);
+    Store_field(res, i, vsection);
+  }
+
+  CAMLreturn(res);
+}
+
 
 /************************************************************************/
 /* State machine */
 
-static void caml_gammu_state_machine_finalize(value s)
+static State_Machine *state_machine_val(value s)
 {
-  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+  State_Machine *state_machine = STATE_MACHINE_PTR(s);
+
+  if (state_machine == NULL)
+    caml_invalid_argument("Gammu: state machine used after Gammu.free.");
+  return state_machine;
+}
+
+static void state_machine_release(State_Machine *state_machine)
+{
+  GSM_Config *cfg;
+  int i;
 
+#ifndef CAML_GAMMU_NO_WATCHDOG
+  watchdog_disarm(state_machine);
+#endif
+#ifndef CAML_GAMMU_NO_PTHREAD
+  state_machine_stop_prefetch(state_machine);
+#endif
+  /* All the slots, including the removed configurations, whatever
+     GSM_FreeStateMachine does with them. */
+  for (i = 0; (cfg = GSM_GetConfig(state_machine->sm, i)) != NULL; i++)
+    GSM_Config_free_strings(cfg);
   GSM_FreeStateMachine(state_machine->sm);
+  incoming_free(state_machine);
+  /* Last lines may have been logged while disconnecting. */
+  if (state_machine->log_sink)
+    log_sink_free(state_machine->log_sink);
+  if (state_machine->debug_buffer)
+    debug_buffer_free(state_machine->debug_buffer);
+  if (state_machine->trace) {
+    free(state_machine->trace->events);
+    free(state_machine->trace);
+  }
   /* Allow GC to collect the callback closure value now. */
+  if (state_machine->log_function)
+    caml_remove_global_root(&(state_machine->log_function));
   if (state_machine->incoming_SMS_callback)
     caml_remove_global_root(&(state_machine->incoming_SMS_callback));
   if (state_machine->incoming_Call_callback)
@@ -335,6 +736,40 @@ static void caml_gammu_state_machine_finalize(value s)
   free(state_machine);
 }
 
+static void caml_gammu_state_machine_finalize(value s)
+{
+  if (STATE_MACHINE_PTR(s) != NULL)
+    state_machine_release(STATE_MACHINE_PTR(s));
+}
+
+CAMLexport
+value caml_gammu_free(value s)
+{
+  CAMLparam1(s);
+  State_Machine *state_machine = STATE_MACHINE_PTR(s);
+  GSM_Error error = ERR_NONE;
+
+  if (state_machine == NULL)
+    CAMLreturn(Val_unit);
+  STATE_MACHINE_PTR(s) = NULL;
+#ifndef CAML_GAMMU_NO_PTHREAD
+  /* Before closing the device under its feet.  The thread does not need
+     the runtime lock. */
+  state_machine_stop_prefetch(state_machine);
+#endif
+  /* Close the device, GSM_FreeStateMachine does not. */
+  if (GSM_IsConnected(state_machine->sm)) {
+    caml_enter_blocking_section();
+    error = GSM_TerminateConnection(state_machine->sm);
+    caml_leave_blocking_section();
+  }
+  drop_pending_sms(state_machine);
+  state_machine_release(state_machine);
+  caml_gammu_raise_Error(error);
+
+  CAMLreturn(Val_unit);
+}
+
 static value Val_GSM_Config(const GSM_Config *config)
 {
   CAMLparam0();
@@ -367,13 +802,11 @@ static value Val_GSM_Config(const GSM_Config *config)
   CAMLreturn(res);
 }
 
-/* Set values of config according to those from vconfig. */
-static void GSM_Config_val(GSM_Config *config, value vconfig)
+/* Set the values of config, except the ones locating the phone, according
+   to those from vconfig. */
+static void GSM_Config_settings_val(GSM_Config *config, value vconfig)
 {
-  CPY_TRIM_STRING_VAL(config->Model, Field(vconfig, 0));
   CPY_TRIM_STRING_VAL(config->DebugLevel, Field(vconfig, 1));
-  CPY_STRING_VAL(config->Device, Field(vconfig, 2));
-  CPY_STRING_VAL(config->Connection, Field(vconfig, 3));
 #if GAMMU_VERSION_NUM >= 12792
   config->SyncTime = Bool_val(Field(vconfig, 4));
   config->LockDevice = Bool_val(Field(vconfig, 5));
@@ -385,7 +818,6 @@ static void GSM_Config_val(GSM_Config *config, value vconfig)
   config->LockDevice = yesno_bool(Bool_val(Field(vconfig, 5)));
   config->StartInfo = yesno_bool(Bool_val(Field(vconfig, 7)));
 #endif
-  CPY_STRING_VAL(config->DebugFile, Field(vconfig, 6));
   config->UseGlobalDebugFile = Bool_val(Field(vconfig, 8));
   CPY_TRIM_STRING_VAL(config->TextReminder, Field(vconfig, 9));
   CPY_TRIM_STRING_VAL(config->TextMeeting, Field(vconfig, 10));
@@ -394,6 +826,28 @@ static void GSM_Config_val(GSM_Config *config, value vconfig)
   CPY_TRIM_STRING_VAL(config->TextMemo, Field(vconfig, 13));
 }
 
+/* Set values of config according to those from vconfig. */
+static void GSM_Config_val(GSM_Config *config, value vconfig)
+{
+  CPY_TRIM_STRING_VAL(config->Model, Field(vconfig, 0));
+  CPY_STRING_VAL(config->Device, Field(vconfig, 2));
+  CPY_STRING_VAL(config->Connection, Field(vconfig, 3));
+  CPY_STRING_VAL(config->DebugFile, Field(vconfig, 6));
+  GSM_Config_settings_val(config, vconfig);
+}
+
+/* Release the strings of a configuration (from GSM_Config_val or
+   GSM_ReadConfig), which are owned by its slot. */
+static void GSM_Config_free_strings(GSM_Config *config)
+{
+  free(config->Device);
+  config->Device = NULL;
+  free(config->Connection);
+  config->Connection = NULL;
+  free(config->DebugFile);
+  config->DebugFile = NULL;
+}
+
 CAMLexport
 value caml_gammu_GSM_GetDebug(value s)
 {
@@ -441,12 +895,31 @@ value caml_gammu_GSM_AllocStateMachine(value vunit)
 
   state_machine->sm = sm;
   state_machine->log_function = 0;
+  state_machine->log_sink = NULL;
+  state_machine->debug_buffer = NULL;
+  state_machine->trace = NULL;
+  state_machine->prefetch = NULL;
   state_machine->incoming_SMS_callback = 0;
   state_machine->incoming_Call_callback = 0;
+  state_machine->incoming_head = NULL;
+  state_machine->incoming_tail = NULL;
+#ifndef CAML_GAMMU_NO_PTHREAD
+  pthread_mutex_init(&state_machine->incoming_mutex, NULL);
+#endif
+  state_machine->sms_submitted = 0;
+  state_machine->sms_reported = 0;
+  state_machine->smsc_cached = FALSE;
+#ifndef CAML_GAMMU_NO_WATCHDOG
+  state_machine->watchdog = NULL;
+#endif
+  GSM_SetSendSMSStatusCallback(sm, send_sms_status_callback,
+                               (void *) state_machine);
 
-  res = alloc_custom(&caml_gammu_state_machine_ops,
-                     sizeof(State_Machine *), 1, 100);
-  STATE_MACHINE_VAL(res) = state_machine;
+  res = caml_alloc_custom(&caml_gammu_state_machine_ops,
+                          sizeof(State_Machine *),
+                          sizeof(State_Machine) + GSM_STATEMACHINE_SIZE,
+                          CUSTOM_MEM_MAX);
+  STATE_MACHINE_PTR(res) = state_machine;
 
   CAMLreturn(res);
 }
@@ -466,7 +939,7 @@ value caml_gammu_GSM_FindGammuRC_force(value vpath)
   free(path);
   caml_gammu_raise_Error(error);
 
-  CAMLreturn(Val_INI_Section(res));
+  CAMLreturn(Val_INI_Section(res, FALSE));
 }
 
 CAMLexport
@@ -481,13 +954,14 @@ value caml_gammu_GSM_FindGammuRC(value vunit)
   caml_leave_blocking_section();
   caml_gammu_raise_Error(error);
 
-  CAMLreturn(Val_INI_Section(res));
+  CAMLreturn(Val_INI_Section(res, FALSE));
 }
 
 CAMLexport
 value caml_gammu_GSM_ReadConfig(value vcfg_info, value vnum)
 {
   CAMLparam2(vcfg_info, vnum);
+  CAMLlocal1(vcfg);
   GSM_Config cfg;
   INI_Section *cfg_info;
   GSM_Error error;
@@ -508,9 +982,18 @@ value caml_gammu_GSM_ReadConfig(value vcfg_info, value vnum)
   caml_enter_blocking_section(); /* release global lock */
   error = GSM_ReadConfig(cfg_info, &cfg, num);
   caml_leave_blocking_section(); /* acquire global lock */
+  /* On error, we do not know which strings were replaced. */
   caml_gammu_raise_Error(error);
 
-  CAMLreturn(Val_GSM_Config(&cfg));
+  vcfg = Val_GSM_Config(&cfg);
+  GSM_Config_free_strings(&cfg);
+#if GAMMU_VERSION_NUM < 12700
+  free(cfg.SyncTime);
+  free(cfg.LockDevice);
+  free(cfg.StartInfo);
+#endif
+
+  CAMLreturn(vcfg);
 }
 
 CAMLexport
@@ -542,6 +1025,8 @@ value caml_gammu_push_config(value s, value vcfg)
      enough configs to fill the stack, we'll set cfg_num to -1. */
   if (cfg_num != -1) {
     dest_cfg = GSM_GetConfig(sm, cfg_num);
+    /* The slot may still hold a removed configuration. */
+    GSM_Config_free_strings(dest_cfg);
     GSM_Config_val(dest_cfg, vcfg);
     /* GSM_SetConfigNum downsets the config num to maximum number of configs
        allowed. So, if the number of configs doesn't change, it's because
@@ -564,9 +1049,16 @@ value caml_gammu_remove_config(value s)
   CAMLparam1(s);
   GSM_StateMachine *sm = GSM_STATEMACHINE_VAL(s);
   int cfg_num = GSM_GetConfigNum(sm);
+  GSM_Config *cfg;
 
-  if (cfg_num > 0)
+  if (cfg_num > 0) {
     GSM_SetConfigNum(sm, cfg_num - 1);
+    cfg = GSM_GetConfig(sm, cfg_num - 1);
+    /* libGammu uses the current configuration until disconnected, its
+       strings are then freed by the next push or the finalizer. */
+    if (!(GSM_IsConnected(sm) && cfg == GSM_GetConfig(sm, -1)))
+      GSM_Config_free_strings(cfg);
+  }
   else
     /* Empty stack, can't remove */
     caml_gammu_raise_Error(ERR_INVALID_CONFIG_NUM);
@@ -574,6 +1066,32 @@ value caml_gammu_remove_config(value s)
   CAMLreturn(Val_unit);
 }
 
+CAMLexport
+value caml_gammu_update_config(value s, value vnum, value vcfg)
+{
+  CAMLparam3(s, vnum, vcfg);
+  GSM_StateMachine *sm = GSM_STATEMACHINE_VAL(s);
+  int num = Int_val(vnum);
+  GSM_Config *cfg = GSM_GetConfig(sm, num);
+
+  if (cfg == NULL || num >= GSM_GetConfigNum(sm))
+    caml_gammu_raise_Error(ERR_INVALID_CONFIG_NUM);
+  /* Model, Device and Connection are left as they are, changing them
+     requires a new connection. */
+  GSM_Config_settings_val(cfg, vcfg);
+  if (cfg->DebugFile == NULL
+      || strcmp(cfg->DebugFile, String_val(Field(vcfg, 6))) != 0) {
+    free(cfg->DebugFile);
+    CPY_STRING_VAL(cfg->DebugFile, Field(vcfg, 6));
+  }
+  /* GSM_InitConnection only reads the debug level when connecting. */
+  if (GSM_IsConnected(sm) && cfg == GSM_GetConfig(sm, -1)
+      && !GSM_SetDebugLevel(cfg->DebugLevel, GSM_GetDebug(sm)))
+    caml_invalid_argument("Gammu.reload_config: invalid debug level.");
+
+  CAMLreturn(Val_unit);
+}
+
 CAMLexport
 value caml_gammu_GSM_GetConfigNum(value s)
 {
@@ -581,49 +1099,70 @@ value caml_gammu_GSM_GetConfigNum(value s)
   CAMLreturn(Val_int( GSM_GetConfigNum(GSM_STATEMACHINE_VAL(s)) ));
 }
 
+static void install_callbacks(State_Machine *state_machine)
+{
+  GSM_StateMachine *sm = state_machine->sm;
+
+  GSM_SetSendSMSStatusCallback(sm, send_sms_status_callback,
+                               (void *) state_machine);
+  if (state_machine->incoming_SMS_callback)
+    GSM_SetIncomingSMSCallback(sm, incoming_SMS_callback,
+                               (void *) state_machine);
+  if (state_machine->incoming_Call_callback)
+    GSM_SetIncomingCallCallback(sm, incoming_Call_callback,
+                                (void *) state_machine);
+}
+
+static GSM_Error init_connection(State_Machine *state_machine,
+                                 int reply_num)
+{
+  GSM_StateMachine *sm = state_machine->sm;
+  GSM_Error error;
+
+  if (state_machine->log_sink)
+    error = GSM_InitConnection_Log(sm, reply_num, log_sink_callback,
+                                   state_machine->log_sink);
+  else if (state_machine->debug_buffer)
+    error = GSM_InitConnection_Log(sm, reply_num, debug_buffer_callback,
+                                   state_machine->debug_buffer);
+  else
+    error = GSM_InitConnection(sm, reply_num);
+  if (error == ERR_NONE)
+    install_callbacks(state_machine);
+  return error;
+}
+
 CAMLexport
 value caml_gammu_GSM_InitConnection(value vs, value vreply_num)
 {
   CAMLparam2(vs, vreply_num);
   GSM_Error error;
-  GSM_StateMachine* s = GSM_STATEMACHINE_VAL(vs);
+  State_Machine *state_machine = STATE_MACHINE_VAL(vs);
   int ReplyNum = Int_val(vreply_num);
 
+  state_machine->smsc_cached = FALSE;
+  TRACE_BEGIN(vs, "InitConnection");
   caml_enter_blocking_section(); /* release global lock */
-  error = GSM_InitConnection(s, ReplyNum);
+  error = init_connection(state_machine, ReplyNum);
   caml_leave_blocking_section(); /* acquire global lock */
+  TRACE_END(vs);
   caml_gammu_raise_Error(error);
 
   CAMLreturn(Val_unit);
 }
 
-static void log_function_callback(const char *text, void *data)
-{
-  CAMLparam0();
-  CAMLlocal1(f);
-
-  /* The caml function value was saved as user data for the callback. */
-  f = *((value *) data);
-  caml_callback(f, caml_copy_string(text));
-
-  CAMLreturn0;
-}
-
 CAMLexport
 value caml_gammu_GSM_InitConnection_Log(value s, value vreply_num,
                                        value vlog_func)
 {
   CAMLparam3(s, vreply_num, vlog_func);
-  GSM_Error error;
   State_Machine *state_machine = STATE_MACHINE_VAL(s);
-  int ReplyNum = Int_val(vreply_num);
 
+  /* The function is called by Gammu.Log.flush, not from libGammu. */
   REGISTER_SM_GLOBAL_ROOT(state_machine, log_function, vlog_func);
-  caml_enter_blocking_section(); /* release global lock */
-  error = GSM_InitConnection_Log(state_machine->sm, ReplyNum,
-                                 log_function_callback, (void *) &vlog_func);
-  caml_leave_blocking_section(); /* acquire global lock */
-  caml_gammu_raise_Error(error);
+  if (state_machine->log_sink == NULL)
+    caml_gammu_log_enable(s, VAL_NONE, Val_int(1024), VAL_NONE);
+  caml_gammu_GSM_InitConnection(s, vreply_num);
 
   CAMLreturn(Val_unit);
 }
@@ -639,52 +1178,228 @@ value caml_gammu_GSM_TerminateConnection(value s)
    * the incomings callbacks since the user might re-init the connection
    * later (with the same callbacks). */
   UNREGISTER_SM_GLOBAL_ROOT(state_machine, log_function);
+  state_machine->smsc_cached = FALSE;
+  TRACE_BEGIN(s, "TerminateConnection");
   caml_enter_blocking_section();
   error = GSM_TerminateConnection(state_machine->sm);
   caml_leave_blocking_section();
+  TRACE_END(s);
+  /* Statuses of sent messages can no longer be reported. */
+  drop_pending_sms(state_machine);
   caml_gammu_raise_Error(error);
 
   CAMLreturn(Val_unit);
 }
 
-CAMLexport
-value caml_gammu_GSM_IsConnected(value s)
+/* Run [run] on the [n] jobs of [size] bytes at [jobs] at once, each in
+   its own thread.  Must be called outside of the OCaml runtime. */
+static void run_jobs(void *jobs, size_t size, mlsize_t n,
+                     void *(*run)(void *))
 {
-  CAMLparam1(s);
+  char *job = (char *) jobs;
+  mlsize_t i;
+#ifndef CAML_GAMMU_NO_PTHREAD
+  pthread_t *threads = malloc(n * sizeof(pthread_t));
+  gboolean *started = calloc(n, sizeof(gboolean));
+
+  if (threads != NULL && started != NULL) {
+    for (i = 0; i < n; i++)
+      started[i] = (pthread_create(&threads[i], NULL, run,
+                                   job + i * size) == 0);
+    for (i = 0; i < n; i++) {
+      if (started[i])
+        pthread_join(threads[i], NULL);
+      else
+        run(job + i * size); /* No more threads, run it here. */
+    }
+  }
+  else
+    for (i = 0; i < n; i++)
+      run(job + i * size);
+  free(started);
+  free(threads);
+#else
+  for (i = 0; i < n; i++)
+    run(job + i * size);
+#endif
+}
 
-  CAMLreturn(Val_bool(GSM_IsConnected(GSM_STATEMACHINE_VAL(s))));
+static void *connect_job_run(void *data)
+{
+  Connect_Job *job = (Connect_Job *) data;
+  State_Machine *state_machine = job->state_machine;
+  double start = monotonic_time();
+
+  trace_begin(state_machine, "InitConnection");
+  job->error = init_connection(state_machine, job->reply_num);
+  trace_end(state_machine);
+  job->time = monotonic_time() - start;
+  return NULL;
 }
 
+/* Connect the (distinct) state machines [vmachines] at once, each in its
+   own thread: the time taken is the one of the slowest phone. */
 CAMLexport
-value caml_gammu_GSM_GetUsedConnection(value s)
+value caml_gammu_connect_all(value vmachines, value vreply_num)
 {
-  CAMLparam1(s);
-  GSM_StateMachine *sm = GSM_STATEMACHINE_VAL(s);
-  GSM_ConnectionType conn_type;
+  CAMLparam2(vmachines, vreply_num);
+  CAMLlocal3(res, vjob, verr);
+  mlsize_t n = Wosize_val(vmachines), i;
+  Connect_Job *jobs;
+
+  if (n == 0)
+    CAMLreturn(Atom(0));
+  jobs = calloc(n, sizeof(Connect_Job));
+  if (jobs == NULL)
+    caml_raise_out_of_memory();
+  for (i = 0; i < n; i++) {
+    jobs[i].state_machine = STATE_MACHINE_VAL(Field(vmachines, i));
+    jobs[i].state_machine->smsc_cached = FALSE;
+    jobs[i].reply_num = Int_val(vreply_num);
+  }
 
-  if (!GSM_IsConnected(sm))
-    caml_gammu_raise_Error(ERR_NOTCONNECTED);
+  caml_enter_blocking_section();
+  run_jobs(jobs, sizeof(Connect_Job), n, connect_job_run);
+  caml_leave_blocking_section();
 
-  conn_type = GSM_GetUsedConnection(sm);
-  SHOUT_DBG("GSM_GetUsedConnection call made: conn_type = %i", (int) conn_type);
+  res = caml_alloc_tuple(n);
+  for (i = 0; i < n; i++) {
+    vjob = caml_alloc_tuple(2);
+    if (jobs[i].error == ERR_NONE)
+      Store_field(vjob, 0, Val_int(0)); /* None */
+    else {
+      verr = caml_alloc_small(1, 0); /* Some */
+      Field(verr, 0) = VAL_GSM_ERROR(jobs[i].error);
+      Store_field(vjob, 0, verr);
+    }
+    verr = caml_copy_double(jobs[i].time);
+    Store_field(vjob, 1, verr);
+    Store_field(res, i, vjob);
+  }
+  free(jobs);
 
-  CAMLreturn(VAL_GSM_CONNECTIONTYPE(conn_type));
+  CAMLreturn(res);
 }
 
-CAMLexport
-value caml_gammu_GSM_ReadDevice(value s, value vwait_for_reply)
+/* Same errors as the Gammu.Info stubs: not supported is an empty
+   string. */
+static gboolean got_string(GSM_Error error, char *val)
 {
-  CAMLparam2(s, vwait_for_reply);
-  GSM_StateMachine *sm;
-  gboolean wait_for_reply;
-  int read_bytes;
+  if (error == ERR_NOTSUPPORTED)
+    val[0] = '\0';
+  return (error == ERR_NONE || error == ERR_NOTSUPPORTED);
+}
 
-  sm = GSM_STATEMACHINE_VAL(s);
-  wait_for_reply = Bool_val(vwait_for_reply);
+static void *identify_job_run(void *data)
+{
+  Identify_Job *job = (Identify_Job *) data;
+  State_Machine *state_machine = job->state_machine;
+  GSM_StateMachine *sm = state_machine->sm;
+  GSM_Error error;
 
-  caml_enter_blocking_section();
+  trace_begin(state_machine, "GetIMEI");
+  job->error = GSM_GetIMEI(sm, job->imei);
+  trace_end(state_machine);
+  if (!got_string(job->error, job->imei))
+    return NULL;
+  job->error = ERR_NONE;
+  trace_begin(state_machine, "GetModel");
+  error = GSM_GetModel(sm, job->model);
+  trace_end(state_machine);
+  if (!got_string(error, job->model))
+    job->model[0] = '\0';
+  trace_begin(state_machine, "GetSIMIMSI");
+  error = GSM_GetSIMIMSI(sm, job->imsi);
+  trace_end(state_machine);
+  job->has_imsi = got_string(error, job->imsi);
+  return NULL;
+}
+
+/* Ask the IMEI, model and IMSI of the (distinct, connected) state
+   machines [vmachines] at once, each in its own thread. */
+CAMLexport
+value caml_gammu_identify_all(value vmachines)
+{
+  CAMLparam1(vmachines);
+  CAMLlocal4(res, vid, vsome, vimsi);
+  mlsize_t n = Wosize_val(vmachines), i;
+  Identify_Job *jobs;
+
+  if (n == 0)
+    CAMLreturn(Atom(0));
+  jobs = calloc(n, sizeof(Identify_Job));
+  if (jobs == NULL)
+    caml_raise_out_of_memory();
+  for (i = 0; i < n; i++)
+    jobs[i].state_machine = STATE_MACHINE_VAL(Field(vmachines, i));
+
+  caml_enter_blocking_section();
+  run_jobs(jobs, sizeof(Identify_Job), n, identify_job_run);
+  caml_leave_blocking_section();
+
+  res = caml_alloc_tuple(n);
+  for (i = 0; i < n; i++) {
+    if (jobs[i].error != ERR_NONE) {
+      Store_field(res, i, VAL_NONE);
+      continue;
+    }
+    vid = caml_alloc_tuple(3);
+    Store_field(vid, 0, caml_copy_string(jobs[i].imei));
+    Store_field(vid, 1, caml_copy_string(jobs[i].model));
+    if (jobs[i].has_imsi) {
+      vimsi = caml_copy_string(jobs[i].imsi);
+      Store_field(vid, 2, val_Some(vimsi));
+    }
+    else
+      Store_field(vid, 2, VAL_NONE);
+    vsome = val_Some(vid);
+    Store_field(res, i, vsome);
+  }
+  free(jobs);
+
+  CAMLreturn(res);
+}
+
+CAMLexport
+value caml_gammu_GSM_IsConnected(value s)
+{
+  CAMLparam1(s);
+
+  CAMLreturn(Val_bool(GSM_IsConnected(GSM_STATEMACHINE_VAL(s))));
+}
+
+CAMLexport
+value caml_gammu_GSM_GetUsedConnection(value s)
+{
+  CAMLparam1(s);
+  GSM_StateMachine *sm = GSM_STATEMACHINE_VAL(s);
+  GSM_ConnectionType conn_type;
+
+  if (!GSM_IsConnected(sm))
+    caml_gammu_raise_Error(ERR_NOTCONNECTED);
+
+  conn_type = GSM_GetUsedConnection(sm);
+  SHOUT_DBG("GSM_GetUsedConnection call made: conn_type = %i", (int) conn_type);
+
+  CAMLreturn(VAL_GSM_CONNECTIONTYPE(conn_type));
+}
+
+CAMLexport
+value caml_gammu_GSM_ReadDevice(value s, value vwait_for_reply)
+{
+  CAMLparam2(s, vwait_for_reply);
+  GSM_StateMachine *sm;
+  gboolean wait_for_reply;
+  int read_bytes;
+
+  sm = GSM_STATEMACHINE_VAL(s);
+  wait_for_reply = Bool_val(vwait_for_reply);
+
+  TRACE_BEGIN(s, "ReadDevice");
+  caml_enter_blocking_section();
   read_bytes = GSM_ReadDevice(sm, wait_for_reply);
   caml_leave_blocking_section();
+  TRACE_END(s);
   /* Bug in GSM_ReadDevice, the function already checks for connection, but
      one can't make the difference between a GSM not connected or 33 bytes
      read. This bug has been fixed in 1.28.92, it returns (-1) in that
@@ -699,6 +1414,583 @@ value caml_gammu_GSM_ReadDevice(value s, value vwait_for_reply)
   CAMLreturn(Val_int(read_bytes));
 }
 
+/* libGammu gives pieces of lines, they are assembled into records.  This
+   runs in the thread performing the operation, without the runtime lock. */
+static void log_sink_callback(const char *text, void *data)
+{
+  Log_Sink *sink = data;
+  const char *eol;
+  size_t len;
+
+  while (*text != '\0') {
+    eol = strchr(text, '\n');
+    len = (eol == NULL) ? strlen(text) : (size_t) (eol - text);
+    if (sink->line_length == 0)
+      sink->line.time = monotonic_time();
+    if (len > LOG_RECORD_LENGTH - 1 - sink->line_length)
+      len = LOG_RECORD_LENGTH - 1 - sink->line_length; /* truncate */
+    memcpy(sink->line.text + sink->line_length, text, len);
+    sink->line_length += len;
+    if (eol == NULL)
+      break;
+    log_sink_push(sink);
+    text = eol + 1;
+  }
+}
+
+static void log_sink_push(Log_Sink *sink)
+{
+  long head = sink->head;
+  Log_Record *record;
+
+  if (sink->line_length == 0)
+    return;
+  sink->line.text[sink->line_length] = '\0';
+  sink->line_length = 0;
+  if (sink->trace)
+    trace_line(sink->trace, sink->line.text, sink->line.time);
+#ifdef CAML_GAMMU_NO_PTHREAD
+  if (sink->file) {
+    fprintf(sink->file, "%.6f %s\n", sink->line.time, sink->line.text);
+    return;
+  }
+#endif
+  if (head - ATOMIC_LOAD(&sink->tail) >= sink->capacity) {
+    ATOMIC_STORE(&sink->dropped, sink->dropped + 1);
+    return;
+  }
+  record = &sink->records[head % sink->capacity];
+  record->time = sink->line.time;
+  strcpy(record->text, sink->line.text);
+  ATOMIC_STORE(&sink->head, head + 1);
+}
+
+#ifndef CAML_GAMMU_NO_PTHREAD
+static void *log_writer_thread(void *data)
+{
+  Log_Sink *sink = data;
+  struct timespec delay = { 0, 50000000L }; /* 50ms */
+  long head, tail, stop;
+  Log_Record *record;
+
+  do {
+    /* Records logged before the stop request are written. */
+    stop = ATOMIC_LOAD(&sink->stop);
+    head = ATOMIC_LOAD(&sink->head);
+    for (tail = sink->tail; tail < head; tail++) {
+      record = &sink->records[tail % sink->capacity];
+      fprintf(sink->file, "%.6f %s\n", record->time, record->text);
+    }
+    if (tail != sink->tail) {
+      fflush(sink->file);
+      ATOMIC_STORE(&sink->tail, tail);
+    }
+    if (!stop)
+      nanosleep(&delay, NULL);
+  } while (!stop);
+
+  return NULL;
+}
+#endif
+
+static void log_sink_free(Log_Sink *sink)
+{
+  if (sink->file) {
+#ifndef CAML_GAMMU_NO_PTHREAD
+    ATOMIC_STORE(&sink->stop, 1);
+    pthread_join(sink->writer, NULL);
+#endif
+    fclose(sink->file);
+  }
+  free(sink->records);
+  free(sink);
+}
+
+CAMLexport
+value caml_gammu_log_enable(value s, value vlevel, value vcapacity,
+                            value vfile)
+{
+  CAMLparam4(s, vlevel, vcapacity, vfile);
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+  GSM_StateMachine *sm = state_machine->sm;
+  long capacity = Long_val(vcapacity);
+  Log_Sink *sink;
+  GSM_Config *cfg;
+  int i;
+
+  if (capacity < 1)
+    caml_invalid_argument("Gammu.Log.enable: capacity must be >= 1.");
+  check_no_prefetch(s, "Gammu.Log.enable: SMS.fold_prefetch is running.");
+  if (Is_block(vlevel)) {
+    /* Filtering is done by libGammu which resets the level from the
+       configuration when connecting. */
+    if (!GSM_SetDebugLevel(String_val(Field(vlevel, 0)), GSM_GetDebug(sm)))
+      caml_invalid_argument("Gammu.Log.enable: invalid debug level.");
+    for (i = 0; i < GSM_GetConfigNum(sm); i++) {
+      cfg = GSM_GetConfig(sm, i);
+      CPY_TRIM_STRING_VAL(cfg->DebugLevel, Field(vlevel, 0));
+    }
+  }
+
+  sink = malloc(sizeof(Log_Sink));
+  if (!sink)
+    caml_raise_out_of_memory();
+  sink->records = malloc(capacity * sizeof(Log_Record));
+  if (!sink->records) {
+    free(sink);
+    caml_raise_out_of_memory();
+  }
+  sink->capacity = capacity;
+  sink->head = 0;
+  sink->tail = 0;
+  sink->dropped = 0;
+  sink->line_length = 0;
+  sink->file = NULL;
+  sink->trace = state_machine->trace;
+  if (Is_block(vfile)) {
+    sink->file = fopen(String_val(Field(vfile, 0)), "a");
+    if (sink->file == NULL) {
+      free(sink->records);
+      free(sink);
+      caml_gammu_raise_Error(ERR_CANTOPENFILE);
+    }
+#ifndef CAML_GAMMU_NO_PTHREAD
+    sink->stop = 0;
+    if (pthread_create(&sink->writer, NULL, log_writer_thread, sink)) {
+      fclose(sink->file);
+      free(sink->records);
+      free(sink);
+      caml_failwith("Gammu.Log.enable: cannot start the writer thread.");
+    }
+#endif
+  }
+
+  GSM_SetDebugFunction(log_sink_callback, sink, GSM_GetDebug(sm));
+  if (state_machine->log_sink)
+    log_sink_free(state_machine->log_sink);
+  state_machine->log_sink = sink;
+  if (state_machine->debug_buffer) {
+    debug_buffer_free(state_machine->debug_buffer);
+    state_machine->debug_buffer = NULL;
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLexport
+value caml_gammu_log_disable(value s)
+{
+  CAMLparam1(s);
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+
+  check_untraced(s, "Gammu.Log.disable: the state machine is traced, "
+                 "see Gammu.Trace.stop.");
+  check_no_prefetch(s, "Gammu.Log.disable: SMS.fold_prefetch is running.");
+  if (state_machine->log_sink) {
+    GSM_SetDebugFunction(NULL, NULL, GSM_GetDebug(state_machine->sm));
+    log_sink_free(state_machine->log_sink);
+    state_machine->log_sink = NULL;
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLexport
+value caml_gammu_log_drain(value s)
+{
+  CAMLparam1(s);
+  CAMLlocal3(res, vrecord, vtext);
+  Log_Sink *sink = STATE_MACHINE_VAL(s)->log_sink;
+  Log_Record *record;
+  long head, i;
+
+  if (sink == NULL || sink->file != NULL)
+    CAMLreturn(Atom(0));
+
+  head = ATOMIC_LOAD(&sink->head);
+  if (head == sink->tail)
+    CAMLreturn(Atom(0));
+  res = caml_alloc(head - sink->tail, 0);
+  for (i = 0; sink->tail + i < head; i++) {
+    record = &sink->records[(sink->tail + i) % sink->capacity];
+    vtext = caml_copy_string(record->text);
+    vrecord = caml_alloc(2, 0);
+    Store_field(vrecord, 0, caml_copy_double(record->time));
+    Store_field(vrecord, 1, vtext);
+    Store_field(res, i, vrecord);
+  }
+  /* Slots are only handed back to the producer once copied. */
+  ATOMIC_STORE(&sink->tail, head);
+
+  CAMLreturn(res);
+}
+
+CAMLexport
+value caml_gammu_log_dropped(value s)
+{
+  CAMLparam1(s);
+  Log_Sink *sink = STATE_MACHINE_VAL(s)->log_sink;
+
+  CAMLreturn(Val_long(sink ? ATOMIC_LOAD(&sink->dropped) : 0));
+}
+
+CAMLexport
+value caml_gammu_log_function(value s)
+{
+  CAMLparam1(s);
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+
+  if (state_machine->log_function)
+    CAMLreturn(val_Some(state_machine->log_function));
+  CAMLreturn(VAL_NONE);
+}
+
+static void trace_begin(State_Machine *state_machine, const char *stub)
+{
+  Trace *trace = state_machine->trace;
+
+  if (trace == NULL)
+    return;
+  trace->stub = stub;
+  trace->stub_start = monotonic_time();
+}
+
+static void trace_end(State_Machine *state_machine)
+{
+  Trace *trace = state_machine->trace;
+  Trace_Event event;
+
+  if (trace == NULL)
+    return;
+  if (trace->frame_pending) {
+    trace_push(trace, &trace->frame);
+    trace->frame_pending = FALSE;
+  }
+  event.kind = TRACE_CALL;
+  event.stub = trace->stub;
+  event.start = trace->stub_start;
+  event.duration = monotonic_time() - trace->stub_start;
+  event.size = 0;
+  event.label[0] = '\0';
+  trace_push(trace, &event);
+  trace->stub = NULL;
+}
+
+static void trace_push(Trace *trace, Trace_Event *event)
+{
+  long head = trace->head;
+
+  if (head - ATOMIC_LOAD(&trace->tail) >= trace->capacity) {
+    ATOMIC_STORE(&trace->dropped, trace->dropped + 1);
+    return;
+  }
+  trace->events[head % trace->capacity] = *event;
+  ATOMIC_STORE(&trace->head, head + 1);
+}
+
+/* libGammu logs frames (at the "text" level and above) as
+     SENDING frame type 0x00/length 0x0A/10
+     41 54 2B 43 4D 47 46 3D 30 0D                   |AT+CMGF=0.
+   and similarly with RECEIVED. */
+static void trace_line(Trace *trace, const char *line, double time)
+{
+  const char *p;
+  int kind, size;
+
+  if (trace->frame_pending) {
+    p = strrchr(line, '|');
+    if (p != NULL) {
+      strncpy(trace->frame.label, p + 1, sizeof(trace->frame.label) - 1);
+      trace->frame.label[sizeof(trace->frame.label) - 1] = '\0';
+    }
+    trace_push(trace, &trace->frame);
+    trace->frame_pending = FALSE;
+  }
+
+  if (strncmp(line, "SENDING frame", 13) == 0)
+    kind = TRACE_SENT;
+  else if (strncmp(line, "RECEIVED frame", 14) == 0)
+    kind = TRACE_RECEIVED;
+  else
+    return;
+  p = strstr(line, "/length ");
+  if (p == NULL || sscanf(p, "/length %*x/%d", &size) != 1)
+    size = -1;
+  trace->frame.kind = kind;
+  trace->frame.stub = trace->stub;
+  trace->frame.start = time;
+  trace->frame.duration = 0.;
+  trace->frame.size = size;
+  trace->frame.label[0] = '\0';
+  trace->frame_pending = TRUE;
+}
+
+CAMLexport
+value caml_gammu_trace_start(value s, value vcapacity, value vlevel)
+{
+  CAMLparam3(s, vcapacity, vlevel);
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+  long capacity = Long_val(vcapacity);
+  Trace *trace;
+
+  if (capacity < 1)
+    caml_invalid_argument("Gammu.Trace.start: capacity must be >= 1.");
+  check_no_prefetch(s, "Gammu.Trace.start: SMS.fold_prefetch is running.");
+  trace = malloc(sizeof(Trace));
+  if (!trace)
+    caml_raise_out_of_memory();
+  trace->events = malloc(capacity * sizeof(Trace_Event));
+  if (!trace->events) {
+    free(trace);
+    caml_raise_out_of_memory();
+  }
+  trace->capacity = capacity;
+  trace->head = 0;
+  trace->tail = 0;
+  trace->dropped = 0;
+  trace->stub = NULL;
+  trace->frame_pending = FALSE;
+
+  /* Frames are only seen through the log. */
+  if (state_machine->log_sink == NULL)
+    caml_gammu_log_enable(s, vlevel, Val_int(1024), VAL_NONE);
+  caml_gammu_trace_stop(s);
+  state_machine->trace = trace;
+  state_machine->log_sink->trace = trace;
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLexport
+value caml_gammu_trace_stop(value s)
+{
+  CAMLparam1(s);
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+
+  check_no_prefetch(s, "Gammu.Trace.stop: SMS.fold_prefetch is running.");
+  if (state_machine->trace) {
+    if (state_machine->log_sink)
+      state_machine->log_sink->trace = NULL;
+    free(state_machine->trace->events);
+    free(state_machine->trace);
+    state_machine->trace = NULL;
+  }
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLexport
+value caml_gammu_trace_events(value s)
+{
+  CAMLparam1(s);
+  CAMLlocal4(res, vevent, vstub, vlabel);
+  Trace *trace = STATE_MACHINE_VAL(s)->trace;
+  Trace_Event *event;
+  long head, i;
+
+  if (trace == NULL)
+    CAMLreturn(Atom(0));
+
+  head = ATOMIC_LOAD(&trace->head);
+  if (head == trace->tail)
+    CAMLreturn(Atom(0));
+  res = caml_alloc(head - trace->tail, 0);
+  for (i = 0; trace->tail + i < head; i++) {
+    event = &trace->events[(trace->tail + i) % trace->capacity];
+    vstub = caml_copy_string(event->stub ? event->stub : "");
+    vlabel = caml_copy_string(event->label);
+    vevent = caml_alloc(6, 0);
+    Store_field(vevent, 0, Val_int(event->kind));
+    Store_field(vevent, 1, vstub);
+    Store_field(vevent, 2, caml_copy_double(event->start));
+    Store_field(vevent, 3, caml_copy_double(event->duration));
+    Store_field(vevent, 4, Val_int(event->size));
+    Store_field(vevent, 5, vlabel);
+    Store_field(res, i, vevent);
+  }
+  ATOMIC_STORE(&trace->tail, head);
+
+  CAMLreturn(res);
+}
+
+CAMLexport
+value caml_gammu_trace_dropped(value s)
+{
+  CAMLparam1(s);
+  Trace *trace = STATE_MACHINE_VAL(s)->trace;
+
+  CAMLreturn(Val_long(trace ? ATOMIC_LOAD(&trace->dropped) : 0));
+}
+
+#ifndef CAML_GAMMU_NO_WATCHDOG
+/* Watchdog armed by the current thread, if any. */
+static __thread Watchdog *thread_watchdog = NULL;
+
+static void (*prev_enter_hook)(void) = NULL;
+static void (*prev_leave_hook)(void) = NULL;
+
+static void watchdog_enter_hook(void)
+{
+  Watchdog *watchdog = thread_watchdog;
+
+  if (watchdog != NULL) {
+    pthread_mutex_lock(&watchdog->mutex);
+    watchdog->in_call = TRUE;
+    pthread_cond_signal(&watchdog->cond);
+    pthread_mutex_unlock(&watchdog->mutex);
+  }
+  prev_enter_hook();
+}
+
+/* Run before the runtime lock is taken back, which may take long. */
+static void watchdog_leave_hook(void)
+{
+  Watchdog *watchdog = thread_watchdog;
+
+  if (watchdog != NULL) {
+    pthread_mutex_lock(&watchdog->mutex);
+    watchdog->in_call = FALSE;
+    pthread_mutex_unlock(&watchdog->mutex);
+  }
+  prev_leave_hook();
+}
+
+/* Chain our hooks to the ones of the runtime.  Done when arming rather
+   than at initialization because the threads library, if linked after
+   this one, replaces the hooks when it is initialized. */
+static void watchdog_install_hooks(void)
+{
+  if (caml_enter_blocking_section_hook != watchdog_enter_hook) {
+    prev_enter_hook = caml_enter_blocking_section_hook;
+    caml_enter_blocking_section_hook = watchdog_enter_hook;
+  }
+  if (caml_leave_blocking_section_hook != watchdog_leave_hook) {
+    prev_leave_hook = caml_leave_blocking_section_hook;
+    caml_leave_blocking_section_hook = watchdog_leave_hook;
+  }
+}
+
+static void *watchdog_thread(void *data)
+{
+  Watchdog *watchdog = data;
+  int rc = 0;
+
+  pthread_mutex_lock(&watchdog->mutex);
+  while (!watchdog->disarmed && rc != ETIMEDOUT)
+    rc = pthread_cond_timedwait(&watchdog->cond, &watchdog->mutex,
+                                &watchdog->deadline);
+  /* Past the deadline, abort the operation in progress or the next one
+     but never a state machine whose operation has returned. */
+  while (!watchdog->disarmed && !watchdog->in_call)
+    pthread_cond_wait(&watchdog->cond, &watchdog->mutex);
+  if (!watchdog->disarmed) {
+    /* The pending operation, if any, returns ERR_ABORTED and so will all
+       following ones until the connection is re-initialized. */
+    SHOUT_DBG("Deadline exceeded, abort operation.");
+    GSM_AbortOperation(watchdog->sm);
+    watchdog->fired = TRUE;
+  }
+  pthread_mutex_unlock(&watchdog->mutex);
+
+  return NULL;
+}
+
+/* Stop and free the watchdog of [state_machine], if any.  Returns whether
+   it has aborted the operations. */
+static gboolean watchdog_disarm(State_Machine *state_machine)
+{
+  Watchdog *watchdog = state_machine->watchdog;
+  gboolean fired;
+
+  if (watchdog == NULL)
+    return FALSE;
+
+  pthread_mutex_lock(&watchdog->mutex);
+  watchdog->disarmed = TRUE;
+  pthread_cond_signal(&watchdog->cond);
+  pthread_mutex_unlock(&watchdog->mutex);
+  /* The thread does not need the OCaml runtime, it exits promptly. */
+  pthread_join(watchdog->thread, NULL);
+  if (thread_watchdog == watchdog)
+    thread_watchdog = NULL;
+
+  fired = watchdog->fired;
+  pthread_cond_destroy(&watchdog->cond);
+  pthread_mutex_destroy(&watchdog->mutex);
+  free(watchdog);
+  state_machine->watchdog = NULL;
+
+  return fired;
+}
+#endif
+
+CAMLexport
+value caml_gammu_watchdog_arm(value s, value vtimeout)
+{
+  CAMLparam2(s, vtimeout);
+#ifdef CAML_GAMMU_NO_WATCHDOG
+  caml_gammu_raise_Error(ERR_NOTIMPLEMENTED);
+  CAMLreturn(Val_false);
+#else
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+  Watchdog *watchdog;
+  double timeout = Double_val(vtimeout);
+  time_t seconds;
+
+  /* Also rejects NaN. */
+  if (!(timeout >= 0. && timeout <= 1e8))
+    caml_invalid_argument("Gammu.with_timeout: timeout out of range.");
+  if (state_machine->watchdog != NULL)
+    /* Nested deadline, the outer one stays in force. */
+    CAMLreturn(Val_false);
+
+  watchdog = malloc(sizeof(Watchdog));
+  if (!watchdog)
+    caml_raise_out_of_memory();
+  watchdog->sm = state_machine->sm;
+  watchdog->disarmed = FALSE;
+  watchdog->fired = FALSE;
+  /* Only one watchdog per thread is followed by the hooks (e.g. not the
+     ones of connect_all), the others abort as soon as the deadline is
+     reached.  We hold the runtime lock, thus are not in a blocking
+     section. */
+  watchdog->in_call = (thread_watchdog != NULL);
+  seconds = (time_t) timeout;
+  clock_gettime(CLOCK_REALTIME, &watchdog->deadline);
+  watchdog->deadline.tv_sec += seconds;
+  watchdog->deadline.tv_nsec += (long) ((timeout - seconds) * 1e9);
+  if (watchdog->deadline.tv_nsec >= 1000000000L) {
+    watchdog->deadline.tv_sec++;
+    watchdog->deadline.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_init(&watchdog->mutex, NULL);
+  pthread_cond_init(&watchdog->cond, NULL);
+  if (pthread_create(&watchdog->thread, NULL, watchdog_thread, watchdog)) {
+    pthread_cond_destroy(&watchdog->cond);
+    pthread_mutex_destroy(&watchdog->mutex);
+    free(watchdog);
+    caml_failwith("Gammu.with_timeout: cannot start the watchdog thread.");
+  }
+  state_machine->watchdog = watchdog;
+  watchdog_install_hooks();
+  if (thread_watchdog == NULL)
+    thread_watchdog = watchdog;
+
+  CAMLreturn(Val_true);
+#endif
+}
+
+CAMLexport
+value caml_gammu_watchdog_disarm(value s)
+{
+  CAMLparam1(s);
+#ifdef CAML_GAMMU_NO_WATCHDOG
+  CAMLreturn(Val_false);
+#else
+  CAMLreturn(Val_bool(watchdog_disarm(STATE_MACHINE_VAL(s))));
+#endif
+}
+
 
 /************************************************************************/
 /* Security related operations with phone */
@@ -714,7 +2006,10 @@ value caml_gammu_GSM_EnterSecurityCode(value s, value vcode_type, value vcode)
   sm = GSM_STATEMACHINE_VAL(s),
   security_code.Type = GSM_SECURITYCODETYPE_VAL(vcode_type);
   CPY_TRIM_STRING_VAL(security_code.Code, vcode);
+  /* The SIM may have changed. */
+  STATE_MACHINE_VAL(s)->smsc_cached = FALSE;
 
+  TRACE_BEGIN(s, "EnterSecurityCode");
   caml_enter_blocking_section();
 #if GAMMU_VERSION_NUM >= 12991
   error = GSM_EnterSecurityCode(sm, &security_code);
@@ -722,6 +2017,7 @@ value caml_gammu_GSM_EnterSecurityCode(value s, value vcode_type, value vcode)
   error = GSM_EnterSecurityCode(sm, security_code);
 #endif
   caml_leave_blocking_section();
+  TRACE_END(s);
   caml_gammu_raise_Error(error);
 
   CAMLreturn(Val_unit);
@@ -737,9 +2033,11 @@ value caml_gammu_GSM_GetSecurityStatus(value s)
 
   sm = GSM_STATEMACHINE_VAL(s);
 
+  TRACE_BEGIN(s, "GetSecurityStatus");
   caml_enter_blocking_section();
   error = GSM_GetSecurityStatus(sm, &status);
   caml_leave_blocking_section();
+  TRACE_END(s);
   caml_gammu_raise_Error(error);
 
   CAMLreturn(VAL_GSM_SECURITYCODETYPE(status));
@@ -833,42 +2131,225 @@ static value Val_GSM_SignalQuality(GSM_SignalQuality *signal_quality)
   CAMLreturn(res);
 }
 
-CAMLexport
-value caml_gammu_GSM_GetNetworkName(value vcode)
+static Code_Names network_names = { NULL, NULL, 0, 0, Val_unit };
+static Code_Names country_names = { NULL, NULL, 0, 0, Val_unit };
+
+static intnat parse_digits(const char *code, mlsize_t len)
 {
-  CAMLparam1(vcode);
-  const unsigned char *name = GSM_GetNetworkName(String_val(vcode));
-  CAMLreturn(CAML_COPY_USTRING(name));
+  intnat n = 0;
+  mlsize_t i;
+
+  for (i = 0; i < len; i++) {
+    if (code[i] < '0' || code[i] > '9')
+      return -1;
+    n = n * 10 + (code[i] - '0');
+  }
+  return n;
 }
 
-CAMLexport
-value caml_gammu_GSM_GetCountryName(value vcode)
+static intnat pack_network_code(value vcode)
 {
-  CAMLparam1(vcode);
-  const unsigned char *name = GSM_GetCountryName(String_val(vcode));
-  CAMLreturn(CAML_COPY_USTRING(name));
+  const char *code = String_val(vcode);
+  mlsize_t len = caml_string_length(vcode);
+  intnat mcc, mnc;
+  mlsize_t mnc_len;
+
+  if (len < 5)
+    return -1;
+  mcc = parse_digits(code, 3);
+  code += 3;
+  len -= 3;
+  if (code[0] == ' ') {
+    code++;
+    len--;
+  }
+  mnc_len = len;
+  mnc = parse_digits(code, mnc_len);
+  if (mcc < 0 || mnc < 0 || mnc_len < 2 || mnc_len > 3)
+    return -1;
+  /* "01" and "001" are different networks. */
+  return mcc * 2000 + (mnc_len == 3 ? 1000 : 0) + mnc;
 }
 
+static intnat pack_country_code(value vcode)
+{
+  if (caml_string_length(vcode) != 3)
+    return -1;
+  return parse_digits(String_val(vcode), 3);
+}
 
-#define CAML_GAMMU_GSM_TYPE_GET(name)                                   \
-  CAMLexport CAML_GAMMU_GSM_TYPE_GET_PROTOTYPE(name)                    \
-  {                                                                     \
-    CAMLparam1(s);                                                      \
-    GSM_##name res;                                                     \
-    GSM_Error error;                                                    \
-    error = GSM_Get##name(GSM_STATEMACHINE_VAL(s), &res);               \
-    caml_gammu_raise_Error(error);                                      \
-    CAMLreturn(Val_GSM_##name(&res));                                   \
-  }
+static uintnat code_names_slot(Code_Names *t, intnat key)
+{
+  uintnat h = (uintnat) key;
 
-CAML_GAMMU_GSM_TYPE_GET(BatteryCharge)
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return h & (t->size - 1);
+}
 
-CAMLexport
-value caml_gammu_GSM_GetFirmWare(value s)
+/* Doubles the number of slots of [t] (allocating them the first time)
+   and rehashes its keys. */
+static void code_names_grow(Code_Names *t)
 {
-  CAMLparam1(s);
-  CAMLlocal1(res);
-  GSM_StateMachine *sm;
+  intnat *keys, *index;
+  intnat size = t->size == 0 ? 256 : 2 * t->size;
+  intnat *old_keys = t->keys, *old_index = t->index;
+  intnat old_size = t->size;
+  uintnat j;
+  intnat i;
+
+  keys = calloc(size, sizeof(intnat));
+  index = malloc(size * sizeof(intnat));
+  if (keys == NULL || index == NULL) {
+    free(keys);
+    free(index);
+    caml_raise_out_of_memory();
+  }
+  t->keys = keys;
+  t->index = index;
+  t->size = size;
+  for (i = 0; i < old_size; i++) {
+    if (old_keys[i] == 0) continue;
+    j = code_names_slot(t, old_keys[i]);
+    while (keys[j] != 0)
+      j = (j + 1) & (size - 1);
+    keys[j] = old_keys[i];
+    index[j] = old_index[i];
+  }
+  free(old_keys);
+  free(old_index);
+}
+
+static value code_names_add(Code_Names *t, value vname)
+{
+  CAMLparam1(vname);
+  CAMLlocal1(vnames);
+  mlsize_t i;
+
+  if (t->names == Val_unit) {
+    vnames = caml_alloc(128, 0);
+    t->names = vnames;
+    caml_register_global_root(&(t->names));
+  } else if ((mlsize_t) t->count == Wosize_val(t->names)) {
+    vnames = caml_alloc(2 * t->count, 0);
+    for (i = 0; i < (mlsize_t) t->count; i++)
+      Store_field(vnames, i, Field(t->names, i));
+    t->names = vnames;
+  }
+  Store_field(t->names, t->count, vname);
+  t->count++;
+
+  CAMLreturn(vname);
+}
+
+/* Name of the network ([network]) or country code [vcode].  The names
+   are memoized by packed code, so GSM_GetNetworkName and
+   GSM_GetCountryName, which scan the tables of libGammu, are called
+   once per code and the same string is returned for equal codes.
+   Codes of another form are not memoized. */
+static value code_name(value vcode, gboolean network)
+{
+  CAMLparam1(vcode);
+  CAMLlocal1(vname);
+  Code_Names *t = network ? &network_names : &country_names;
+  const unsigned char *name;
+  intnat key;
+  uintnat j;
+
+  key = network ? pack_network_code(vcode) : pack_country_code(vcode);
+  if (key >= 0 && t->size > 0) {
+    j = code_names_slot(t, key + 1);
+    while (t->keys[j] != 0) {
+      if (t->keys[j] == key + 1)
+        CAMLreturn(Field(t->names, t->index[j]));
+      j = (j + 1) & (t->size - 1);
+    }
+  }
+
+  if (network)
+    name = GSM_GetNetworkName(String_val(vcode));
+  else
+    name = GSM_GetCountryName(String_val(vcode));
+  vname = CAML_COPY_USTRING(name);
+  if (key < 0)
+    CAMLreturn(vname);
+
+  /* Keep the load factor under 1/2. */
+  if (2 * (t->count + 1) > t->size)
+    code_names_grow(t);
+  j = code_names_slot(t, key + 1);
+  while (t->keys[j] != 0)
+    j = (j + 1) & (t->size - 1);
+  code_names_add(t, vname);
+  t->keys[j] = key + 1;
+  t->index[j] = t->count - 1;
+
+  CAMLreturn(vname);
+}
+
+static value code_names(value vcodes, gboolean network)
+{
+  CAMLparam1(vcodes);
+  CAMLlocal2(res, vname);
+  mlsize_t len = Wosize_val(vcodes);
+  mlsize_t i;
+
+  res = caml_alloc(len, 0);
+  for (i = 0; i < len; i++) {
+    vname = code_name(Field(vcodes, i), network);
+    Store_field(res, i, vname);
+  }
+
+  CAMLreturn(res);
+}
+
+CAMLexport
+value caml_gammu_GSM_GetNetworkName(value vcode)
+{
+  return code_name(vcode, TRUE);
+}
+
+CAMLexport
+value caml_gammu_GSM_GetCountryName(value vcode)
+{
+  return code_name(vcode, FALSE);
+}
+
+CAMLexport
+value caml_gammu_network_code_names(value vcodes)
+{
+  return code_names(vcodes, TRUE);
+}
+
+CAMLexport
+value caml_gammu_country_code_names(value vcodes)
+{
+  return code_names(vcodes, FALSE);
+}
+
+
+#define CAML_GAMMU_GSM_TYPE_GET(name)                                   \
+  CAMLexport CAML_GAMMU_GSM_TYPE_GET_PROTOTYPE(name)                    \
+  {                                                                     \
+    CAMLparam1(s);                                                      \
+    GSM_##name res;                                                     \
+    GSM_Error error;                                                    \
+    TRACE_BEGIN(s, "Get" #name);                                        \
+    error = GSM_Get##name(GSM_STATEMACHINE_VAL(s), &res);               \
+    TRACE_END(s);                                                       \
+    caml_gammu_raise_Error(error);                                      \
+    CAMLreturn(Val_GSM_##name(&res));                                   \
+  }
+
+CAML_GAMMU_GSM_TYPE_GET(BatteryCharge)
+
+CAMLexport
+value caml_gammu_GSM_GetFirmWare(value s)
+{
+  CAMLparam1(s);
+  CAMLlocal1(res);
+  GSM_StateMachine *sm;
   char val[GSM_MAX_VERSION_LENGTH + 1];
   char date[GSM_MAX_VERSION_DATE_LENGTH + 1];
   double num;
@@ -876,9 +2357,11 @@ value caml_gammu_GSM_GetFirmWare(value s)
 
   sm = GSM_STATEMACHINE_VAL(s);
 
+  TRACE_BEGIN(s, "GetFirmware");
   caml_enter_blocking_section();
   error = GSM_GetFirmware(sm, val, date, &num);
   caml_leave_blocking_section();
+  TRACE_END(s);
   caml_gammu_raise_Error(error);
 
   res = caml_alloc(3, 0);
@@ -899,6 +2382,8 @@ CAML_GAMMU_GSM_STR_GET(Manufacturer, GSM_MAX_MANUFACTURER_LENGTH + 1)
 
 CAML_GAMMU_GSM_STR_GET(Model, GSM_MAX_MODEL_LENGTH + 1)
 
+CAML_GAMMU_GSM_STR_GET(SIMIMSI, BUFFER_LENGTH)
+
 CAMLexport
 value caml_gammu_GSM_GetModelInfo(value s)
 {
@@ -950,6 +2435,33 @@ static value Val_GSM_DateTime(GSM_DateTime *date_time)
   CAMLreturn(res);
 }
 
+/* Number of days since 1970-01-01 of the date y-m-d of the proleptic
+   Gregorian calendar (algorithm of H. Hinnant). */
+static long days_from_civil(long y, unsigned int m, unsigned int d)
+{
+  long era;
+  unsigned int yoe, doy, doe;
+
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = (unsigned int) (y - era * 400);
+  doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (long) doe - 719468;
+}
+
+static int64_t GSM_DateTime_epoch(GSM_DateTime *date_time)
+{
+  int64_t days;
+
+  if (date_time->Month < 1 || date_time->Month > 12)
+    return 0; /* No date given by the phone. */
+  days = days_from_civil(date_time->Year, date_time->Month, date_time->Day);
+  /* [Timezone] is the offset (in seconds) of the local time to UTC. */
+  return days * 86400 + date_time->Hour * 3600 + date_time->Minute * 60
+    + date_time->Second - date_time->Timezone;
+}
+
 CAMLexport
 value caml_gammu_GSM_CheckDate(value vdate)
 {
@@ -1000,6 +2512,137 @@ value caml_gammu_GSM_OSDateTime(value vdt, value vtimezone)
   CAMLreturn(caml_copy_string(os_date_time));
 }
 
+CAMLexport
+value caml_gammu_datetime_epoch(value vdt)
+{
+  CAMLparam1(vdt);
+  GSM_DateTime dt;
+
+  GSM_DateTime_val(&dt, vdt);
+
+  CAMLreturn(caml_copy_int64(GSM_DateTime_epoch(&dt)));
+}
+
+/* Inverse of [days_from_civil]. */
+static void civil_from_days(long z, long *y, unsigned int *m,
+                            unsigned int *d)
+{
+  long era;
+  unsigned int doe, yoe, doy, mp;
+
+  z += 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = (unsigned int) (z - era * 146097);
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp < 10 ? mp + 3 : mp - 9;
+  *y = (long) yoe + era * 400 + (*m <= 2);
+}
+
+static GSM_DateTime *GSM_DateTime_of_epoch(GSM_DateTime *date_time,
+                                           int64_t epoch, int tz_offset)
+{
+  int64_t local = epoch + tz_offset;
+  int64_t days = local / 86400;
+  int64_t secs = local % 86400;
+  long year;
+  unsigned int month, day;
+
+  if (secs < 0) {
+    secs += 86400;
+    days--;
+  }
+  civil_from_days((long) days, &year, &month, &day);
+  date_time->Timezone = tz_offset;
+  date_time->Second = secs % 60;
+  date_time->Minute = (secs / 60) % 60;
+  date_time->Hour = secs / 3600;
+  date_time->Day = day;
+  date_time->Month = month;
+  date_time->Year = year;
+
+  return date_time;
+}
+
+static value Val_stamp(GSM_DateTime *date_time)
+{
+  CAMLparam0();
+  CAMLlocal2(res, vepoch);
+
+  vepoch = caml_copy_int64(GSM_DateTime_epoch(date_time));
+  res = caml_alloc_small(2, 0);
+  Field(res, 0) = vepoch;
+  Field(res, 1) = Val_int(date_time->Timezone);
+
+  CAMLreturn(res);
+}
+
+/* Writes "YYYY-MM-DD HH:MM:SS" (followed by " +hh:mm" if [timezone])
+   in [buf], unlike OSDate and OSDateTime which use static buffers. */
+static value format_date_time(GSM_DateTime *date_time, gboolean timezone)
+{
+  char buf[64];
+  int tz = date_time->Timezone;
+  int len;
+
+  len = snprintf(buf, sizeof(buf), "%04d-%02d-%02d %02d:%02d:%02d",
+                 date_time->Year, date_time->Month, date_time->Day,
+                 date_time->Hour, date_time->Minute, date_time->Second);
+  if (timezone && len > 0 && len < (int) sizeof(buf)) {
+    snprintf(buf + len, sizeof(buf) - len, " %c%02d:%02d",
+             tz < 0 ? '-' : '+', abs(tz) / 3600, (abs(tz) / 60) % 60);
+  }
+  return caml_copy_string(buf);
+}
+
+CAMLexport
+value caml_gammu_datetime_to_stamp(value vdt)
+{
+  CAMLparam1(vdt);
+  GSM_DateTime dt;
+
+  GSM_DateTime_val(&dt, vdt);
+
+  CAMLreturn(Val_stamp(&dt));
+}
+
+CAMLexport
+value caml_gammu_datetime_of_stamp(value vstamp)
+{
+  CAMLparam1(vstamp);
+  GSM_DateTime dt;
+
+  GSM_DateTime_of_epoch(&dt, Int64_val(Field(vstamp, 0)),
+                        Int_val(Field(vstamp, 1)));
+
+  CAMLreturn(Val_GSM_DateTime(&dt));
+}
+
+CAMLexport
+value caml_gammu_datetime_format(value vdt, value vtimezone)
+{
+  CAMLparam2(vdt, vtimezone);
+  GSM_DateTime dt;
+
+  GSM_DateTime_val(&dt, vdt);
+
+  CAMLreturn(format_date_time(&dt, Bool_val(vtimezone)));
+}
+
+CAMLexport
+value caml_gammu_datetime_format_stamp(value vstamp, value vtimezone)
+{
+  CAMLparam2(vstamp, vtimezone);
+  GSM_DateTime dt;
+
+  GSM_DateTime_of_epoch(&dt, Int64_val(Field(vstamp, 0)),
+                        Int_val(Field(vstamp, 1)));
+
+  CAMLreturn(format_date_time(&dt, Bool_val(vtimezone)));
+}
+
 
 /************************************************************************/
 /* Memory */
@@ -1243,77 +2886,1104 @@ static GSM_MultiSMSMessage *GSM_MultiSMSMessage_val(
   return multi_sms;
 }
 
-static value Val_GSM_MultiSMSMessage(GSM_MultiSMSMessage *multi_sms)
+static value Val_GSM_MultiSMSMessage(GSM_MultiSMSMessage *multi_sms)
+{
+  CAMLparam0();
+  CAMLlocal1(res);
+  int length = multi_sms->Number;
+  int i;
+
+  res = caml_alloc(length, 0);
+  for (i=0; i < length; i++)
+    Store_field(res, i, Val_GSM_SMSMessage(&(multi_sms->SMS[i])));
+
+  CAMLreturn(res);
+}
+
+CAMLexport
+value caml_gammu_GSM_GetSMS(value s, value vfolder, value vlocation)
+{
+  CAMLparam3(s, vfolder, vlocation);
+  CAMLlocal1(vsms);
+  GSM_StateMachine *sm;
+  GSM_MultiSMSMessage sms;
+  GSM_Error error;
+  int i;
+
+  sm = GSM_STATEMACHINE_VAL(s);
+  /* Clear SMS structure */
+  for (i = 0; i < GSM_MAX_MULTI_SMS; i++)
+    GSM_SetDefaultSMSData(&sms.SMS[i]);
+
+  sms.SMS[0].Location = Int_val(vlocation);
+  sms.SMS[0].Folder = Int_val(vfolder);
+  /* TODO: Is that necessary ? */
+  sms.Number = 0;
+
+  TRACE_BEGIN(s, "GetSMS");
+  caml_enter_blocking_section();
+  error = GSM_GetSMS(sm, &sms);
+  caml_leave_blocking_section();
+  TRACE_END(s);
+  caml_gammu_raise_Error(error);
+
+  vsms = Val_GSM_MultiSMSMessage(&sms);
+  CAMLreturn(vsms);
+}
+
+static void get_next_sms(value s, value vlocation, value vfolder,
+                         value vstart, GSM_MultiSMSMessage *sms)
+{
+  GSM_StateMachine *sm;
+  gboolean start;
+  GSM_Error error;
+  int i;
+
+  sm = GSM_STATEMACHINE_VAL(s);
+  start = Bool_val(vstart);
+  /* Clear SMS structure */
+  for (i = 0; i < GSM_MAX_MULTI_SMS; i++)
+    GSM_SetDefaultSMSData(&sms->SMS[i]);
+
+  sms->SMS[0].Location = Int_val(vlocation);
+  sms->SMS[0].Folder = Int_val(vfolder);
+  /* TODO: Is that necessary ? */
+  sms->Number = 0;
+
+  TRACE_BEGIN(s, "GetNextSMS");
+  caml_enter_blocking_section();
+  error = GSM_GetNextSMS(sm, sms, start);
+  caml_leave_blocking_section();
+  TRACE_END(s);
+  caml_gammu_raise_Error(error);
+}
+
+CAMLexport
+value caml_gammu_GSM_GetNextSMS(value s, value vlocation, value vfolder,
+                                value vstart)
+{
+  CAMLparam4(s, vlocation, vfolder, vstart);
+  GSM_MultiSMSMessage sms;
+
+  get_next_sms(s, vlocation, vfolder, vstart, &sms);
+
+  CAMLreturn(Val_GSM_MultiSMSMessage(&sms));
+}
+
+CAMLexport
+value caml_gammu_GSM_GetNextSMS_stamped(value s, value vlocation,
+                                        value vfolder, value vstart)
+{
+  CAMLparam4(s, vlocation, vfolder, vstart);
+  CAMLlocal3(res, vstamp, vsms);
+  GSM_MultiSMSMessage sms;
+
+  get_next_sms(s, vlocation, vfolder, vstart, &sms);
+
+  /* The stamp is the one of the first part, the date of the message. */
+  vstamp = Val_stamp(&sms.SMS[0].DateTime);
+  vsms = Val_GSM_MultiSMSMessage(&sms);
+  res = caml_alloc_small(2, 0);
+  Field(res, 0) = vstamp;
+  Field(res, 1) = vsms;
+
+  CAMLreturn(res);
+}
+
+static gboolean sms_columns_init(SMS_Columns *cols)
+{
+  cols->count = 0;
+  cols->capacity = 64;
+  cols->time = malloc(cols->capacity * sizeof(int64_t));
+  cols->state = malloc(cols->capacity * sizeof(intnat));
+  cols->folder = malloc(cols->capacity * sizeof(intnat));
+  cols->location = malloc(cols->capacity * sizeof(intnat));
+  cols->coding = malloc(cols->capacity * sizeof(intnat));
+  cols->sms_class = malloc(cols->capacity * sizeof(intnat));
+  cols->offsets = malloc((2 * cols->capacity + 1) * sizeof(intnat));
+  cols->arena_length = 0;
+  cols->arena_capacity = 64 * 128;
+  cols->arena = malloc(cols->arena_capacity);
+  if (cols->offsets)
+    cols->offsets[0] = 0;
+  return cols->time && cols->state && cols->folder && cols->location
+    && cols->coding && cols->sms_class && cols->offsets && cols->arena;
+}
+
+/* Reallocate the column [p] (of elements of type [ty]) to [n] elements. */
+#define COLUMN_REALLOC(p, ty, n, ok)                    \
+  do {                                                  \
+    ty *new_column = realloc(p, (n) * sizeof(ty));      \
+    if (new_column) p = new_column; else ok = FALSE;    \
+  } while (0)
+
+/* Append [src] to the arena: converted from unicode if [unicode], the
+   [length] first bytes of it (which may contain NULs) otherwise. */
+static gboolean sms_columns_add_string(SMS_Columns *cols,
+                                       const unsigned char *src,
+                                       gboolean unicode, size_t length)
+{
+  /* An UCS-2 character takes at most 3 bytes in UTF-8 and a surrogate pair
+     4 bytes, i.e. 3 bytes per input byte is plenty. */
+  size_t max_len = unicode ? 3 * (2 * UnicodeLength(src) + 2) : length + 1;
+  gboolean ok = TRUE;
+
+  while (cols->arena_length + max_len > cols->arena_capacity) {
+    COLUMN_REALLOC(cols->arena, char, 2 * cols->arena_capacity, ok);
+    if (!ok)
+      return FALSE;
+    cols->arena_capacity *= 2;
+  }
+  if (unicode) {
+    DecodeUnicode(src, cols->arena + cols->arena_length);
+    cols->arena_length += strlen(cols->arena + cols->arena_length);
+  }
+  else {
+    memcpy(cols->arena + cols->arena_length, src, length);
+    cols->arena_length += length;
+  }
+  return TRUE;
+}
+
+static gboolean sms_columns_add(SMS_Columns *cols, GSM_SMSMessage *sms)
+{
+  long i = cols->count;
+  long capacity = 2 * cols->capacity;
+  gboolean ok = TRUE;
+
+  if (i == cols->capacity) {
+    COLUMN_REALLOC(cols->time, int64_t, capacity, ok);
+    COLUMN_REALLOC(cols->state, intnat, capacity, ok);
+    COLUMN_REALLOC(cols->folder, intnat, capacity, ok);
+    COLUMN_REALLOC(cols->location, intnat, capacity, ok);
+    COLUMN_REALLOC(cols->coding, intnat, capacity, ok);
+    COLUMN_REALLOC(cols->sms_class, intnat, capacity, ok);
+    COLUMN_REALLOC(cols->offsets, intnat, 2 * capacity + 1, ok);
+    if (!ok)
+      return FALSE;
+    cols->capacity = capacity;
+  }
+  /* Encoded as the position of the constructor in gammu.ml */
+  cols->time[i] = GSM_DateTime_epoch(&(sms->DateTime));
+  cols->state[i] = sms->State - 1;
+  cols->folder[i] = sms->Folder;
+  cols->location[i] = sms->Location;
+  cols->coding[i] = sms->Coding - 1;
+  cols->sms_class[i] = sms->Class;
+  if (!sms_columns_add_string(cols, sms->Number, TRUE, 0))
+    return FALSE;
+  cols->offsets[2 * i + 1] = cols->arena_length;
+  if (sms->Coding == SMS_Coding_8bit) {
+    size_t length = sms->Length;
+    if (length > sizeof(sms->Text))
+      length = sizeof(sms->Text);
+    if (!sms_columns_add_string(cols, sms->Text, FALSE, length))
+      return FALSE;
+  }
+  else if (!sms_columns_add_string(cols, sms->Text, TRUE, 0))
+    return FALSE;
+  cols->offsets[2 * i + 2] = cols->arena_length;
+  cols->count++;
+  return TRUE;
+}
+
+static void sms_columns_free(SMS_Columns *cols)
+{
+  free(cols->time);
+  free(cols->state);
+  free(cols->folder);
+  free(cols->location);
+  free(cols->coding);
+  free(cols->sms_class);
+  free(cols->offsets);
+  free(cols->arena);
+}
+
+#define COLUMN_BIGARRAY(kind, data, n)                                  \
+  caml_ba_alloc_dims(kind | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, data, \
+                     (intnat) (n))
+
+CAMLexport
+value caml_gammu_sms_columns(value s, value vfolder, value vn)
+{
+  CAMLparam3(s, vfolder, vn);
+  CAMLlocal1(res);
+  GSM_StateMachine *sm = GSM_STATEMACHINE_VAL(s);
+  int folder = Int_val(vfolder);
+  long n = Long_val(vn), messages = 0;
+  GSM_MultiSMSMessage sms;
+  SMS_Columns cols;
+  GSM_Error error = ERR_NONE;
+  gboolean start = TRUE;
+  int location = 0, failures = 0, i;
+
+  if (!sms_columns_init(&cols)) {
+    sms_columns_free(&cols);
+    caml_raise_out_of_memory();
+  }
+
+  /* The whole folder sweep is done without the runtime lock. */
+  TRACE_BEGIN(s, "GetNextSMS");
+  caml_enter_blocking_section();
+  while (n < 0 || messages < n) {
+    for (i = 0; i < GSM_MAX_MULTI_SMS; i++)
+      GSM_SetDefaultSMSData(&sms.SMS[i]);
+    sms.SMS[0].Location = location;
+    /* Once started, the location carries the folder. */
+    sms.SMS[0].Folder = start ? folder : 0;
+    sms.Number = 0;
+    error = GSM_GetNextSMS(sm, &sms, start);
+    if (error == ERR_EMPTY) {
+      /* There's no next SMS message. */
+      error = ERR_NONE;
+      break;
+    }
+    if ((error == ERR_UNKNOWN || error == ERR_CORRUPTED) && failures < 8) {
+      /* Skip the message, as SMS.fold does. */
+      failures++;
+      if (start)
+        start = FALSE;
+      else
+        location++;
+      continue;
+    }
+    if (error != ERR_NONE)
+      break;
+    failures = 0;
+    for (i = 0; i < sms.Number; i++)
+      if (!sms_columns_add(&cols, &sms.SMS[i])) {
+        error = ERR_MOREMEMORY;
+        break;
+      }
+    if (error != ERR_NONE)
+      break;
+    messages++;
+    location = sms.SMS[0].Location;
+    start = FALSE;
+  }
+  caml_leave_blocking_section();
+  TRACE_END(s);
+  if (error != ERR_NONE) {
+    sms_columns_free(&cols);
+    caml_gammu_raise_Error(error);
+  }
+
+  /* The bigarrays take ownership of the columns. */
+  res = caml_alloc(9, 0);
+  Store_field(res, 0, Val_long(cols.count));
+  Store_field(res, 1, COLUMN_BIGARRAY(CAML_BA_INT64, cols.time, cols.count));
+  Store_field(res, 2, COLUMN_BIGARRAY(CAML_BA_CAML_INT, cols.state,
+                                      cols.count));
+  Store_field(res, 3, COLUMN_BIGARRAY(CAML_BA_CAML_INT, cols.folder,
+                                      cols.count));
+  Store_field(res, 4, COLUMN_BIGARRAY(CAML_BA_CAML_INT, cols.location,
+                                      cols.count));
+  Store_field(res, 5, COLUMN_BIGARRAY(CAML_BA_CAML_INT, cols.coding,
+                                      cols.count));
+  Store_field(res, 6, COLUMN_BIGARRAY(CAML_BA_CAML_INT, cols.sms_class,
+                                      cols.count));
+  Store_field(res, 7, COLUMN_BIGARRAY(CAML_BA_CAML_INT, cols.offsets,
+                                      2 * cols.count + 1));
+  Store_field(res, 8, COLUMN_BIGARRAY(CAML_BA_CHAR, cols.arena,
+                                      cols.arena_length));
+
+  CAMLreturn(res);
+}
+
+#ifndef CAML_GAMMU_NO_PTHREAD
+/* Add [entry] to the queue, waiting for room.  Returns FALSE if the
+   consumer asked to stop. */
+static gboolean sms_prefetch_push(SMS_Prefetch *prefetch,
+                                  SMS_Prefetched *entry)
+{
+  double start = monotonic_time();
+
+  pthread_mutex_lock(&prefetch->mutex);
+  while (!prefetch->stop && prefetch->head - prefetch->tail >= prefetch->depth)
+    pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+  prefetch->producer_wait += monotonic_time() - start;
+  if (prefetch->stop) {
+    pthread_mutex_unlock(&prefetch->mutex);
+    return FALSE;
+  }
+  pthread_mutex_unlock(&prefetch->mutex);
+  /* The consumer does not touch the slot until [head] is incremented. */
+  prefetch->queue[prefetch->head % prefetch->depth] = *entry;
+  pthread_mutex_lock(&prefetch->mutex);
+  prefetch->head++;
+  pthread_cond_broadcast(&prefetch->cond);
+  pthread_mutex_unlock(&prefetch->mutex);
+  return TRUE;
+}
+
+/* Same walk as SMS.fold (fold_loop in gammu.ml). */
+static void *sms_prefetch_thread(void *data)
+{
+  SMS_Prefetch *prefetch = data;
+  GSM_StateMachine *sm = prefetch->state_machine->sm;
+  SMS_Prefetched *entry;
+  GSM_Error error = ERR_NONE;
+  gboolean start = TRUE;
+  int location = 0, retries_num = 0, i;
+  long n = prefetch->n;
+  double t;
+
+  entry = malloc(sizeof(SMS_Prefetched));
+  if (entry == NULL)
+    error = ERR_MOREMEMORY;
+  while (error == ERR_NONE && n != 0) {
+    for (i = 0; i < GSM_MAX_MULTI_SMS; i++)
+      GSM_SetDefaultSMSData(&entry->sms.SMS[i]);
+    entry->sms.SMS[0].Location = location;
+    /* Once started, the location carries the folder. */
+    entry->sms.SMS[0].Folder = start ? prefetch->folder : 0;
+    entry->sms.Number = 0;
+    t = monotonic_time();
+    trace_begin(prefetch->state_machine, "GetNextSMS");
+    entry->error = GSM_GetNextSMS(sm, &entry->sms, start);
+    trace_end(prefetch->state_machine);
+    prefetch->fetch_time += monotonic_time() - t;
+    entry->location = start ? -1 : location;
+    if (entry->error == ERR_UNKNOWN || entry->error == ERR_CORRUPTED) {
+      /* Let the consumer call [on_err]. */
+      if (!sms_prefetch_push(prefetch, entry))
+        break;
+      if (retries_num == prefetch->retries) {
+        retries_num = 0;
+        start = FALSE;
+        location++;
+      }
+      else
+        retries_num++;
+      continue;
+    }
+    if (entry->error != ERR_NONE) {
+      error = entry->error;
+      break;
+    }
+    prefetch->fetched++;
+    if (!sms_prefetch_push(prefetch, entry))
+      break;
+    retries_num = 0;
+    location = entry->sms.SMS[0].Location;
+    start = FALSE;
+    if (n > 0)
+      n--;
+  }
+  free(entry);
+
+  pthread_mutex_lock(&prefetch->mutex);
+  prefetch->error = (error == ERR_NONE) ? ERR_EMPTY : error;
+  prefetch->done = TRUE;
+  pthread_cond_broadcast(&prefetch->cond);
+  pthread_mutex_unlock(&prefetch->mutex);
+
+  return NULL;
+}
+
+/* Ask the thread of [prefetch] to stop and wait for it to do so.  May be
+   called concurrently (Gammu.free and the consumer): the first caller
+   joins the thread, the others wait for it. */
+static void sms_prefetch_join(SMS_Prefetch *prefetch)
+{
+  gboolean join;
+
+  pthread_mutex_lock(&prefetch->mutex);
+  join = !prefetch->stop;
+  prefetch->stop = TRUE;
+  pthread_cond_broadcast(&prefetch->cond);
+  if (join) {
+    pthread_mutex_unlock(&prefetch->mutex);
+    /* The current GetNextSMS, if any, has to complete. */
+    pthread_join(prefetch->thread, NULL);
+    pthread_mutex_lock(&prefetch->mutex);
+    prefetch->joined = TRUE;
+    pthread_cond_broadcast(&prefetch->cond);
+  }
+  else
+    while (!prefetch->joined)
+      pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+  pthread_mutex_unlock(&prefetch->mutex);
+}
+
+/* Called with the runtime lock. */
+static void state_machine_stop_prefetch(State_Machine *state_machine)
+{
+  SMS_Prefetch *prefetch = state_machine->prefetch;
+
+  if (prefetch == NULL)
+    return;
+  sms_prefetch_join(prefetch);
+  prefetch->state_machine = NULL;
+  state_machine->prefetch = NULL;
+}
+
+/* Called with the runtime lock, once [prefetch] is joined. */
+static void sms_prefetch_detach(SMS_Prefetch *prefetch)
+{
+  if (prefetch->state_machine != NULL) {
+    prefetch->state_machine->prefetch = NULL;
+    prefetch->state_machine = NULL;
+  }
+}
+#endif
+
+static void caml_gammu_sms_prefetch_finalize(value vprefetch)
+{
+#ifndef CAML_GAMMU_NO_PTHREAD
+  SMS_Prefetch *prefetch = SMS_PREFETCH_VAL(vprefetch);
+
+  sms_prefetch_join(prefetch);
+  sms_prefetch_detach(prefetch);
+  pthread_cond_destroy(&prefetch->cond);
+  pthread_mutex_destroy(&prefetch->mutex);
+  free(prefetch->queue);
+  free(prefetch);
+#endif
+}
+
+CAMLexport
+value caml_gammu_sms_prefetch_start(value s, value vfolder, value vn,
+                                    value vretries, value vdepth)
+{
+  CAMLparam5(s, vfolder, vn, vretries, vdepth);
+#ifdef CAML_GAMMU_NO_PTHREAD
+  caml_gammu_raise_Error(ERR_NOTIMPLEMENTED);
+  CAMLreturn(Val_unit);
+#else
+  CAMLlocal1(res);
+  SMS_Prefetch *prefetch;
+  long depth = Long_val(vdepth);
+
+  if (depth < 1 || depth > 64)
+    caml_invalid_argument("Gammu.SMS.fold_prefetch: depth out of range.");
+  if (STATE_MACHINE_VAL(s)->prefetch != NULL)
+    caml_invalid_argument("Gammu.SMS.fold_prefetch: already running on "
+                          "this state machine.");
+  prefetch = malloc(sizeof(SMS_Prefetch));
+  if (prefetch == NULL)
+    caml_raise_out_of_memory();
+  prefetch->queue = malloc(depth * sizeof(SMS_Prefetched));
+  if (prefetch->queue == NULL) {
+    free(prefetch);
+    caml_raise_out_of_memory();
+  }
+  prefetch->state_machine = STATE_MACHINE_VAL(s);
+  prefetch->folder = Int_val(vfolder);
+  prefetch->n = Long_val(vn);
+  prefetch->retries = Int_val(vretries);
+  prefetch->depth = depth;
+  prefetch->head = 0;
+  prefetch->tail = 0;
+  prefetch->done = FALSE;
+  prefetch->stop = FALSE;
+  prefetch->joined = FALSE;
+  prefetch->error = ERR_NONE;
+  prefetch->fetched = 0;
+  prefetch->fetch_time = 0.;
+  prefetch->producer_wait = 0.;
+  prefetch->consumer_wait = 0.;
+  pthread_mutex_init(&prefetch->mutex, NULL);
+  pthread_cond_init(&prefetch->cond, NULL);
+  if (pthread_create(&prefetch->thread, NULL, sms_prefetch_thread,
+                     prefetch)) {
+    pthread_cond_destroy(&prefetch->cond);
+    pthread_mutex_destroy(&prefetch->mutex);
+    free(prefetch->queue);
+    free(prefetch);
+    caml_failwith("Gammu.SMS.fold_prefetch: cannot start the thread.");
+  }
+  prefetch->state_machine->prefetch = prefetch;
+
+  /* The queue holds up to 64 messages of GSM_MAX_MULTI_SMS parts. */
+  res = caml_alloc_custom(&caml_gammu_sms_prefetch_ops,
+                          sizeof(SMS_Prefetch *), 1, 16);
+  SMS_PREFETCH_VAL(res) = prefetch;
+
+  CAMLreturn(res);
+#endif
+}
+
+/* Returns the next message (as [Some(Ok multi_sms)] to OCaml), the next
+   error to give to [on_err] ([Some(Error(location, e))]) or [None] at the
+   end of the messages. */
+CAMLexport
+value caml_gammu_sms_prefetch_next(value vprefetch)
+{
+  CAMLparam1(vprefetch);
+#ifdef CAML_GAMMU_NO_PTHREAD
+  CAMLreturn(Val_int(0));
+#else
+  CAMLlocal3(res, vsome, verr);
+  SMS_Prefetch *prefetch = SMS_PREFETCH_VAL(vprefetch);
+  SMS_Prefetched *entry;
+  gboolean available;
+  double start;
+
+  start = monotonic_time();
+  caml_enter_blocking_section();
+  pthread_mutex_lock(&prefetch->mutex);
+  while (prefetch->head == prefetch->tail && !prefetch->done)
+    pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+  /* [done] is only set after the last push. */
+  available = prefetch->head != prefetch->tail;
+  pthread_mutex_unlock(&prefetch->mutex);
+  caml_leave_blocking_section();
+  prefetch->consumer_wait += monotonic_time() - start;
+
+  if (!available) {
+    if (prefetch->error == ERR_EMPTY)
+      CAMLreturn(Val_int(0)); /* None */
+    caml_gammu_raise_Error(prefetch->error);
+  }
+
+  entry = &prefetch->queue[prefetch->tail % prefetch->depth];
+  if (entry->error == ERR_NONE) {
+    res = caml_alloc(1, 0); /* Ok */
+    Store_field(res, 0, Val_GSM_MultiSMSMessage(&entry->sms));
+  }
+  else {
+    verr = caml_alloc(2, 0);
+    Store_field(verr, 0, Val_int(entry->location));
+    Store_field(verr, 1, VAL_GSM_ERROR(entry->error));
+    res = caml_alloc(1, 1); /* Error */
+    Store_field(res, 0, verr);
+  }
+  pthread_mutex_lock(&prefetch->mutex);
+  prefetch->tail++;
+  pthread_cond_broadcast(&prefetch->cond);
+  pthread_mutex_unlock(&prefetch->mutex);
+  vsome = caml_alloc(1, 0);
+  Store_field(vsome, 0, res);
+
+  CAMLreturn(vsome);
+#endif
+}
+
+CAMLexport
+value caml_gammu_sms_prefetch_stop(value vprefetch)
+{
+  CAMLparam1(vprefetch);
+#ifdef CAML_GAMMU_NO_PTHREAD
+  CAMLreturn(Val_unit);
+#else
+  CAMLlocal1(res);
+  SMS_Prefetch *prefetch = SMS_PREFETCH_VAL(vprefetch);
+
+  caml_enter_blocking_section();
+  sms_prefetch_join(prefetch);
+  caml_leave_blocking_section();
+  sms_prefetch_detach(prefetch);
+
+  res = caml_alloc(4, 0);
+  Store_field(res, 0, Val_long(prefetch->fetched));
+  Store_field(res, 1, caml_copy_double(prefetch->fetch_time));
+  Store_field(res, 2, caml_copy_double(prefetch->producer_wait));
+  Store_field(res, 3, caml_copy_double(prefetch->consumer_wait));
+
+  CAMLreturn(res);
+#endif
+}
+
+
+/************************************************************************/
+/* SMS archive */
+
+static uint64_t archive_uint(const char *p, int bytes)
+{
+  uint64_t n = 0;
+  int i;
+
+  for (i = bytes - 1; i >= 0; i--)
+    n = (n << 8) | (unsigned char) p[i];
+  return n;
+}
+
+static int archive_key_compare_time(const void *k1, const void *k2)
+{
+  const Archive_Key *key1 = k1, *key2 = k2;
+
+  if (key1->time != key2->time)
+    return (key1->time < key2->time) ? -1 : 1;
+  return (key1->offset < key2->offset) ? -1 : (key1->offset > key2->offset);
+}
+
+static int archive_key_compare_number(const void *k1, const void *k2)
+{
+  const Archive_Key *key1 = k1, *key2 = k2;
+  size_t length = key1->number_length < key2->number_length
+    ? key1->number_length : key2->number_length;
+  int c = memcmp(key1->number, key2->number, length);
+
+  if (c != 0)
+    return c;
+  if (key1->number_length != key2->number_length)
+    return (key1->number_length < key2->number_length) ? -1 : 1;
+  return archive_key_compare_time(k1, k2);
+}
+
+/* Release the file and the indexes of [archive]. */
+static void archive_release(SMS_Archive *archive)
+{
+  if (archive->data != NULL) {
+#ifndef CAML_GAMMU_NO_MMAP
+    if (archive->mapped)
+      munmap(archive->data, archive->length);
+    else
+#endif
+      free(archive->data);
+  }
+  archive->data = NULL;
+  free(archive->by_time);
+  archive->by_time = NULL;
+  free(archive->by_number);
+  archive->by_number = NULL;
+}
+
+static void caml_gammu_archive_finalize(value varchive)
+{
+  SMS_Archive *archive = SMS_ARCHIVE_VAL(varchive);
+
+  archive_release(archive);
+  free(archive);
+}
+
+/* Map the file [path] into [archive].  Returns FALSE on error. */
+static gboolean archive_load(SMS_Archive *archive, const char *path)
+{
+#ifndef CAML_GAMMU_NO_MMAP
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1)
+    return FALSE;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return FALSE;
+  }
+  archive->length = st.st_size;
+  if (archive->length > 0) {
+    archive->data = mmap(NULL, archive->length, PROT_READ, MAP_SHARED, fd, 0);
+    if (archive->data == MAP_FAILED)
+      archive->data = NULL;
+    archive->mapped = TRUE;
+  }
+  close(fd);
+  return archive->length == 0 || archive->data != NULL;
+#else
+  FILE *f = fopen(path, "rb");
+  long length;
+
+  if (f == NULL)
+    return FALSE;
+  if (fseek(f, 0, SEEK_END) == 0 && (length = ftell(f)) >= 0) {
+    archive->length = length;
+    archive->data = malloc(length + 1);
+    rewind(f);
+    if (archive->data != NULL
+        && fread(archive->data, 1, length, f) != (size_t) length) {
+      free(archive->data);
+      archive->data = NULL;
+    }
+  }
+  fclose(f);
+  return archive->data != NULL;
+#endif
+}
+
+CAMLexport
+value caml_gammu_archive_open(value vpath)
+{
+  CAMLparam1(vpath);
+  CAMLlocal1(res);
+  SMS_Archive *archive;
+  size_t offset, record_length;
+  const char *p;
+  long i;
+
+  archive = calloc(1, sizeof(SMS_Archive));
+  if (archive == NULL)
+    caml_raise_out_of_memory();
+  if (!archive_load(archive, String_val(vpath))) {
+    free(archive);
+    caml_gammu_raise_Error(ERR_CANTOPENFILE);
+  }
+  if (archive->length >= ARCHIVE_MAGIC_LENGTH
+      && memcmp(archive->data, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LENGTH) != 0) {
+    archive_release(archive);
+    free(archive);
+    caml_gammu_raise_Error(ERR_FILENOTSUPPORTED);
+  }
+
+  /* Count the complete records, a crash may have cut the last one. */
+  offset = ARCHIVE_MAGIC_LENGTH;
+  while (offset + ARCHIVE_HEADER <= archive->length) {
+    p = archive->data + offset;
+    record_length = archive_uint(p + ARCHIVE_LENGTH, 4);
+    if (record_length != ARCHIVE_HEADER
+        + archive_uint(p + ARCHIVE_NUMBER_LENGTH, 2)
+        + archive_uint(p + ARCHIVE_TEXT_LENGTH, 4)
+        || offset + record_length > archive->length)
+      break;
+    archive->count++;
+    offset += record_length;
+  }
+  archive->valid = (archive->length < ARCHIVE_MAGIC_LENGTH) ? 0 : offset;
+
+  if (archive->count > 0) {
+    archive->by_time = malloc(archive->count * sizeof(Archive_Key));
+    archive->by_number = malloc(archive->count * sizeof(Archive_Key));
+    if (archive->by_time == NULL || archive->by_number == NULL) {
+      archive_release(archive);
+      free(archive);
+      caml_raise_out_of_memory();
+    }
+    offset = ARCHIVE_MAGIC_LENGTH;
+    for (i = 0; i < archive->count; i++) {
+      p = archive->data + offset;
+      archive->by_time[i].number = p + ARCHIVE_HEADER;
+      archive->by_time[i].number_length =
+        archive_uint(p + ARCHIVE_NUMBER_LENGTH, 2);
+      archive->by_time[i].time = (int64_t) archive_uint(p + ARCHIVE_TIME, 8);
+      archive->by_time[i].offset = offset;
+      offset += archive_uint(p + ARCHIVE_LENGTH, 4);
+    }
+    memcpy(archive->by_number, archive->by_time,
+           archive->count * sizeof(Archive_Key));
+    qsort(archive->by_time, archive->count, sizeof(Archive_Key),
+          archive_key_compare_time);
+    qsort(archive->by_number, archive->count, sizeof(Archive_Key),
+          archive_key_compare_number);
+  }
+
+  res = caml_alloc_custom(&caml_gammu_archive_ops, sizeof(SMS_Archive *),
+                          1, 100);
+  SMS_ARCHIVE_VAL(res) = archive;
+
+  CAMLreturn(res);
+}
+
+CAMLexport
+value caml_gammu_archive_close(value varchive)
+{
+  CAMLparam1(varchive);
+  archive_release(SMS_ARCHIVE_VAL(varchive));
+  CAMLreturn(Val_unit);
+}
+
+static SMS_Archive *archive_opened(value varchive)
+{
+  SMS_Archive *archive = SMS_ARCHIVE_VAL(varchive);
+
+  if (archive->data == NULL && archive->length > 0)
+    caml_invalid_argument("Gammu.SMS.Archive: reader closed.");
+  return archive;
+}
+
+/* Record at the offset [ventry] of [varchive].  The whole record, with
+   the lengths it gives, must lie in the complete records. */
+static const char *archive_record(value varchive, value ventry)
+{
+  SMS_Archive *archive = archive_opened(varchive);
+  long offset = Long_val(ventry);
+  const char *p;
+  size_t record_length;
+
+  if (offset < ARCHIVE_MAGIC_LENGTH
+      || (size_t) offset + ARCHIVE_HEADER > archive->valid)
+    caml_invalid_argument("Gammu.SMS.Archive: invalid entry.");
+  p = archive->data + offset;
+  record_length = archive_uint(p + ARCHIVE_LENGTH, 4);
+  if (record_length != ARCHIVE_HEADER
+      + archive_uint(p + ARCHIVE_NUMBER_LENGTH, 2)
+      + archive_uint(p + ARCHIVE_TEXT_LENGTH, 4)
+      || (size_t) offset + record_length > archive->valid)
+    caml_invalid_argument("Gammu.SMS.Archive: invalid entry.");
+  return p;
+}
+
+CAMLexport
+value caml_gammu_archive_info(value varchive)
+{
+  CAMLparam1(varchive);
+  CAMLlocal1(res);
+  SMS_Archive *archive = SMS_ARCHIVE_VAL(varchive);
+
+  res = caml_alloc_tuple(2);
+  Store_field(res, 0, Val_long(archive->count));
+  Store_field(res, 1, Val_long(archive->valid));
+
+  CAMLreturn(res);
+}
+
+CAMLexport
+value caml_gammu_archive_nth(value varchive, value vi)
+{
+  CAMLparam2(varchive, vi);
+  SMS_Archive *archive = archive_opened(varchive);
+  long i = Long_val(vi);
+
+  if (i < 0 || i >= archive->count)
+    caml_invalid_argument("Gammu.SMS.Archive.nth");
+
+  CAMLreturn(Val_long(archive->by_time[i].offset));
+}
+
+CAMLexport
+value caml_gammu_archive_time(value varchive, value ventry)
+{
+  CAMLparam2(varchive, ventry);
+  const char *p = archive_record(varchive, ventry);
+
+  CAMLreturn(caml_copy_int64((int64_t) archive_uint(p + ARCHIVE_TIME, 8)));
+}
+
+/* [vfield] is the offset of one of the u8 fields. */
+CAMLexport
+value caml_gammu_archive_field(value varchive, value ventry, value vfield)
+{
+  CAMLparam3(varchive, ventry, vfield);
+  const char *p = archive_record(varchive, ventry);
+
+  CAMLreturn(Val_int((unsigned char) p[Int_val(vfield)]));
+}
+
+CAMLexport
+value caml_gammu_archive_string(value varchive, value ventry, value vtext)
+{
+  CAMLparam3(varchive, ventry, vtext);
+  CAMLlocal1(res);
+  const char *p = archive_record(varchive, ventry);
+  size_t number_length = archive_uint(p + ARCHIVE_NUMBER_LENGTH, 2);
+  size_t length;
+
+  if (Bool_val(vtext)) {
+    length = archive_uint(p + ARCHIVE_TEXT_LENGTH, 4);
+    p += ARCHIVE_HEADER + number_length;
+  }
+  else {
+    length = number_length;
+    p += ARCHIVE_HEADER;
+  }
+  /* [p] is outside the OCaml heap, the allocation does not move it. */
+  res = caml_alloc_string(length);
+  memcpy((char *) String_val(res), p, length);
+
+  CAMLreturn(res);
+}
+
+/* Entries of [number] (all if [None]) between [from] and [until]
+   (included), by increasing time.  Only the indexes are read. */
+CAMLexport
+value caml_gammu_archive_range(value varchive, value vnumber, value vfrom,
+                               value vuntil)
+{
+  CAMLparam4(varchive, vnumber, vfrom, vuntil);
+  CAMLlocal1(res);
+  SMS_Archive *archive = archive_opened(varchive);
+  int (*compare)(const void *, const void *);
+  Archive_Key *index, key;
+  int64_t until = Int64_val(vuntil);
+  long lo = 0, hi = archive->count, mid, end, i;
+
+  key.time = Int64_val(vfrom);
+  key.offset = -1;              /* Before all records of that time. */
+  if (Is_block(vnumber)) {
+    key.number = String_val(Field(vnumber, 0));
+    key.number_length = caml_string_length(Field(vnumber, 0));
+    index = archive->by_number;
+    compare = archive_key_compare_number;
+  }
+  else {
+    index = archive->by_time;
+    compare = archive_key_compare_time;
+  }
+  /* First entry not before [key]. */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (compare(&index[mid], &key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (end = lo; end < archive->count && index[end].time <= until; end++)
+    if (Is_block(vnumber)
+        && (index[end].number_length != key.number_length
+            || memcmp(index[end].number, key.number, key.number_length)))
+      break;
+
+  if (end == lo)
+    CAMLreturn(Atom(0));
+  res = caml_alloc_tuple(end - lo);
+  for (i = lo; i < end; i++)
+    Store_field(res, i - lo, Val_long(index[i].offset));
+
+  CAMLreturn(res);
+}
+
+static void sms_backup_release(SMS_Backup *b)
+{
+  long i;
+
+  if (b->backup != NULL) {
+    /* The messages before [b->next] were freed once read. */
+    for (i = b->next; i < b->count; i++)
+      free(b->backup->SMS[i]);
+    free(b->backup);
+    b->backup = NULL;
+  }
+}
+
+static void caml_gammu_sms_backup_finalize(value vbackup)
+{
+  SMS_Backup *b = SMS_BACKUP_VAL(vbackup);
+
+  sms_backup_release(b);
+  free(b);
+}
+
+static SMS_Backup *sms_backup_opened(value vbackup)
+{
+  SMS_Backup *b = SMS_BACKUP_VAL(vbackup);
+
+  if (b->backup == NULL)
+    caml_invalid_argument("Gammu.SMS.Backup: backup closed.");
+  return b;
+}
+
+/* The messages are only kept in the C heap, they do not weigh on the
+   OCaml GC, hence the small constant [mem] below. */
+static value alloc_sms_backup(GSM_SMS_Backup *backup, long count)
 {
-  CAMLparam0();
-  CAMLlocal1(res);
-  int length = multi_sms->Number;
-  int i;
+  value res;
+  SMS_Backup *b = malloc(sizeof(SMS_Backup));
 
-  res = caml_alloc(length, 0);
-  for (i=0; i < length; i++)
-    Store_field(res, i, Val_GSM_SMSMessage(&(multi_sms->SMS[i])));
+  if (b == NULL) {
+    GSM_FreeSMSBackup(backup);
+    free(backup);
+    caml_raise_out_of_memory();
+  }
+  b->backup = backup;
+  b->count = count;
+  b->next = 0;
+  res = caml_alloc_custom(&caml_gammu_sms_backup_ops, sizeof(SMS_Backup *),
+                          1, 100);
+  SMS_BACKUP_VAL(res) = b;
+  return res;
+}
 
-  CAMLreturn(res);
+CAMLexport
+value caml_gammu_sms_backup_create(value vunit)
+{
+  CAMLparam1(vunit);
+  GSM_SMS_Backup *backup = calloc(1, sizeof(GSM_SMS_Backup));
+
+  if (backup == NULL)
+    caml_raise_out_of_memory();
+  CAMLreturn(alloc_sms_backup(backup, 0));
 }
 
 CAMLexport
-value caml_gammu_GSM_GetSMS(value s, value vfolder, value vlocation)
+value caml_gammu_sms_backup_add(value vbackup, value vsms)
 {
-  CAMLparam3(s, vfolder, vlocation);
-  CAMLlocal1(vsms);
-  GSM_StateMachine *sm;
-  GSM_MultiSMSMessage sms;
-  GSM_Error error;
-  int i;
+  CAMLparam2(vbackup, vsms);
+  SMS_Backup *b = sms_backup_opened(vbackup);
+  GSM_SMSMessage *sms;
+
+  /* libGammu does not read more messages back. */
+  if (b->count >= GSM_BACKUP_MAX_SMS)
+    caml_gammu_raise_Error(ERR_MOREMEMORY);
+  sms = malloc(sizeof(GSM_SMSMessage));
+  if (sms == NULL)
+    caml_raise_out_of_memory();
+  GSM_SMSMessage_val(sms, vsms);
+  b->backup->SMS[b->count] = sms;
+  b->count++;
+  b->backup->SMS[b->count] = NULL;
 
-  sm = GSM_STATEMACHINE_VAL(s);
-  /* Clear SMS structure */
-  for (i = 0; i < GSM_MAX_MULTI_SMS; i++)
-    GSM_SetDefaultSMSData(&sms.SMS[i]);
+  CAMLreturn(Val_unit);
+}
 
-  sms.SMS[0].Location = Int_val(vlocation);
-  sms.SMS[0].Folder = Int_val(vfolder);
-  /* TODO: Is that necessary ? */
-  sms.Number = 0;
+CAMLexport
+value caml_gammu_sms_backup_write(value vbackup, value vpath)
+{
+  CAMLparam2(vbackup, vpath);
+  SMS_Backup *b = sms_backup_opened(vbackup);
+  char *path = dup_String_val(vpath);
+  GSM_Error error;
+  FILE *f;
 
   caml_enter_blocking_section();
-  error = GSM_GetSMS(sm, &sms);
+  /* GSM_AddSMSBackupFile appends to the file but numbers the messages
+     from 0, so a second backup in the same file would not be read. */
+  f = fopen(path, "wb");
+  if (f == NULL)
+    error = ERR_CANTOPENFILE;
+  else {
+    fclose(f);
+    error = GSM_AddSMSBackupFile(path, b->backup);
+  }
   caml_leave_blocking_section();
+  free(path);
   caml_gammu_raise_Error(error);
 
-  vsms = Val_GSM_MultiSMSMessage(&sms);
-  CAMLreturn(vsms);
+  CAMLreturn(Val_unit);
 }
 
 CAMLexport
-value caml_gammu_GSM_GetNextSMS(value s, value vlocation, value vfolder,
-                                value vstart)
+value caml_gammu_sms_backup_read(value vpath)
 {
-  CAMLparam4(s, vlocation, vfolder, vstart);
-  GSM_StateMachine *sm;
-  gboolean start;
-  GSM_MultiSMSMessage sms;
+  CAMLparam1(vpath);
+  GSM_SMS_Backup *backup = calloc(1, sizeof(GSM_SMS_Backup));
+  char *path;
   GSM_Error error;
-  int i;
-
-  sm = GSM_STATEMACHINE_VAL(s);
-  start = Bool_val(vstart);
-  /* Clear SMS structure */
-  for (i = 0; i < GSM_MAX_MULTI_SMS; i++)
-    GSM_SetDefaultSMSData(&sms.SMS[i]);
-
-  sms.SMS[0].Location = Int_val(vlocation);
-  sms.SMS[0].Folder = Int_val(vfolder);
-  /* TODO: Is that necessary ? */
-  sms.Number = 0;
+  long count = 0;
 
+  if (backup == NULL)
+    caml_raise_out_of_memory();
+  path = strdup(String_val(vpath));
+  if (path == NULL) {
+    free(backup);
+    caml_raise_out_of_memory();
+  }
   caml_enter_blocking_section();
-  error = GSM_GetNextSMS(sm, &sms, start);
+  error = GSM_ReadSMSBackupFile(path, backup);
   caml_leave_blocking_section();
-  caml_gammu_raise_Error(error);
+  free(path);
+  if (error != ERR_NONE) {
+    GSM_FreeSMSBackup(backup);
+    free(backup);
+    caml_gammu_raise_Error(error);
+  }
+  while (backup->SMS[count] != NULL)
+    count++;
 
-  CAMLreturn(Val_GSM_MultiSMSMessage(&sms));
+  CAMLreturn(alloc_sms_backup(backup, count));
+}
+
+CAMLexport
+value caml_gammu_sms_backup_next(value vbackup)
+{
+  CAMLparam1(vbackup);
+  CAMLlocal1(vsms);
+  SMS_Backup *b = sms_backup_opened(vbackup);
+
+  if (b->next >= b->count)
+    CAMLreturn(VAL_NONE);
+  vsms = Val_GSM_SMSMessage(b->backup->SMS[b->next]);
+  free(b->backup->SMS[b->next]);
+  b->backup->SMS[b->next] = NULL;
+  b->next++;
+
+  CAMLreturn(val_Some(vsms));
+}
+
+CAMLexport
+value caml_gammu_sms_backup_free(value vbackup)
+{
+  CAMLparam1(vbackup);
+  sms_backup_release(SMS_BACKUP_VAL(vbackup));
+  CAMLreturn(Val_unit);
 }
 
 #define CAML_GAMMU_GSM_SETSMS(set)                              \
@@ -1326,9 +3996,11 @@ value caml_gammu_GSM_GetNextSMS(value s, value vlocation, value vfolder,
     GSM_StateMachine *sm = GSM_STATEMACHINE_VAL(s);             \
     GSM_SMSMessage sms;                                         \
     GSM_SMSMessage_val(&sms, vsms);                             \
+    TRACE_BEGIN(s, #set "SMS");                                 \
     caml_enter_blocking_section();                              \
     error = GSM_##set##SMS(sm, &sms);                           \
     caml_leave_blocking_section();                              \
+    TRACE_END(s);                                               \
     caml_gammu_raise_Error(error);                              \
     res = caml_alloc(2, 0);                                     \
     Store_field(res, 0, Val_int(sms.Folder));                   \
@@ -1339,17 +4011,269 @@ value caml_gammu_GSM_GetNextSMS(value s, value vlocation, value vfolder,
 CAML_GAMMU_GSM_SETSMS(Set)
 CAML_GAMMU_GSM_SETSMS(Add)
 
+static void send_sms_status_callback(GSM_StateMachine *sm, int status,
+                                     int message_reference, void *user_data)
+{
+  State_Machine *state_machine = (State_Machine *) user_data;
+  int i;
+
+  /* Called with the global lock released: only record the status, it is
+     fetched later by caml_gammu_send_sms_result. */
+  if (state_machine->sms_reported >= state_machine->sms_submitted)
+    return; /* Not a message sent through these bindings. */
+  i = state_machine->sms_reported % SEND_STATUS_RING;
+  state_machine->sms_status[i] = status;
+  state_machine->sms_reference[i] = message_reference;
+  state_machine->sms_reported++;
+}
+
+/* Mark all messages waiting for their status as failed. */
+static void drop_pending_sms(State_Machine *state_machine)
+{
+  while (state_machine->sms_reported < state_machine->sms_submitted)
+    send_sms_status_callback(state_machine->sm, -1, -1,
+                             (void *) state_machine);
+}
+
+/* libGammu reads the SMSC [sms->SMSC.Location] from the phone before each
+   send if no SMSC number is given.  Read it once and give it.  Called
+   without the runtime lock. */
+static void apply_smsc_cache(State_Machine *state_machine,
+                             GSM_SMSMessage *sms)
+{
+  GSM_SMSC *smsc = &state_machine->smsc;
+
+  if (sms->SMSC.Location == 0 || UnicodeLength(sms->SMSC.Number) != 0)
+    return;
+  if (!state_machine->smsc_cached || smsc->Location != sms->SMSC.Location) {
+    smsc->Location = sms->SMSC.Location;
+    /* On error, let libGammu report it. */
+    state_machine->smsc_cached =
+      GSM_GetSMSC(state_machine->sm, smsc) == ERR_NONE;
+    if (!state_machine->smsc_cached)
+      return;
+  }
+  CopyUnicodeString(sms->SMSC.Number, smsc->Number);
+  if (sms->SMSC.Validity.Format == SMS_Validity_NotAvailable)
+    sms->SMSC.Validity = smsc->Validity;
+  sms->SMSC.Location = 0;
+}
+
+/* Send [sms] and set [submission] to its number (to retrieve its status). */
+static GSM_Error send_sms(State_Machine *state_machine, GSM_SMSMessage *sms,
+                          long *submission)
+{
+  GSM_Error error;
+
+  *submission = state_machine->sms_submitted++;
+  trace_begin(state_machine, "SendSMS");
+  caml_enter_blocking_section(); /* release global lock */
+  apply_smsc_cache(state_machine, sms);
+  error = GSM_SendSMS(state_machine->sm, sms);
+  caml_leave_blocking_section(); /* acquire global lock */
+  trace_end(state_machine);
+  if (error != ERR_NONE && state_machine->sms_reported <= *submission)
+    /* The message was not accepted, no status will come for it. */
+    state_machine->sms_submitted--;
+
+  return error;
+}
+
 CAMLexport
 value caml_gammu_GSM_SendSMS(value s, value vsms)
 {
   CAMLparam2(s, vsms);
   GSM_Error error;
-  GSM_StateMachine *sm = GSM_STATEMACHINE_VAL(s);
   GSM_SMSMessage sms;
+  long submission;
   GSM_SMSMessage_val(&sms, vsms);
-  caml_enter_blocking_section(); /* release global lock */
-  error = GSM_SendSMS(sm, &sms);
-  caml_leave_blocking_section(); /* acquire global lock */
+  error = send_sms(STATE_MACHINE_VAL(s), &sms, &submission);
+  caml_gammu_raise_Error(error);
+  CAMLreturn(Val_unit);
+}
+
+CAMLexport
+value caml_gammu_send_sms_async(value s, value vsms)
+{
+  CAMLparam2(s, vsms);
+  GSM_Error error;
+  GSM_SMSMessage sms;
+  long submission;
+  GSM_SMSMessage_val(&sms, vsms);
+  error = send_sms(STATE_MACHINE_VAL(s), &sms, &submission);
+  caml_gammu_raise_Error(error);
+  CAMLreturn(Val_long(submission));
+}
+
+CAMLexport
+value caml_gammu_send_sms_result(value s, value vsubmission)
+{
+  CAMLparam2(s, vsubmission);
+  CAMLlocal1(res);
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+  long submission = Long_val(vsubmission);
+  int i;
+
+  if (submission >= state_machine->sms_reported)
+    CAMLreturn(Val_int(0)); /* Send_pending */
+  if (state_machine->sms_reported - submission > SEND_STATUS_RING)
+    caml_invalid_argument("Gammu.SMS.send_status: status no longer "
+                          "available.");
+  i = submission % SEND_STATUS_RING;
+  if (state_machine->sms_status[i] == 0) {
+    res = caml_alloc(1, 0); /* Send_ok */
+    Store_field(res, 0, Val_int(state_machine->sms_reference[i]));
+  }
+  else {
+    res = caml_alloc(1, 1); /* Send_error */
+    Store_field(res, 0, Val_int(state_machine->sms_status[i]));
+  }
+  CAMLreturn(res);
+}
+
+CAMLexport
+value caml_gammu_sms_in_flight(value s)
+{
+  CAMLparam1(s);
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+  CAMLreturn(Val_long(state_machine->sms_submitted
+                      - state_machine->sms_reported));
+}
+
+CAMLexport
+value caml_gammu_sms_drop_pending(value s)
+{
+  CAMLparam1(s);
+  drop_pending_sms(STATE_MACHINE_VAL(s));
+  CAMLreturn(Val_unit);
+}
+
+CAMLexport
+value caml_gammu_GSM_GetSMSC(value s, value vlocation)
+{
+  CAMLparam2(s, vlocation);
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+  GSM_SMSC smsc;
+  GSM_Error error;
+
+  smsc.Location = Int_val(vlocation);
+
+  TRACE_BEGIN(s, "GetSMSC");
+  caml_enter_blocking_section();
+  error = GSM_GetSMSC(state_machine->sm, &smsc);
+  caml_leave_blocking_section();
+  TRACE_END(s);
+  caml_gammu_raise_Error(error);
+  state_machine->smsc = smsc;
+  state_machine->smsc_cached = TRUE;
+
+  CAMLreturn(Val_GSM_SMSC(&smsc));
+}
+
+CAMLexport
+value caml_gammu_GSM_SetSMSC(value s, value vsmsc)
+{
+  CAMLparam2(s, vsmsc);
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+  GSM_SMSC smsc;
+  GSM_Error error;
+
+  GSM_SMSC_val(&smsc, vsmsc);
+  state_machine->smsc_cached = FALSE;
+
+  TRACE_BEGIN(s, "SetSMSC");
+  caml_enter_blocking_section();
+  error = GSM_SetSMSC(state_machine->sm, &smsc);
+  caml_leave_blocking_section();
+  TRACE_END(s);
+  caml_gammu_raise_Error(error);
+
+  CAMLreturn(Val_unit);
+}
+
+CAMLexport
+value caml_gammu_smsc_cached(value s)
+{
+  CAMLparam1(s);
+  State_Machine *state_machine = STATE_MACHINE_VAL(s);
+
+  if (!state_machine->smsc_cached)
+    CAMLreturn(VAL_NONE);
+  CAMLreturn(val_Some(Val_GSM_SMSC(&state_machine->smsc)));
+}
+
+CAMLexport
+value caml_gammu_smsc_clear(value s)
+{
+  CAMLparam1(s);
+  STATE_MACHINE_VAL(s)->smsc_cached = FALSE;
+  CAMLreturn(Val_unit);
+}
+
+static void caml_gammu_sms_template_finalize(value vtemplate)
+{
+  free(SMS_TEMPLATE_VAL(vtemplate));
+}
+
+CAMLexport
+value caml_gammu_sms_template(value vsms, value vplaceholder)
+{
+  CAMLparam2(vsms, vplaceholder);
+  CAMLlocal1(res);
+  SMS_Template *template;
+  unsigned char placeholder[(GSM_MAX_SMS_LENGTH + 1) * 2];
+  size_t text_len, len, i;
+
+  template = malloc(sizeof(SMS_Template));
+  if (!template)
+    caml_raise_out_of_memory();
+  GSM_SMSMessage_val(&(template->sms), vsms);
+  CPY_TRIM_USTRING_VAL(placeholder, vplaceholder);
+
+  /* Look for the placeholder in the already encoded text, so that the
+     offset is expressed in characters of the unicode buffer. */
+  text_len = UnicodeLength(template->sms.Text);
+  len = UnicodeLength(placeholder);
+  for (i = 0; len > 0 && i + len <= text_len; i++)
+    if (memcmp(template->sms.Text + 2 * i, placeholder, 2 * len) == 0)
+      break;
+  if (len == 0 || i + len > text_len) {
+    free(template);
+    caml_invalid_argument("Gammu.SMS.template: placeholder not found "
+                          "in the message text.");
+  }
+  template->offset = i;
+  template->length = len;
+
+  res = caml_alloc_custom(&caml_gammu_sms_template_ops,
+                          sizeof(SMS_Template *), sizeof(SMS_Template),
+                          CUSTOM_MEM_MAX);
+  SMS_TEMPLATE_VAL(res) = template;
+  CAMLreturn(res);
+}
+
+CAMLexport
+value caml_gammu_send_sms_template(value s, value vtemplate, value vnumber,
+                                   value vfill)
+{
+  CAMLparam4(s, vtemplate, vnumber, vfill);
+  GSM_Error error;
+  SMS_Template *template = SMS_TEMPLATE_VAL(vtemplate);
+  unsigned char fill[(GSM_MAX_SMS_LENGTH + 1) * 2];
+  GSM_SMSMessage sms;
+  long submission;
+
+  CPY_TRIM_USTRING_VAL(fill, vfill);
+  if (UnicodeLength(fill) != template->length)
+    caml_invalid_argument("Gammu.SMS.send_template: the filling must have "
+                          "the length of the placeholder.");
+  /* The template itself is left untouched, libGammu may update the
+     message while sending it. */
+  memcpy(&sms, &(template->sms), sizeof(GSM_SMSMessage));
+  memcpy(sms.Text + 2 * template->offset, fill, 2 * template->length);
+  CPY_TRIM_USTRING_VAL(sms.Number, vnumber);
+
+  error = send_sms(STATE_MACHINE_VAL(s), &sms, &submission);
   caml_gammu_raise_Error(error);
   CAMLreturn(Val_unit);
 }
@@ -1379,9 +4303,11 @@ value caml_gammu_GSM_GetSMSFolders(value s)
   sm = GSM_STATEMACHINE_VAL(s);
 
   /* Get the folders. */
+  TRACE_BEGIN(s, "GetSMSFolders");
   caml_enter_blocking_section();
   error = GSM_GetSMSFolders(sm, &folders);
   caml_leave_blocking_section();
+  TRACE_END(s);
   caml_gammu_raise_Error(error);
 
   /* Convert it to a an array of SMS.folder values. */
@@ -1419,9 +4345,11 @@ value caml_gammu_GSM_GetSMSStatus(value s)
 
   sm = GSM_STATEMACHINE_VAL(s);
 
+  TRACE_BEGIN(s, "GetSMSStatus");
   caml_enter_blocking_section();
   error = GSM_GetSMSStatus(sm, &status);
   caml_leave_blocking_section();
+  TRACE_END(s);
   caml_gammu_raise_Error(error);
 
   CAMLreturn(Val_GSM_SMSMemoryStatus(&status));
@@ -1440,14 +4368,78 @@ value caml_gammu_GSM_DeleteSMS(value s, value vlocation, value vfolder)
   sms.Location = Int_val(vlocation);
   sms.Folder = Int_val(vfolder);
 
+  TRACE_BEGIN(s, "DeleteSMS");
   caml_enter_blocking_section();
   error = GSM_DeleteSMS(sm, &sms);
   caml_leave_blocking_section();
+  TRACE_END(s);
   caml_gammu_raise_Error(error);
 
   CAMLreturn(Val_unit);
 }
 
+CAMLexport
+value caml_gammu_sms_delete_many(value s, value vlocations)
+{
+  CAMLparam2(s, vlocations);
+  CAMLlocal2(res, verr);
+  GSM_StateMachine *sm;
+  GSM_SMSMessage sms;
+  GSM_Error *errors;
+  int *locations;
+  mlsize_t n, i;
+
+  sm = GSM_STATEMACHINE_VAL(s);
+  n = Wosize_val(vlocations);
+  if (n == 0)
+    CAMLreturn(Atom(0));
+
+  /* Copy the (folder, location) pairs out of the heap, they cannot be
+     accessed without the runtime lock. */
+  locations = malloc(2 * n * sizeof(int));
+  errors = malloc(n * sizeof(GSM_Error));
+  if (locations == NULL || errors == NULL) {
+    free(locations);
+    free(errors);
+    caml_raise_out_of_memory();
+  }
+  for (i = 0; i < n; i++) {
+    locations[2 * i] = Int_val(Field(Field(vlocations, i), 0));
+    locations[2 * i + 1] = Int_val(Field(Field(vlocations, i), 1));
+  }
+
+  TRACE_BEGIN(s, "DeleteSMS");
+  caml_enter_blocking_section();
+  for (i = 0; i < n; i++) {
+    sms.Folder = locations[2 * i];
+    sms.Location = locations[2 * i + 1];
+    errors[i] = GSM_DeleteSMS(sm, &sms);
+    if (errors[i] == ERR_ABORTED || errors[i] == ERR_NOTCONNECTED) {
+      /* No point in trying the remaining locations. */
+      for (i++; i < n; i++)
+        errors[i] = errors[i - 1];
+      break;
+    }
+  }
+  caml_leave_blocking_section();
+  TRACE_END(s);
+
+  res = caml_alloc_tuple(n);
+  for (i = 0; i < n; i++) {
+    if (errors[i] == ERR_NONE)
+      Store_field(res, i, Val_int(0)); /* None */
+    else {
+      verr = caml_alloc_small(1, 0); /* Some */
+      Field(verr, 0) = VAL_GSM_ERROR(errors[i]);
+      Store_field(res, i, verr);
+    }
+  }
+  free(locations);
+  free(errors);
+
+  CAMLreturn(res);
+}
+
 /* Unused and need update.
 static GSM_MultiPartSMSEntry GSM_MultiPartSMSEntry_val(value vmult_part_sms)
 {
@@ -1627,6 +4619,108 @@ static value Val_GSM_Call(GSM_Call *call)
 /************************************************************************/
 /* Events */
 
+#ifdef CAML_GAMMU_NO_PTHREAD
+# define INCOMING_LOCK(state_machine)
+# define INCOMING_UNLOCK(state_machine)
+#else
+# define INCOMING_LOCK(state_machine)                   \
+  pthread_mutex_lock(&(state_machine)->incoming_mutex)
+# define INCOMING_UNLOCK(state_machine)                 \
+  pthread_mutex_unlock(&(state_machine)->incoming_mutex)
+#endif
+
+static void incoming_push(State_Machine *state_machine, Incoming_Event *event)
+{
+  event->next = NULL;
+  INCOMING_LOCK(state_machine);
+  if (state_machine->incoming_tail == NULL)
+    state_machine->incoming_head = event;
+  else
+    state_machine->incoming_tail->next = event;
+  state_machine->incoming_tail = event;
+  INCOMING_UNLOCK(state_machine);
+}
+
+static void incoming_push_SMS(State_Machine *state_machine,
+                              GSM_SMSMessage *sms)
+{
+  Incoming_Event *event = malloc(sizeof(Incoming_Event));
+
+  if (event == NULL)
+    return; /* No way to report it to libGammu, the SMS is lost. */
+  event->is_call = FALSE;
+  event->u.sms = *sms;
+  incoming_push(state_machine, event);
+}
+
+static void incoming_push_Call(State_Machine *state_machine, GSM_Call *call)
+{
+  Incoming_Event *event = malloc(sizeof(Incoming_Event));
+
+  if (event == NULL)
+    return;
+  event->is_call = TRUE;
+  event->u.call = *call;
+  incoming_push(state_machine, event);
+}
+
+static Incoming_Event *incoming_pop(State_Machine *state_machine)
+{
+  Incoming_Event *event;
+
+  INCOMING_LOCK(state_machine);
+  event = state_machine->incoming_head;
+  if (event != NULL) {
+    state_machine->incoming_head = event->next;
+    if (state_machine->incoming_head == NULL)
+      state_machine->incoming_tail = NULL;
+  }
+  INCOMING_UNLOCK(state_machine);
+  return event;
+}
+
+static void incoming_free(State_Machine *state_machine)
+{
+  Incoming_Event *event;
+
+  while ((event = incoming_pop(state_machine)) != NULL)
+    free(event);
+#ifndef CAML_GAMMU_NO_PTHREAD
+  pthread_mutex_destroy(&state_machine->incoming_mutex);
+#endif
+}
+
+CAMLexport
+value caml_gammu_dispatch_incoming(value s)
+{
+  CAMLparam1(s);
+  CAMLlocal1(v);
+  State_Machine *state_machine = STATE_MACHINE_PTR(s);
+  Incoming_Event *event;
+  gboolean is_call;
+
+  /* [s] may have been freed, possibly by a callback. */
+  while (state_machine != NULL
+         && (event = incoming_pop(state_machine)) != NULL) {
+    is_call = event->is_call;
+    if (is_call && state_machine->incoming_Call_callback)
+      v = Val_GSM_Call(&event->u.call);
+    else if (!is_call && state_machine->incoming_SMS_callback)
+      v = Val_GSM_SMSMessage(&event->u.sms);
+    else
+      v = Val_unit; /* No callback (any more). */
+    free(event);
+    /* The closures are read after the allocations, which may move them. */
+    if (v != Val_unit && is_call)
+      caml_callback(state_machine->incoming_Call_callback, v);
+    else if (v != Val_unit)
+      caml_callback(state_machine->incoming_SMS_callback, v);
+    state_machine = STATE_MACHINE_PTR(s);
+  }
+
+  CAMLreturn(Val_unit);
+}
+
 #define CAML_GAMMU_GSM_SETINCOMING(name, type)                          \
   CAMLexport                                                            \
   value caml_gammu_GSM_SetIncoming##name(value s, value venable)        \
@@ -1641,18 +4735,15 @@ static value Val_GSM_Call(GSM_Call *call)
     SHOUT_DBG("leaving");                                                   \
     CAMLreturn(Val_unit);                                               \
   }                                                                     \
+  /* Called by libGammu, possibly without the runtime lock or from     \
+     another thread: the event is only queued. */                       \
   static void incoming_##name##_callback(GSM_StateMachine *sm,          \
                                          type TYPE_MODIFIER1 t,         \
                                          void *user_data)               \
   {                                                                     \
-    CAMLparam0();                                                       \
-    CAMLlocal1(f);                                                      \
     SHOUT_DBG("entering");                                                  \
-    SHOUT_DBG("f = *%ld", (long) user_data);                                \
-    f = *((value *) user_data);                                         \
-    caml_callback(f, Val_##type(TYPE_MODIFIER2 t));                     \
+    incoming_push_##name((State_Machine *) user_data, TYPE_MODIFIER2 t); \
     SHOUT_DBG("leaving");                                                   \
-    CAMLreturn0;                                                        \
   }                                                                     \
   CAMLexport                                                            \
   value caml_gammu_GSM_SetIncoming##name##Callback(value s, value vf)   \
@@ -1660,12 +4751,10 @@ static value Val_GSM_Call(GSM_Call *call)
     CAMLparam2(s, vf);                                                  \
     SHOUT_DBG("entering");                                                  \
     State_Machine *state_machine = STATE_MACHINE_VAL(s);                \
-    void *user_data = (void *) &(state_machine->incoming_##name##_callback); \
-    SHOUT_DBG("*user_data = %ld", (long) user_data);                        \
     REGISTER_SM_GLOBAL_ROOT(state_machine, incoming_##name##_callback, vf); \
     GSM_SetIncoming##name##Callback(state_machine->sm,                  \
                                     incoming_##name##_callback,         \
-                                    user_data);                         \
+                                    (void *) state_machine);            \
     SHOUT_DBG("leaving");                                                   \
     CAMLreturn(Val_unit);                                               \
   }
@@ -21,8 +21,10 @@
 #ifndef __GAMMU_STUBS_H__
 #define __GAMMU_STUBS_H__
 
+#include <stdint.h>
 #include <caml/mlvalues.h>
 #include <caml/signals.h>
+#include <caml/bigarray.h>
 
 #include <gammu.h>
 
@@ -36,6 +38,18 @@
 # define GAMMU_VERSION_NUM VERSION_NUM
 #endif
 
+#ifdef _MSC_VER
+# define CAML_GAMMU_NO_PTHREAD
+#else
+# include <pthread.h>
+#endif
+
+/* Deadlines are enforced by a watchdog thread calling GSM_AbortOperation,
+   which only exists since Gammu 1.33. */
+#if defined(CAML_GAMMU_NO_PTHREAD) || GAMMU_VERSION_NUM < 13300
+# define CAML_GAMMU_NO_WATCHDOG
+#endif
+
 #if !( GAMMU_VERSION_NUM == 12400                     \
        || GAMMU_VERSION_NUM == 12601                  \
        || GAMMU_VERSION_NUM == 12792                  \
@@ -110,12 +124,32 @@ char *dup_String_val(value v);
 
 #define CPY_STRING_VAL(dst, v)                  \
   do {                                          \
-    /* TODO: Possible memory leak here, check if we can free dst */ \
+    /* The previous string of dst must have been freed. */ \
     dst = strdup(String_val(v));                \
     if (!dst)                                   \
       caml_raise_out_of_memory();               \
   } while (0)
 
+/* Counters shared between one producer and one consumer thread. */
+#ifdef __GNUC__
+# define ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+# define ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+/* MSVC gives acquire/release semantics to volatile accesses. */
+# define ATOMIC_LOAD(p) (*((volatile long *) (p)))
+# define ATOMIC_STORE(p, v) (*((volatile long *) (p)) = (v))
+#endif
+
+static double monotonic_time(void);
+
+value caml_gammu_monotonic_time(value vunit);
+
+value caml_gammu_fsync(value vfd);
+
+value caml_gammu_fsync_dir(value vpath);
+
+value caml_gammu_file_mtime(value vpath);
+
 /* Decode unicode strings ((unsigned char *) in gammu) to (char *). */
 #define CAML_COPY_USTRING(str) caml_copy_string(DecodeUnicodeString(str))
 
@@ -150,7 +184,8 @@ static char *yesno_bool(gboolean b);
 typedef enum {
   ERR_INI_KEY_NOT_FOUND = 75, /* number in gammu.ml */
   ERR_COULD_NOT_DECODE,
-  ERR_INVALID_CONFIG_NUM
+  ERR_INVALID_CONFIG_NUM,
+  ERR_DEADLINE_EXCEEDED
 } CAML_GAMMU_Error;
 
 #define GSM_ERROR_VAL(v) (Int_val(v) + 2)
@@ -175,7 +210,34 @@ value caml_gammu_GSM_GetGlobalDebug(value vunit);
 
 value caml_gammu_GSM_SetDebugGlobal(value vdi, value vglobal);
 
-value caml_gammu_GSM_SetDebugFileDescriptor(value vdi, value vchannel);
+/* Circular buffer receiving the debug output of a Debug.info. */
+typedef struct {
+  char *data;
+  size_t size;
+  size_t pos;                   /* Next byte to write. */
+  gboolean wrapped;             /* Whether [data] is full, oldest at [pos]. */
+#ifndef CAML_GAMMU_NO_PTHREAD
+  /* The global debug info may be used by several threads at once. */
+  pthread_mutex_t mutex;
+#endif
+} Debug_Buffer;
+
+static Debug_Buffer **Debug_Buffer_slot(value vdi);
+
+static void debug_buffer_callback(const char *text, void *data);
+
+static void debug_buffer_free(Debug_Buffer *buffer);
+
+static void check_untraced(value vdi, const char *msg);
+
+static void check_no_prefetch(value vdi, const char *msg);
+static void detach_debug_function(value vdi);
+
+value caml_gammu_GSM_SetDebugFileDescriptor(value vdi, value vfd);
+
+value caml_gammu_set_debug_buffer(value vdi, value vsize);
+
+value caml_gammu_debug_buffer_snapshot(value vdi);
 
 value caml_gammu_GSM_SetDebugLevel(value vdi, value vlevel);
 
@@ -183,7 +245,22 @@ value caml_gammu_GSM_SetDebugLevel(value vdi, value vlevel);
 /************************************************************************/
 /* INI files */
 
-#define INI_SECTION_VAL(v) (*((INI_Section **) Data_custom_val(v)))
+/* Parsed INI file.  [head] may be NULL (empty file), hence [freed]. */
+typedef struct {
+  INI_Section *head;
+  gboolean freed;               /* By INI.free. */
+} INI_File;
+
+#define INI_FILE_VAL(v) ((INI_File *) Data_custom_val(v))
+#define INI_SECTION_VAL(v) (ini_section_val(v))
+
+/* Native memory accounted to the GC before a full major cycle is forced,
+   for the custom blocks below (see alloc_custom). */
+#define CUSTOM_MEM_MAX (64 * 1024 * 1024)
+
+static INI_Section *ini_section_val(value vini_section);
+
+static mlsize_t ini_size(INI_Section *ini_section, gboolean unicode);
 
 static void caml_gammu_ini_section_finalize(value vini_section);
 
@@ -196,31 +273,166 @@ static struct custom_operations caml_gammu_ini_section_ops = {
   custom_deserialize_default
 };
 
-static value alloc_INI_Section();
+static value alloc_INI_Section(mlsize_t mem);
 
-static value Val_INI_Section(INI_Section *ini_section);
+static value Val_INI_Section(INI_Section *ini_section, gboolean unicode);
+
+value caml_gammu_INI_free(value vini_section);
 
 value caml_gammu_INI_ReadFile(value vfilename, value vunicode);
 
 value caml_gammu_INI_GetValue(value vfile_info, value vsection, value vkey,
                               value vunicode);
 
+static value copy_ini_string(unsigned char *s, gboolean unicode);
+
+value caml_gammu_INI_entries(value vfile_info, value vunicode);
+
 
 /************************************************************************/
 /* State machine */
 
+/* Number of sending statuses remembered per state machine.
+   WARNING: must be in sync with [send_status_ring] in gammu.ml */
+#define SEND_STATUS_RING 64
+
+#ifndef CAML_GAMMU_NO_WATCHDOG
+/* Watchdog aborting the operations of [sm] once [deadline] is reached,
+   unless it has been disarmed before. */
+typedef struct {
+  GSM_StateMachine *sm;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct timespec deadline;     /* CLOCK_REALTIME, see pthread_cond_timedwait */
+  gboolean disarmed;
+  gboolean fired;
+  /* Whether the thread that armed the watchdog is in a blocking section,
+     i.e. possibly in libGammu.  An abort landing once the operation has
+     returned would stay on the state machine and make the next one fail,
+     so the watchdog only aborts while [in_call]. */
+  gboolean in_call;
+} Watchdog;
+#endif
+
+/* Kinds of trace events.
+   WARNING: must be in sync with [Trace.kind] in gammu.ml */
+#define TRACE_CALL 0
+#define TRACE_SENT 1
+#define TRACE_RECEIVED 2
+
+typedef struct {
+  int kind;
+  const char *stub;             /* Static string, NULL if not in a stub. */
+  double start;                 /* See monotonic_time. */
+  double duration;              /* 0 for frames. */
+  int size;                     /* Size of frames, in bytes. */
+  char label[32];               /* Beginning of the frame, as text. */
+} Trace_Event;
+
+/* Ring of the trace events of a state machine.  Like Log_Sink, it has a
+   single producer (the thread performing the operations) and a single
+   consumer (Gammu.Trace.events). */
+typedef struct {
+  Trace_Event *events;
+  long capacity;
+  long head;
+  long tail;
+  long dropped;
+  const char *stub;             /* Stub being executed. */
+  double stub_start;
+  Trace_Event frame;            /* Frame waiting for its label. */
+  gboolean frame_pending;
+} Trace;
+
+/* Maximum length of a log record, longer lines are truncated. */
+#define LOG_RECORD_LENGTH 512
+
+typedef struct {
+  double time;                  /* See monotonic_time. */
+  char text[LOG_RECORD_LENGTH];
+} Log_Record;
+
+/* Ring of the log lines of a state machine.  It has a single producer,
+   libGammu through log_sink_callback, and a single consumer: the writer
+   thread if the records go to a file, Gammu.Log.drain otherwise (always
+   called with the runtime lock held).  Hence no lock is needed. */
+typedef struct {
+  Log_Record *records;
+  long capacity;
+  long head;                    /* Next record to write (producer). */
+  long tail;                    /* Next record to read (consumer). */
+  long dropped;                 /* Records lost because the ring was full. */
+  Log_Record line;              /* Line being assembled (producer). */
+  size_t line_length;
+  FILE *file;
+  Trace *trace;                 /* Frames are detected in the log lines. */
+#ifndef CAML_GAMMU_NO_PTHREAD
+  pthread_t writer;
+  long stop;
+#endif
+} Log_Sink;
+
+/* SMS or call notified by libGammu, kept until
+   caml_gammu_dispatch_incoming gives it to the OCaml callback. */
+typedef struct Incoming_Event {
+  struct Incoming_Event *next;
+  gboolean is_call;
+  union {
+    GSM_SMSMessage sms;
+    GSM_Call call;
+  } u;
+} Incoming_Event;
+
 /* Define a struct to put, caml side, state machine related stuff in C heap in
    order to deal with GC. */
 typedef struct {
   GSM_StateMachine *sm;
   value log_function;
+  Log_Sink *log_sink;           /* NULL unless logging is enabled. */
+  Debug_Buffer *debug_buffer;   /* Not used at the same time as log_sink. */
+  Trace *trace;                 /* NULL unless tracing. */
   value incoming_SMS_callback;
   value incoming_Call_callback;
+  /* Events received from libGammu and not yet dispatched, oldest first.
+     libGammu may run in another thread (e.g. SMS.fold_prefetch). */
+  Incoming_Event *incoming_head;
+  Incoming_Event *incoming_tail;
+#ifndef CAML_GAMMU_NO_PTHREAD
+  pthread_mutex_t incoming_mutex;
+#endif
+  /* Statuses of sent SMS, reported by libGammu in the order of submission.
+     The status of the submission number [n] is at index
+     [n % SEND_STATUS_RING] once [n < sms_reported]. */
+  long sms_submitted;
+  long sms_reported;
+  int sms_status[SEND_STATUS_RING];
+  int sms_reference[SEND_STATUS_RING];
+  /* SMSC read from the phone, used for the messages to send with the same
+     SMSC location and no SMSC number.  Forgotten when the connection or
+     the SIM may have changed. */
+  GSM_SMSC smsc;
+  gboolean smsc_cached;
+#ifndef CAML_GAMMU_NO_WATCHDOG
+  Watchdog *watchdog;           /* NULL unless a deadline is pending. */
+#endif
+  /* Thread of SMS.fold_prefetch using [sm], if any. */
+  struct SMS_Prefetch *prefetch;
 } State_Machine;
 
-#define STATE_MACHINE_VAL(v) (*((State_Machine **) Data_custom_val(v)))
+/* NULL once released by Gammu.free, only for the finalizer. */
+#define STATE_MACHINE_PTR(v) (*((State_Machine **) Data_custom_val(v)))
+#define STATE_MACHINE_VAL(v) (state_machine_val(v))
 #define GSM_STATEMACHINE_VAL(v) (STATE_MACHINE_VAL(v)->sm)
 
+/* GSM_StateMachine is opaque.  Its size, dominated by the configuration
+   stack and the phone and protocol buffers, is estimated for the GC. */
+#define GSM_STATEMACHINE_SIZE (64 * 1024)
+
+static State_Machine *state_machine_val(value s);
+
+static void state_machine_release(State_Machine *state_machine);
+
 static void caml_gammu_state_machine_finalize(value s);
 
 static struct custom_operations caml_gammu_state_machine_ops = {
@@ -237,9 +449,12 @@ static struct custom_operations caml_gammu_state_machine_ops = {
    state machine allocation. */
 #define REGISTER_SM_GLOBAL_ROOT(state_machine, field, v)        \
   do {                                                          \
-    state_machine->field = v;                                   \
-    if (!state_machine->field)                                  \
+    if (!state_machine->field) {                                \
+      state_machine->field = v;                                 \
       caml_register_global_root(&state_machine->field);         \
+    }                                                           \
+    else                                                        \
+      state_machine->field = v;                                 \
   } while (0)
 
 /* TODO: If it is acceptable for a global root to be a pointer to NULL, remove
@@ -254,8 +469,12 @@ static struct custom_operations caml_gammu_state_machine_ops = {
 
 static value Val_GSM_Config(const GSM_Config *config);
 
+static void GSM_Config_settings_val(GSM_Config *config, value vconfig);
+
 static void GSM_Config_val(GSM_Config *config, value vconfig);
 
+static void GSM_Config_free_strings(GSM_Config *config);
+
 #define VAL_GSM_CONNECTIONTYPE(ct) Val_int(ct - 1)
 
 value caml_gammu_GSM_GetDebug(value s);
@@ -266,6 +485,8 @@ value caml_gammu_GSM_InitDefaultLocales();
 
 value caml_gammu_GSM_AllocStateMachine(value vunit);
 
+value caml_gammu_free(value s);
+
 value caml_gammu_GSM_FindGammuRC_force(value vpath);
 
 value caml_gammu_GSM_FindGammuRC(value vunit);
@@ -278,23 +499,120 @@ value caml_gammu_push_config(value s, value vcfg);
 
 value caml_gammu_remove_config(value s);
 
+value caml_gammu_update_config(value s, value vnum, value vcfg);
+
 value caml_gammu_GSM_GetConfigNum(value s);
 
+/* GSM_InitConnection resets the callbacks of libGammu: install ours
+   again after each connection.  Does not need the runtime lock. */
+static void install_callbacks(State_Machine *state_machine);
+
+/* GSM_InitConnection, keeping the log sink or the debug buffer of
+   [state_machine]: libGammu replaces the debug function of the state
+   machine by the one it is given (none for GSM_InitConnection).  Called
+   without the runtime lock. */
+static GSM_Error init_connection(State_Machine *state_machine,
+                                 int reply_num);
+
 value caml_gammu_GSM_InitConnection(value s, value vreply_num);
 
-static void log_function_callback(const char *text, void *data);
+static void log_sink_callback(const char *text, void *data);
+
+static void log_sink_push(Log_Sink *sink);
+
+#ifndef CAML_GAMMU_NO_PTHREAD
+static void *log_writer_thread(void *data);
+#endif
+
+static void log_sink_free(Log_Sink *sink);
+
+value caml_gammu_log_enable(value s, value vlevel, value vcapacity,
+                            value vfile);
+
+value caml_gammu_log_disable(value s);
+
+value caml_gammu_log_drain(value s);
+
+value caml_gammu_log_dropped(value s);
+
+value caml_gammu_log_function(value s);
+
+/* Delimit the libGammu call of a stub, for Gammu.Trace. */
+#define TRACE_BEGIN(s, name) trace_begin(STATE_MACHINE_VAL(s), name)
+#define TRACE_END(s) trace_end(STATE_MACHINE_VAL(s))
+
+static void trace_begin(State_Machine *state_machine, const char *stub);
+
+static void trace_end(State_Machine *state_machine);
+
+static void trace_push(Trace *trace, Trace_Event *event);
+
+static void trace_line(Trace *trace, const char *line, double time);
+
+value caml_gammu_trace_start(value s, value vcapacity, value vlevel);
+
+value caml_gammu_trace_stop(value s);
+
+value caml_gammu_trace_events(value s);
+
+value caml_gammu_trace_dropped(value s);
 
 value caml_gammu_GSM_InitConnection_Log(value s, value vreply_num,
                                        value vlog_func);
 
 value caml_gammu_GSM_TerminateConnection(value s);
 
+static void run_jobs(void *jobs, size_t size, mlsize_t n,
+                     void *(*run)(void *));
+
+/* Connection of one state machine by caml_gammu_connect_all. */
+typedef struct {
+  State_Machine *state_machine;
+  int reply_num;
+  GSM_Error error;
+  double time;                  /* Duration of GSM_InitConnection. */
+} Connect_Job;
+
+static void *connect_job_run(void *data);
+
+value caml_gammu_connect_all(value vmachines, value vreply_num);
+
+/* Identification of one state machine by caml_gammu_identify_all. */
+typedef struct {
+  State_Machine *state_machine;
+  GSM_Error error;              /* Of GSM_GetIMEI. */
+  char imei[GSM_MAX_IMEI_LENGTH + 1];
+  char model[GSM_MAX_MODEL_LENGTH + 1];
+  char imsi[BUFFER_LENGTH];
+  gboolean has_imsi;
+} Identify_Job;
+
+static void *identify_job_run(void *data);
+
+value caml_gammu_identify_all(value vmachines);
+
 value caml_gammu_GSM_IsConnected(value s);
 
 value caml_gammu_GSM_GetUsedConnection(value s);
 
 value caml_gammu_GSM_ReadDevice(value s, value vwait_for_reply);
 
+#ifndef CAML_GAMMU_NO_WATCHDOG
+static void *watchdog_thread(void *data);
+
+static gboolean watchdog_disarm(State_Machine *state_machine);
+
+static void watchdog_enter_hook(void);
+
+static void watchdog_leave_hook(void);
+
+static void watchdog_install_hooks(void);
+#endif
+
+value caml_gammu_watchdog_arm(value s, value vtimeout);
+
+value caml_gammu_watchdog_disarm(value s);
+
 
 /************************************************************************/
 /* Security related operations with phone */
@@ -338,9 +656,11 @@ static value Val_GSM_SignalQuality(GSM_SignalQuality *signal_quality);
     char val[buf_length] = "";                           \
     GSM_Error error;                                     \
     sm = GSM_STATEMACHINE_VAL(s);                        \
+    TRACE_BEGIN(s, "Get" #name);                         \
     caml_enter_blocking_section();                       \
     error = GSM_Get##name(sm, val);                      \
     caml_leave_blocking_section();                       \
+    TRACE_END(s);                                        \
     if (error != ERR_NOTSUPPORTED)                       \
       caml_gammu_raise_Error(error);                     \
     CAMLreturn(caml_copy_string(val));                   \
@@ -349,10 +669,42 @@ static value Val_GSM_SignalQuality(GSM_SignalQuality *signal_quality);
 #define CAML_GAMMU_GSM_TYPE_GET_PROTOTYPE(name) \
   value caml_gammu_GSM_Get##name(value s)
 
+/* Open addressing (linear probing) hash table of the names of the
+   network or country codes already looked up. */
+typedef struct {
+  intnat *keys;                 /* Packed code + 1, 0 if the slot is free. */
+  intnat *index;                /* Index of the name in [names]. */
+  intnat size;                  /* Number of slots, a power of 2. */
+  intnat count;
+  value names;                  /* Array of the names, a global root. */
+} Code_Names;
+
+static intnat parse_digits(const char *code, mlsize_t len);
+
+/* [mcc * 2000 + mnc] for 2 digits MNCs, [+ 1000] for 3 digits ones, or
+   -1 if [vcode] is not of the form "MCC MNC" or "MCCMNC". */
+static intnat pack_network_code(value vcode);
+
+static intnat pack_country_code(value vcode);
+
+static uintnat code_names_slot(Code_Names *t, intnat key);
+
+static void code_names_grow(Code_Names *t);
+
+static value code_names_add(Code_Names *t, value vname);
+
+static value code_name(value vcode, gboolean network);
+
+static value code_names(value vcodes, gboolean network);
+
 value caml_gammu_GSM_GetNetworkName(value vcode);
 
 value caml_gammu_GSM_GetCountryName(value vcode);
 
+value caml_gammu_network_code_names(value vcodes);
+
+value caml_gammu_country_code_names(value vcodes);
+
 CAML_GAMMU_GSM_TYPE_GET_PROTOTYPE(BatteryCharge);
 
 value caml_gammu_GSM_GetFirmWare(value s);
@@ -368,6 +720,8 @@ CAML_GAMMU_GSM_STR_GET_PROTOTYPE(
 
 CAML_GAMMU_GSM_STR_GET_PROTOTYPE(Model, GSM_MAX_MODEL_LENGTH + 1);
 
+CAML_GAMMU_GSM_STR_GET_PROTOTYPE(SIMIMSI, BUFFER_LENGTH);
+
 value caml_gammu_GSM_GetModelInfo(value s);
 
 CAML_GAMMU_GSM_TYPE_GET_PROTOTYPE(NetworkInfo);
@@ -385,6 +739,11 @@ static GSM_DateTime *GSM_DateTime_val(
 
 static value Val_GSM_DateTime(GSM_DateTime *date_time);
 
+static long days_from_civil(long y, unsigned int m, unsigned int d);
+
+/* Seconds since 1970-01-01 00:00:00 UTC. */
+static int64_t GSM_DateTime_epoch(GSM_DateTime *date_time);
+
 value caml_gammu_GSM_CheckDate(value vdate);
 
 value caml_gammu_GSM_CheckTime(value vdate);
@@ -393,6 +752,27 @@ value caml_gammu_GSM_OSDate(value vdt);
 
 value caml_gammu_GSM_OSDateTime(value vdt, value vtimezone);
 
+value caml_gammu_datetime_epoch(value vdt);
+
+static void civil_from_days(long z, long *y, unsigned int *m,
+                            unsigned int *d);
+
+static GSM_DateTime *GSM_DateTime_of_epoch(GSM_DateTime *date_time,
+                                           int64_t epoch, int tz_offset);
+
+/* Allocates a [DateTime.stamp]. */
+static value Val_stamp(GSM_DateTime *date_time);
+
+static value format_date_time(GSM_DateTime *date_time, gboolean timezone);
+
+value caml_gammu_datetime_to_stamp(value vdt);
+
+value caml_gammu_datetime_of_stamp(value vstamp);
+
+value caml_gammu_datetime_format(value vdt, value vtimezone);
+
+value caml_gammu_datetime_format_stamp(value vstamp, value vtimezone);
+
 
 /************************************************************************/
 /* Memory */
@@ -449,15 +829,271 @@ static value Val_GSM_MultiSMSMessage(GSM_MultiSMSMessage *multi_sms);
 
 value caml_gammu_GSM_GetSMS(value s, value vlocation, value vfolder);
 
+static void get_next_sms(value s, value vlocation, value vfolder,
+                         value vstart, GSM_MultiSMSMessage *sms);
+
 value caml_gammu_GSM_GetNextSMS(value s, value vlocation, value vfolder,
                                 value vstart);
 
+/* Returns the pair [(stamp, multi_sms)]. */
+value caml_gammu_GSM_GetNextSMS_stamped(value s, value vlocation,
+                                        value vfolder, value vstart);
+
+/* Messages read in bulk, one row per SMS (i.e. per part of multipart
+   messages), each field in its own array.  Row [i] number and text are
+   at offsets [2i .. 2i+1] and [2i+1 .. 2i+2] of [arena]. */
+typedef struct {
+  long count;
+  long capacity;
+  int64_t *time;
+  intnat *state;
+  intnat *folder;
+  intnat *location;
+  intnat *coding;
+  intnat *sms_class;
+  intnat *offsets;              /* 2 * capacity + 1 entries */
+  char *arena;
+  size_t arena_length;
+  size_t arena_capacity;
+} SMS_Columns;
+
+static gboolean sms_columns_init(SMS_Columns *cols);
+
+static gboolean sms_columns_add(SMS_Columns *cols, GSM_SMSMessage *sms);
+
+static void sms_columns_free(SMS_Columns *cols);
+
+value caml_gammu_sms_columns(value s, value vfolder, value vn);
+
+#ifndef CAML_GAMMU_NO_PTHREAD
+/* Message (or error, to be given to [on_err]) read by the prefetcher. */
+typedef struct {
+  GSM_Error error;
+  int location;                 /* Location after which the error occured. */
+  GSM_MultiSMSMessage sms;
+} SMS_Prefetched;
+
+/* Thread reading the messages ahead of Gammu.SMS.fold_prefetch into a
+   bounded queue.  [head], [tail], [done], [stop] and [joined] are
+   protected by [mutex]; [cond] is signalled whenever one of them changes.
+   [state_machine] is set to NULL once the thread is joined by Gammu.free
+   or the finalizer of the state machine. */
+typedef struct SMS_Prefetch {
+  State_Machine *state_machine;
+  int folder;
+  long n;
+  int retries;
+  SMS_Prefetched *queue;
+  long depth;
+  long head;                    /* Next entry to fill (producer). */
+  long tail;                    /* Next entry to read (consumer). */
+  gboolean done;                /* No more entries will be added. */
+  gboolean stop;                /* Asked by the consumer. */
+  gboolean joined;
+  GSM_Error error;              /* Reason of [done], ERR_EMPTY at the end. */
+  /* Statistics, in seconds. */
+  long fetched;
+  double fetch_time;
+  double producer_wait;
+  double consumer_wait;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} SMS_Prefetch;
+
+static void sms_prefetch_join(SMS_Prefetch *prefetch);
+
+/* Join the thread of SMS.fold_prefetch using [state_machine], if any. */
+static void state_machine_stop_prefetch(State_Machine *state_machine);
+#endif
+
+#define SMS_PREFETCH_VAL(v) (*((SMS_Prefetch **) Data_custom_val(v)))
+
+static void caml_gammu_sms_prefetch_finalize(value vprefetch);
+
+static struct custom_operations caml_gammu_sms_prefetch_ops = {
+  "ml-gammu.Gammu.SMS.prefetch",
+  caml_gammu_sms_prefetch_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+value caml_gammu_sms_prefetch_start(value s, value vfolder, value vn,
+                                    value vretries, value vdepth);
+
+value caml_gammu_sms_prefetch_next(value vprefetch);
+
+value caml_gammu_sms_prefetch_stop(value vprefetch);
+
+/* SMS archive file: the magic string then records of ARCHIVE_HEADER bytes
+   followed by the number and the text (UTF-8).  Integers are little-endian.
+   WARNING: must be in sync with the SMS.Archive writer in gammu.ml */
+#define ARCHIVE_MAGIC "GMARCH01"
+#define ARCHIVE_MAGIC_LENGTH 8
+#define ARCHIVE_HEADER 24
+#define ARCHIVE_LENGTH 0        /* u32, length of the whole record */
+#define ARCHIVE_TIME 4          /* i64, seconds since the epoch (UTC) */
+#define ARCHIVE_STATE 12        /* u8 */
+#define ARCHIVE_CODING 13       /* u8 */
+#define ARCHIVE_CLASS 14        /* u8 */
+#define ARCHIVE_FOLDER 15       /* u8 */
+#define ARCHIVE_NUMBER_LENGTH 16 /* u16 */
+#define ARCHIVE_TEXT_LENGTH 20  /* u32 */
+
+/* Index entry of a record. */
+typedef struct {
+  const char *number;           /* In the mapped file. */
+  size_t number_length;
+  int64_t time;
+  long offset;
+} Archive_Key;
+
+/* Archive file mapped in memory (or read, without mmap) with its indexes,
+   sorted by time and by (number, time). */
+typedef struct {
+  char *data;                   /* NULL once closed. */
+  size_t length;
+  gboolean mapped;
+  size_t valid;                 /* Length of the complete records. */
+  long count;
+  Archive_Key *by_time;
+  Archive_Key *by_number;
+} SMS_Archive;
+
+#define SMS_ARCHIVE_VAL(v) (*((SMS_Archive **) Data_custom_val(v)))
+
+static void caml_gammu_archive_finalize(value varchive);
+
+static struct custom_operations caml_gammu_archive_ops = {
+  "ml-gammu.Gammu.SMS.Archive.reader",
+  caml_gammu_archive_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static uint64_t archive_uint(const char *p, int bytes);
+
+static int archive_key_compare_time(const void *k1, const void *k2);
+
+static int archive_key_compare_number(const void *k1, const void *k2);
+
+static void archive_release(SMS_Archive *archive);
+
+value caml_gammu_archive_open(value vpath);
+
+value caml_gammu_archive_close(value varchive);
+
+value caml_gammu_archive_info(value varchive);
+
+value caml_gammu_archive_nth(value varchive, value vi);
+
+value caml_gammu_archive_time(value varchive, value ventry);
+
+value caml_gammu_archive_field(value varchive, value ventry, value vfield);
+
+value caml_gammu_archive_string(value varchive, value ventry, value vtext);
+
+value caml_gammu_archive_range(value varchive, value vnumber, value vfrom,
+                               value vuntil);
+
+/* Messages of a backup file in libGammu format, being written or read.
+   [backup->SMS] is NULL terminated. */
+typedef struct {
+  GSM_SMS_Backup *backup;       /* NULL once freed. */
+  long count;
+  long next;                    /* Next message to read. */
+} SMS_Backup;
+
+#define SMS_BACKUP_VAL(v) (*((SMS_Backup **) Data_custom_val(v)))
+
+static void caml_gammu_sms_backup_finalize(value vbackup);
+
+static struct custom_operations caml_gammu_sms_backup_ops = {
+  "ml-gammu.Gammu.SMS.Backup",
+  caml_gammu_sms_backup_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static void sms_backup_release(SMS_Backup *b);
+
+value caml_gammu_sms_backup_create(value vunit);
+
+value caml_gammu_sms_backup_add(value vbackup, value vsms);
+
+value caml_gammu_sms_backup_write(value vbackup, value vpath);
+
+value caml_gammu_sms_backup_read(value vpath);
+
+value caml_gammu_sms_backup_next(value vbackup);
+
+value caml_gammu_sms_backup_free(value vbackup);
+
 value caml_gammu_GSM_SetSMS(value s, value vsms);
 
 value caml_gammu_GSM_AddSMS(value s, value vsms);
 
 value caml_gammu_GSM_SendSMS(value s, value vsms);
 
+/* Precompiled message: converted once to libGammu representation, only the
+   placeholder characters of [sms.Text] are overwritten for each send. */
+typedef struct {
+  GSM_SMSMessage sms;
+  size_t offset;                /* Placeholder position (in characters). */
+  size_t length;                /* Placeholder length (in characters). */
+} SMS_Template;
+
+#define SMS_TEMPLATE_VAL(v) (*((SMS_Template **) Data_custom_val(v)))
+
+static void caml_gammu_sms_template_finalize(value vtemplate);
+
+static struct custom_operations caml_gammu_sms_template_ops = {
+  "ml-gammu.Gammu.SMS.template",
+  caml_gammu_sms_template_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+value caml_gammu_sms_template(value vsms, value vplaceholder);
+
+value caml_gammu_send_sms_template(value s, value vtemplate, value vnumber,
+                                   value vfill);
+
+static void send_sms_status_callback(GSM_StateMachine *sm, int status,
+                                     int message_reference, void *user_data);
+
+static void drop_pending_sms(State_Machine *state_machine);
+
+static void apply_smsc_cache(State_Machine *state_machine,
+                             GSM_SMSMessage *sms);
+
+static GSM_Error send_sms(State_Machine *state_machine, GSM_SMSMessage *sms,
+                          long *submission);
+
+value caml_gammu_send_sms_async(value s, value vsms);
+
+value caml_gammu_send_sms_result(value s, value vsubmission);
+
+value caml_gammu_sms_in_flight(value s);
+
+value caml_gammu_sms_drop_pending(value s);
+
+value caml_gammu_GSM_GetSMSC(value s, value vlocation);
+
+value caml_gammu_GSM_SetSMSC(value s, value vsmsc);
+
+value caml_gammu_smsc_cached(value s);
+
+value caml_gammu_smsc_clear(value s);
+
 #define OUTBOX(outbox) (Val_int(outbox))
 
 value caml_gammu_GSM_GetSMSFolders(value s);
@@ -514,5 +1150,20 @@ CAML_GAMMU_GSM_SETINCOMING_PROTOTYPES(SMS, GSM_SMSMessage);
 
 CAML_GAMMU_GSM_SETINCOMING_PROTOTYPES(Call, GSM_Call);
 
+static void incoming_push(State_Machine *state_machine, Incoming_Event *event);
+
+static void incoming_push_SMS(State_Machine *state_machine,
+                              GSM_SMSMessage *sms);
+
+static void incoming_push_Call(State_Machine *state_machine, GSM_Call *call);
+
+static Incoming_Event *incoming_pop(State_Machine *state_machine);
+
+static void incoming_free(State_Machine *state_machine);
+
+/* Calls the OCaml callbacks on the events received so far.  Called
+   after each function talking to the phone, with the runtime lock. */
+value caml_gammu_dispatch_incoming(value s);
+
 
 #endif /* __GAMMU_STUBS_H__ */